@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmarks of the hot paths of the library on synthetic archives.
+ *
+ * Usage: ./bench [-f] [-d dir] [-r runs]
+ *   -f       full scale: adds the archives of a million members and of multi-gigabyte members
+ *   -d dir   directory the archives are generated in, /tmp by default
+ *   -r runs  number of warm runs of each operation, 5 by default
+ *
+ * Each archive is generated, timed, then removed. Every measurement is printed as a JSON object on its own line, so
+ * that the output of two revisions can be compared with a script. A cold run first asks the kernel to drop the pages
+ * of the archive from its cache; warm runs follow and report their minimum and median times.
+ */
+
+#define BENCH_MAX_RUNS 64
+#define BENCH_READ_LEN 4096
+#define BENCH_SPARSE_MIN (64 << 20)     /* data of members this large is left as a hole in the archive */
+
+struct bench_profile {
+    const char *name;
+    size_t members;
+    uint64_t size;              /* data size of each member */
+    int depth;                  /* number of directory levels above the members, 0 for a single flat directory */
+    int full;                   /* only generated at full scale */
+};
+
+static const struct bench_profile bench_profiles[] = {
+    { "flat-1-tiny", 1, 64, 0, 0 },
+    { "flat-1k-tiny", 1000, 64, 0, 0 },
+    { "flat-100k-tiny", 100000, 64, 0, 0 },
+    { "deep-100k-tiny", 100000, 64, 5, 0 },
+    { "flat-10k-64k", 10000, 64 << 10, 0, 0 },
+    { "flat-4-3g", 4, 3ULL << 30, 0, 0 },
+    { "flat-1m-empty", 1000000, 0, 0, 1 },
+    { "deep-1m-empty", 1000000, 0, 6, 1 },
+    { "flat-2-9g", 2, 9ULL << 30, 0, 1 },
+};
+
+/* The archive being timed and the paths the lookups are made with. */
+struct bench_archive {
+    const struct bench_profile *profile;
+    char path[PATH_MAX];
+    uint64_t bytes;
+    char last_file[TAR_PATH_MAX + 1];
+    char last_dir[TAR_PATH_MAX + 1];
+};
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_octal(char *field, size_t width, uint64_t value) {
+    for (size_t i = width - 1; i-- > 0; value >>= 3) {
+        field[i] = (char)('0' + (value & 7));
+    }
+    field[width - 1] = '\0';
+}
+
+/* Stores a size, in the GNU base-256 encoding when it does not fit in 11 octal digits. */
+static void bench_size(tar_header_t *header, uint64_t size) {
+    if (size < (1ULL << 33)) {
+        bench_octal(header->size, sizeof(header->size), size);
+        return;
+    }
+    memset(header->size, 0, sizeof(header->size));
+    header->size[0] = (char)0x80;
+    for (size_t i = sizeof(header->size) - 1; i > 0; i--, size >>= 8) {
+        header->size[i] = (char)(size & 0xFF);
+    }
+}
+
+static int bench_write_header(FILE *out, const char *path, char typeflag, uint64_t size) {
+    tar_header_t header;
+    unsigned sum = 0;
+
+    memset(&header, 0, sizeof(header));
+    // The name field needs no terminating null when the path fills it.
+    memcpy(header.name, path, strnlen(path, sizeof(header.name)));
+    bench_octal(header.mode, sizeof(header.mode), typeflag == DIRTYPE ? 0755 : 0644);
+    bench_octal(header.uid, sizeof(header.uid), 0);
+    bench_octal(header.gid, sizeof(header.gid), 0);
+    bench_size(&header, size);
+    bench_octal(header.mtime, sizeof(header.mtime), 1700000000);
+    header.typeflag = typeflag;
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    for (size_t i = 0; i < sizeof(header); i++) {
+        sum += ((const uint8_t *)&header)[i];
+    }
+    bench_octal(header.chksum, sizeof(header.chksum) - 1, sum);
+    header.chksum[sizeof(header.chksum) - 1] = ' ';
+
+    return fwrite(&header, sizeof(header), 1, out) == 1 ? 0 : -1;
+}
+
+static int bench_write_data(FILE *out, uint64_t size) {
+    static const char pattern[TAR_HEADER_SIZE] = "0123456789abcdef";
+    uint64_t padded = (size + TAR_HEADER_SIZE - 1) / TAR_HEADER_SIZE * TAR_HEADER_SIZE;
+
+    if (size >= BENCH_SPARSE_MIN) {
+        return fseeko(out, (off_t)padded, SEEK_CUR);
+    }
+    for (uint64_t done = 0; done < padded; done += TAR_HEADER_SIZE) {
+        if (fwrite(pattern, TAR_HEADER_SIZE, 1, out) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the directory of member i into dir. Members of deep trees are spread ten per directory, in directories
+ * nested depth levels deep and named after the digits of i / 10.
+ */
+static void bench_member_dir(const struct bench_profile *profile, size_t i, char *dir) {
+    size_t len = (size_t)sprintf(dir, "bench/");
+    size_t group = i / 10;
+    char digits[24];
+    int n = sprintf(digits, "%0*zu", profile->depth, group);
+
+    // Digits beyond the depth of the tree all go to the last level.
+    for (int level = 0; level < profile->depth; level++) {
+        int width = level == profile->depth - 1 ? n - level : 1;
+        len += (size_t)sprintf(dir + len, "d%.*s/", width, digits + level);
+    }
+}
+
+/* Generates the archive of a profile. Directory headers are written before the first member they contain. */
+static int bench_generate(struct bench_archive *archive) {
+    const struct bench_profile *profile = archive->profile;
+    char dir[TAR_PATH_MAX + 1], previous[TAR_PATH_MAX + 1] = "";
+    FILE *out = fopen(archive->path, "w");
+    static const char zeros[2 * TAR_HEADER_SIZE];
+
+    if (out == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < profile->members; i++) {
+        bench_member_dir(profile, i, dir);
+
+        // Every directory of the new path which is not one of the previous path is new, as members come in order.
+        for (size_t len = 1; dir[len - 1] != '\0'; len++) {
+            if (dir[len - 1] == '/' && strncmp(dir, previous, len) != 0) {
+                char parent[TAR_PATH_MAX + 1];
+
+                memcpy(parent, dir, len);
+                parent[len] = '\0';
+                if (bench_write_header(out, parent, DIRTYPE, 0) == -1) {
+                    fclose(out);
+                    return -1;
+                }
+            }
+        }
+        strcpy(previous, dir);
+
+        if (snprintf(archive->last_file, sizeof(archive->last_file), "%sf%zu", dir, i) >=
+                (int)sizeof(archive->last_file) ||
+            bench_write_header(out, archive->last_file, REGTYPE, profile->size) == -1 ||
+            bench_write_data(out, profile->size) == -1) {
+            fclose(out);
+            return -1;
+        }
+    }
+    strcpy(archive->last_dir, previous);
+
+    if (fwrite(zeros, sizeof(zeros), 1, out) != 1 || fflush(out) == EOF || fsync(fileno(out)) == -1) {
+        fclose(out);
+        return -1;
+    }
+    archive->bytes = (uint64_t)ftello(out);
+    return fclose(out);
+}
+
+/* Asks the kernel to evict the pages of the archive, for a cold run. */
+static void bench_drop_cache(int fd) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static long bench_check_archive(int fd, const struct bench_archive *archive) {
+    (void)archive;
+    return check_archive(fd);
+}
+
+static long bench_exists(int fd, const struct bench_archive *archive) {
+    return exists(fd, (char *)archive->last_file);
+}
+
+static long bench_list(int fd, const struct bench_archive *archive) {
+    static char buffers[16][TAR_PATH_MAX + 1];
+    char *entries[16];
+    size_t no_entries = 16;
+
+    for (int i = 0; i < 16; i++) {
+        entries[i] = buffers[i];
+    }
+    return list(fd, (char *)archive->last_dir, entries, &no_entries) == 1 ? (long)no_entries : -1;
+}
+
+static long bench_read_file(int fd, const struct bench_archive *archive) {
+    static uint8_t dest[BENCH_READ_LEN];
+    size_t len = sizeof(dest);
+    // Reads the end of large members, so that reaching the data is part of the cost.
+    size_t offset = archive->profile->size > sizeof(dest) ? archive->profile->size - sizeof(dest) : 0;
+
+    ssize_t ret = read_file(fd, (char *)archive->last_file, offset, dest, &len);
+
+    return ret < 0 ? (long)ret : (long)len;
+}
+
+static long bench_index(int fd, const struct bench_archive *archive) {
+    tar_index_t *index = tar_index_build(fd);
+    long ret = index != NULL && exists_index(index, archive->last_file) ? 1 : -1;
+
+    tar_index_free(index);
+    return ret;
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_time(const struct bench_archive *archive, int fd, const char *op,
+                       long (*run)(int, const struct bench_archive *), int runs) {
+    uint64_t times[BENCH_MAX_RUNS], start, cold;
+    long result;
+
+    bench_drop_cache(fd);
+    start = bench_now_ns();
+    result = run(fd, archive);
+    cold = bench_now_ns() - start;
+    printf("{\"archive\": \"%s\", \"members\": %zu, \"bytes\": %llu, \"op\": \"%s\", \"cache\": \"cold\", "
+           "\"runs\": 1, \"min_ns\": %llu, \"median_ns\": %llu, \"result\": %ld}\n",
+           archive->profile->name, archive->profile->members, (unsigned long long)archive->bytes, op,
+           (unsigned long long)cold, (unsigned long long)cold, result);
+
+    for (int i = 0; i < runs; i++) {
+        start = bench_now_ns();
+        result = run(fd, archive);
+        times[i] = bench_now_ns() - start;
+    }
+    qsort(times, (size_t)runs, sizeof(times[0]), bench_cmp_u64);
+    printf("{\"archive\": \"%s\", \"members\": %zu, \"bytes\": %llu, \"op\": \"%s\", \"cache\": \"warm\", "
+           "\"runs\": %d, \"min_ns\": %llu, \"median_ns\": %llu, \"result\": %ld}\n",
+           archive->profile->name, archive->profile->members, (unsigned long long)archive->bytes, op, runs,
+           (unsigned long long)times[0], (unsigned long long)times[runs / 2], result);
+    fflush(stdout);
+}
+
+/* Compares the decoding of size fields by TAR_INT() and tar_field_to_u64(). */
+static void bench_fields(void) {
+    enum { FIELDS = 4096, ROUNDS = 2000 };
+    static char fields[FIELDS][12];
+    volatile uint64_t sink = 0;
+    uint64_t seed = 88172645463325252ULL, start, elapsed;
+
+    for (size_t i = 0; i < FIELDS; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        bench_octal(fields[i], sizeof(fields[i]), seed & ((1ULL << 33) - 1));
+    }
+
+    start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < FIELDS; i++) {
+            sink += (uint64_t)TAR_INT(fields[i]);
+        }
+    }
+    elapsed = bench_now_ns() - start;
+    printf("{\"op\": \"TAR_INT\", \"fields\": %d, \"ns_per_field\": %.3f}\n", FIELDS * ROUNDS,
+           (double)elapsed / (FIELDS * ROUNDS));
+
+    start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < FIELDS; i++) {
+            sink += tar_field_to_u64(fields[i], sizeof(fields[i]));
+        }
+    }
+    elapsed = bench_now_ns() - start;
+    printf("{\"op\": \"tar_field_to_u64\", \"fields\": %d, \"ns_per_field\": %.3f}\n", FIELDS * ROUNDS,
+           (double)elapsed / (FIELDS * ROUNDS));
+    (void)sink;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "/tmp";
+    int full = 0, runs = 5, opt;
+
+    while ((opt = getopt(argc, argv, "fd:r:")) != -1) {
+        switch (opt) {
+        case 'f':
+            full = 1;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f] [-d dir] [-r runs]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (runs < 1 || runs > BENCH_MAX_RUNS) {
+        fprintf(stderr, "The number of runs must be between 1 and %d\n", BENCH_MAX_RUNS);
+        return -1;
+    }
+
+    bench_fields();
+
+    for (size_t p = 0; p < sizeof(bench_profiles) / sizeof(bench_profiles[0]); p++) {
+        struct bench_archive archive = { .profile = &bench_profiles[p] };
+        int fd;
+
+        if (archive.profile->full && !full) {
+            continue;
+        }
+        snprintf(archive.path, sizeof(archive.path), "%s/bench-%s.tar", dir, archive.profile->name);
+        if (bench_generate(&archive) == -1) {
+            perror("Could not generate the archive");
+            unlink(archive.path);
+            return -1;
+        }
+        fd = open(archive.path, O_RDONLY);
+        if (fd == -1) {
+            perror("open(archive)");
+            unlink(archive.path);
+            return -1;
+        }
+
+        bench_time(&archive, fd, "check_archive", bench_check_archive, runs);
+        bench_time(&archive, fd, "exists", bench_exists, runs);
+        bench_time(&archive, fd, "list", bench_list, runs);
+        bench_time(&archive, fd, "read_file", bench_read_file, runs);
+        bench_time(&archive, fd, "tar_index_build", bench_index, runs);
+
+        close(fd);
+        unlink(archive.path);
+    }
+    return 0;
+}
@@ -1,369 +1,6454 @@
+#define _GNU_SOURCE
 #include "lib_tar.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
+/*
+ * Instrumentation.
+ *
+ * TAR_COUNT() adds to a counter of the calling thread. A traced public function opens a scope with TAR_TRACE_BEGIN(),
+ * which records the time and the counters, and closes it with TAR_TRACE_END(), which charges the elapsed time to the
+ * function and reports the call to the trace hook. All three compile to nothing without TAR_STATS.
+ */
+
+static const char *const tar_op_names[TAR_OP_COUNT] = {
+    "check_archive", "exists", "is_dir", "is_file", "is_symlink", "list", "read_file", "tar_index_build",
+    "tar_index_update", "exists_index", "is_dir_index", "is_file_index", "is_symlink_index", "list_index",
+    "read_file_index", "check_archive_parallel", "tar_open_mmap", "tar_mmap_header", "read_file_view", "tar_iter_open",
+    "tar_iter_next", "read_files_batch", "read_files_batch_index", "tar_stream_open", "tar_stream_open_index",
+    "tar_stream_read", "tar_stream_seek", "tar_async_read", "tar_async_submit", "tar_async_wait", "tar_index_save",
+    "tar_index_load", "tar_index_select", "tar_open_compressed", "read_file_compressed", "tar_extract_all",
+    "tar_writer_add_file", "tar_writer_add_dir", "tar_writer_add_symlink", "tar_writer_close", "list_arena",
+    "list_index_arena", "tar_index_select_arena", "list_recursive", "find", "list_recursive_index", "find_index",
+    "tar_index_open_shared", "tar_index_prefetch", "tar_index_validate", "tar_index_hash_contents",
+    "tar_index_content_hash", "tar_catalog_add", "tar_catalog_which", "exists_catalog", "is_dir_catalog",
+    "is_file_catalog", "is_symlink_catalog", "read_file_catalog",
+};
+
+const char *tar_op_name(enum tar_op op) {
+    return (unsigned)op < TAR_OP_COUNT ? tar_op_names[op] : "unknown";
+}
+
+#ifdef TAR_STATS
+
+static __thread tar_stats_t tar_stats;
+static tar_trace_cb_t tar_trace_callback;
+static void *tar_trace_arg;
+
+struct tar_trace_scope {
+    struct timespec start;
+    tar_counters_t counters;
+};
+
+#define TAR_COUNT(counter, n) (tar_stats.counters.counter += (uint64_t)(n))
+#define TAR_TRACE_BEGIN(scope) \
+    struct tar_trace_scope scope; \
+    tar_trace_begin(&scope)
+#define TAR_TRACE_END(scope, op, path, ret) tar_trace_end(&scope, op, path, (long)(ret))
+
+static void tar_trace_begin(struct tar_trace_scope *scope) {
+    scope->counters = tar_stats.counters;
+    clock_gettime(CLOCK_MONOTONIC, &scope->start);
+}
+
+static void tar_trace_end(struct tar_trace_scope *scope, enum tar_op op, const char *path, long ret) {
+    int saved_errno = errno;
+    struct timespec end;
+    tar_trace_event_t event;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    event.op = op;
+    event.path = path;
+    event.ret = ret;
+    event.ns = (uint64_t)(end.tv_sec - scope->start.tv_sec) * 1000000000ULL + (uint64_t)end.tv_nsec -
+               (uint64_t)scope->start.tv_nsec;
+    event.counters.headers_scanned = tar_stats.counters.headers_scanned - scope->counters.headers_scanned;
+    event.counters.bytes_read = tar_stats.counters.bytes_read - scope->counters.bytes_read;
+    event.counters.syscalls = tar_stats.counters.syscalls - scope->counters.syscalls;
+    event.counters.seeks = tar_stats.counters.seeks - scope->counters.seeks;
+    event.counters.index_hits = tar_stats.counters.index_hits - scope->counters.index_hits;
+    event.counters.index_misses = tar_stats.counters.index_misses - scope->counters.index_misses;
+
+    tar_stats.calls[op]++;
+    tar_stats.ns[op] += event.ns;
+    if (tar_trace_callback != NULL) {
+        tar_trace_callback(&event, tar_trace_arg);
+    }
+    errno = saved_errno;
+}
+
+void tar_stats_get(tar_stats_t *stats) {
+    *stats = tar_stats;
+}
+
+void tar_stats_reset(void) {
+    memset(&tar_stats, 0, sizeof(tar_stats));
+}
+
+int tar_set_trace(tar_trace_cb_t callback, void *arg) {
+    tar_trace_arg = arg;
+    tar_trace_callback = callback;
+    return 0;
+}
+
+#else
+
+#define TAR_COUNT(counter, n) ((void)0)
+#define TAR_TRACE_BEGIN(scope) ((void)0)
+#define TAR_TRACE_END(scope, op, path, ret) ((void)0)
+
+void tar_stats_get(tar_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void tar_stats_reset(void) {
+}
+
+int tar_set_trace(tar_trace_cb_t callback, void *arg) {
+    (void)callback;
+    (void)arg;
+    errno = ENOSYS;
+    return -1;
+}
 
+#endif
+
+#define TAR_ONES 0x0101010101010101ULL
+
+/* Loads 8 bytes as a little-endian word, so that the first byte is the lowest. */
+static uint64_t tar_load_le64(const uint8_t *bytes) {
+    uint64_t word;
+
+    memcpy(&word, bytes, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/*
+ * Decodes the run of octal digits at the start of a word of 8 bytes, eight digits at a time. Returns the number of
+ * digits in the run and stores their value in value.
+ */
+static inline unsigned tar_octal8(uint64_t word, uint64_t *value) {
+    // A byte is an octal digit when its upper five bits are those of '0': flag the bytes that are not.
+    uint64_t other = (word & 0xF8 * TAR_ONES) ^ (0x30 * TAR_ONES);
+    uint64_t flags = (((other & 0x7F * TAR_ONES) + 0x7F * TAR_ONES) | other) & 0x80 * TAR_ONES;
+    unsigned digits = flags ? (unsigned)__builtin_ctzll(flags) / 8 : 8;
+
+    if (digits == 0) {
+        *value = 0;
+        return 0;
+    }
+
+    // Move the digits to the top bytes, so that the last one has the lowest weight, then fold pairs of lanes.
+    word = (word - 0x30 * TAR_ONES) << (8 * (8 - digits));
+    word = (word * 8 + (word >> 8)) & 0x00FF00FF00FF00FFULL;
+    word = (word * 64 + (word >> 16)) & 0x0000FFFF0000FFFFULL;
+    word = (word * 4096 + (word >> 32)) & 0xFFFFFFFFULL;
+    *value = word;
+    return digits;
+}
 
 /**
- * Checks whether the archive is valid.
+ * Decodes a numeric header field.
+ */
+uint64_t tar_field_to_u64(const char *field, size_t width) {
+    const uint8_t *bytes = (const uint8_t *)field;
+    uint64_t value = 0, chunk;
+    size_t start = 0;
+
+    if (width > 16) {
+        width = 16;
+    }
+    if (width > 0 && (bytes[0] & 0x80)) {
+        // GNU base-256: the remaining bits are a big-endian two's complement number.
+        if (bytes[0] & 0x40) {
+            return 0; // Negative, no valid size or mode.
+        }
+        value = bytes[0] & 0x3F;
+        for (size_t i = 1; i < width; i++) {
+            if (value >> 56) {
+                return UINT64_MAX;
+            }
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    // Some writers right-align the digits with leading spaces.
+    while (start < width && bytes[start] == ' ') {
+        start++;
+    }
+    bytes += start;
+    width -= start;
+    if (width < 8) {
+        uint8_t buf[8] = { 0 };
+
+        memcpy(buf, bytes, width);
+        tar_octal8(tar_load_le64(buf), &value);
+        return value;
+    }
+
+    // The digits end at the first byte which is not one, at the latest at the end of the field. The last word is
+    // loaded from the end of the field and shifted down, so that no byte past the field is read.
+    for (size_t i = 0;; i += 8) {
+        uint64_t word = i + 8 <= width ? tar_load_le64(bytes + i)
+                                       : tar_load_le64(bytes + width - 8) >> (8 * (i + 8 - width));
+        unsigned digits = tar_octal8(word, &chunk);
+
+        value = (value << (3 * digits)) | chunk;
+        if (digits < 8 || i + 8 >= width) {
+            return value;
+        }
+    }
+}
+
+/* Rounds a data size up to the number of bytes it occupies in the archive. */
+static uint64_t tar_padded_size(uint64_t size) {
+    return ((size + TAR_HEADER_SIZE - 1) / TAR_HEADER_SIZE) * TAR_HEADER_SIZE;
+}
+
+/*
+ * Reads len bytes at the given offset without moving the offset of the file descriptor, retrying on interruptions
+ * and short reads. Returns the number of bytes read, which is short only at the end of the file, or -1 on error.
+ */
+static ssize_t tar_pread(int fd, void *dest, size_t len, off_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, (uint8_t *)dest + done, len - done, offset + (off_t)done);
+
+        TAR_COUNT(syscalls, 1);
+        if (n > 0) {
+            TAR_COUNT(bytes_read, n);
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/*
+ * Writes the full path of a header into path, which must hold TAR_PATH_MAX + 1 bytes: the ustar prefix, if any,
+ * followed by a '/' and the name. Returns the length of the path.
+ */
+static size_t tar_header_path(const tar_header_t *header, char *path) {
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    size_t prefix_len = 0;
+
+    // Only ustar headers have a prefix: older formats use the same bytes for other fields.
+    if (memcmp(header->magic, TMAGIC, TMAGLEN) == 0) {
+        prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    }
+    if (prefix_len > 0) {
+        memcpy(path, header->prefix, prefix_len);
+        path[prefix_len++] = '/';
+    }
+    memcpy(path + prefix_len, header->name, name_len);
+    path[prefix_len + name_len] = '\0';
+    return prefix_len + name_len;
+}
+
+static int tar_is_regular(char typeflag) {
+    return typeflag == REGTYPE || typeflag == AREGTYPE;
+}
+
+static int tar_is_link(char typeflag) {
+    return typeflag == SYMTYPE || typeflag == LNKTYPE;
+}
+
+/*
+ * Computes the normalized archive path a link points to into target, which must hold PATH_MAX bytes.
  *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
+ * The linkname of a hard link is a path from the root of the archive, that of a symlink is relative to the directory
+ * containing it unless it starts with a '/'. "." and ".." components are resolved, and ".." never goes above the root
+ * of the archive. Returns the length of the target, or -1 if it does not fit.
+ */
+static ssize_t tar_link_target(const char *path, size_t path_len, char typeflag, const char *linkname,
+                               size_t linkname_len, char *target) {
+    size_t len = 0;
+
+    if (typeflag == SYMTYPE && (linkname_len == 0 || linkname[0] != '/')) {
+        // Keep the directory of the link, that is everything up to the last '/' before its last component.
+        if (path_len > 0 && path[path_len - 1] == '/') {
+            path_len--;
+        }
+        while (path_len > 0 && path[path_len - 1] != '/') {
+            path_len--;
+        }
+        if (path_len >= PATH_MAX) {
+            return -1;
+        }
+        memcpy(target, path, path_len);
+        len = path_len;
+    }
+
+    for (size_t i = 0; i < linkname_len;) {
+        size_t end = i;
+
+        while (end < linkname_len && linkname[end] != '/') {
+            end++;
+        }
+        size_t component_len = end - i;
+
+        if (component_len == 2 && linkname[i] == '.' && linkname[i + 1] == '.') {
+            // Drop the last component of what has been built so far.
+            if (len > 0) {
+                len--;
+            }
+            while (len > 0 && target[len - 1] != '/') {
+                len--;
+            }
+        } else if (component_len > 0 && !(component_len == 1 && linkname[i] == '.')) {
+            if (len + component_len + 1 >= PATH_MAX) {
+                return -1;
+            }
+            memcpy(target + len, linkname + i, component_len);
+            len += component_len;
+            target[len++] = '/';
+        }
+        i = end + 1;
+    }
+
+    // Components are built with a trailing '/', which is not part of the path.
+    if (len > 0) {
+        len--;
+    }
+    target[len] = '\0';
+    return (ssize_t)len;
+}
+
+
+/*
+ * Long names.
  *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * Paths and link targets which do not fit in a ustar header are stored in an extra header placed before the header of
+ * the member they apply to: a pax extended header, whose "path", "linkpath" and "size" records override the fields of
+ * the member, or a GNU ././@LongLink header, whose data is the path or the link target itself. Scanning decodes the
+ * full path, link target and size of each member once, as it reads its headers, so that finding an entry only compares
+ * complete paths.
+ */
+
+#define TAR_EXTRA_MAX (1 << 20)     /* extra headers with more data than this are skipped */
+
+/* The decoded fields of a member, and the overrides read from extra headers for the next member. */
+struct tar_member {
+    char path[PATH_MAX];
+    char link[PATH_MAX];        /* link target for links, empty otherwise */
+    size_t path_len;
+    size_t link_len;
+    uint64_t size;
+    int has_path, has_link, has_size;
+};
+
+static int tar_is_extra(char typeflag) {
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK;
+}
+
+/* Stores a path given by an extra header, unless it is too long to be looked up. */
+static int tar_member_set(char *dest, size_t *dest_len, const uint8_t *value, size_t len) {
+    if (len == 0 || len >= PATH_MAX) {
+        return 0;
+    }
+    memcpy(dest, value, len);
+    dest[len] = '\0';
+    *dest_len = len;
+    return 1;
+}
+
+/* Parses the "<length> <key>=<value>\n" records of a pax extended header. */
+static void tar_member_pax(struct tar_member *member, const uint8_t *data, size_t size) {
+    size_t offset = 0;
+
+    while (offset < size) {
+        size_t record_len = 0, i = offset;
+
+        while (i < size && data[i] >= '0' && data[i] <= '9' && record_len <= size) {
+            record_len = record_len * 10 + (size_t)(data[i++] - '0');
+        }
+        if (i == offset || i >= size || data[i] != ' ' || record_len > size - offset ||
+            offset + record_len <= i + 1 || data[offset + record_len - 1] != '\n') {
+            return; // Malformed: ignore the rest.
+        }
+
+        const uint8_t *key = data + i + 1, *end = data + offset + record_len - 1;
+        const uint8_t *equals = memchr(key, '=', (size_t)(end - key));
+        offset += record_len;
+        if (equals == NULL) {
+            continue;
+        }
+        size_t key_len = (size_t)(equals - key), value_len = (size_t)(end - equals - 1);
+
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            member->has_path = tar_member_set(member->path, &member->path_len, equals + 1, value_len);
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            member->has_link = tar_member_set(member->link, &member->link_len, equals + 1, value_len);
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0 && value_len > 0 && value_len < 20) {
+            uint64_t value = 0;
+            size_t j;
+
+            for (j = 0; j < value_len && equals[1 + j] >= '0' && equals[1 + j] <= '9'; j++) {
+                value = value * 10 + (uint64_t)(equals[1 + j] - '0');
+            }
+            if (j == value_len) {
+                member->size = value;
+                member->has_size = 1;
+            }
+        }
+    }
+}
+
+/* Records the overrides given by the data of an extra header for the next member. */
+static void tar_member_extra(struct tar_member *member, char typeflag, const uint8_t *data, size_t size) {
+    switch (typeflag) {
+    case XHDTYPE:
+        tar_member_pax(member, data, size);
+        break;
+    case GNUTYPE_LONGNAME:
+        member->has_path = tar_member_set(member->path, &member->path_len, data, strnlen((const char *)data, size));
+        break;
+    case GNUTYPE_LONGLINK:
+        member->has_link = tar_member_set(member->link, &member->link_len, data, strnlen((const char *)data, size));
+        break;
+    default:
+        break; // Global pax headers hold no path of a member.
+    }
+}
+
+/* Decodes the member of a header, taking the fields no extra header overrode from the header itself. */
+static void tar_member_finish(struct tar_member *member, const tar_header_t *header) {
+    if (!member->has_path) {
+        member->path_len = tar_header_path(header, member->path);
+    }
+    if (!member->has_link) {
+        member->link_len = tar_is_link(header->typeflag) ? strnlen(header->linkname, sizeof(header->linkname)) : 0;
+        memcpy(member->link, header->linkname, member->link_len);
+        member->link[member->link_len] = '\0';
+    }
+    if (!member->has_size) {
+        member->size = tar_field_to_u64(header->size, sizeof(header->size));
+    }
+    member->has_path = member->has_link = member->has_size = 0;
+}
+
+/* Computes the path a link member points to. See tar_link_target(). */
+static ssize_t tar_member_link_target(const struct tar_member *member, char typeflag, char *target) {
+    return tar_link_target(member->path, member->path_len, typeflag, member->link, member->link_len, target);
+}
+
+/* Compares the path of a member to a path which may lack the trailing '/' of a directory when or_dir is set. */
+static int tar_member_is(const struct tar_member *member, const char *path, size_t path_len, int or_dir) {
+    if (member->path_len == path_len) {
+        return memcmp(member->path, path, path_len) == 0;
+    }
+    return or_dir && member->path_len == path_len + 1 && member->path[path_len] == '/' &&
+           memcmp(member->path, path, path_len) == 0;
+}
+
+
+/*
+ * Arena allocator.
  *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * Allocations are carved one after the other from the head block, and a new regular block becomes the head once it is
+ * full. An allocation larger than a quarter of a block gets a block of its own, chained behind the head so that the
+ * room left in the head is not lost. Listings into an arena go through a sink which either copies paths into the
+ * buffers of the caller, within their number, or appends them to an array grown from the arena.
+ */
+
+#define TAR_ARENA_ALIGN 16
+
+struct tar_arena_block {
+    struct tar_arena_block *next;
+    size_t size;
+    _Alignas(TAR_ARENA_ALIGN) unsigned char data[];
+};
+
+struct tar_arena {
+    struct tar_arena_block *head;
+    size_t used;            /* bytes taken from the head block */
+    size_t block_size;
+};
+
+/* Allocates a block with room for size bytes. */
+static struct tar_arena_block *tar_arena_block_new(size_t size) {
+    if (size > SIZE_MAX - sizeof(struct tar_arena_block)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct tar_arena_block *block = malloc(sizeof(*block) + size);
+
+    if (block != NULL) {
+        block->size = size;
+    }
+    return block;
+}
+
+/**
+ * Creates an arena.
+ */
+tar_arena_t *tar_arena_create(size_t block_size) {
+    tar_arena_t *arena = calloc(1, sizeof(*arena));
+
+    if (arena == NULL) {
+        return NULL;
+    }
+    block_size = block_size ? block_size : TAR_ARENA_DEFAULT_BLOCK;
+    arena->block_size = (block_size + TAR_ARENA_ALIGN - 1) & ~(size_t)(TAR_ARENA_ALIGN - 1);
+    return arena;
+}
+
+/**
+ * Allocates memory from the arena.
+ */
+void *tar_arena_alloc(tar_arena_t *arena, size_t size) {
+    struct tar_arena_block *block;
+
+    if (size > SIZE_MAX - TAR_ARENA_ALIGN) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = size ? (size + TAR_ARENA_ALIGN - 1) & ~(size_t)(TAR_ARENA_ALIGN - 1) : TAR_ARENA_ALIGN;
+
+    if (arena->head != NULL && arena->head->size - arena->used >= size) {
+        void *ptr = arena->head->data + arena->used;
+
+        arena->used += size;
+        return ptr;
+    }
+    if (size > arena->block_size / 4) {
+        if ((block = tar_arena_block_new(size)) == NULL) {
+            return NULL;
+        }
+        if (arena->head != NULL) {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = NULL;
+            arena->head = block;
+            arena->used = size;
+        }
+        return block->data;
+    }
+    if ((block = tar_arena_block_new(arena->block_size)) == NULL) {
+        return NULL;
+    }
+    block->next = arena->head;
+    arena->head = block;
+    arena->used = size;
+    return block->data;
+}
+
+/**
+ * Copies a string into the arena.
+ */
+char *tar_arena_strndup(tar_arena_t *arena, const char *string, size_t len) {
+    char *copy = tar_arena_alloc(arena, len + 1);
+
+    if (copy != NULL) {
+        memcpy(copy, string, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * Frees everything allocated from the arena, keeping one block.
+ */
+void tar_arena_reset(tar_arena_t *arena) {
+    struct tar_arena_block *block = arena->head, *kept = NULL;
+
+    while (block != NULL) {
+        struct tar_arena_block *next = block->next;
+
+        if (kept == NULL && block->size == arena->block_size) {
+            kept = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    if (kept != NULL) {
+        kept->next = NULL;
+    }
+    arena->head = kept;
+    arena->used = 0;
+}
+
+/**
+ * Releases an arena and everything allocated from it.
+ */
+void tar_arena_destroy(tar_arena_t *arena) {
+    int saved_errno = errno;
+
+    if (arena == NULL) {
+        return;
+    }
+    while (arena->head != NULL) {
+        struct tar_arena_block *next = arena->head->next;
+
+        free(arena->head);
+        arena->head = next;
+    }
+    free(arena);
+    errno = saved_errno;
+}
+
+/* Where a listing puts the paths it finds: the buffers of the caller, or an array grown from an arena. */
+struct tar_list_sink {
+    char **entries;         /* buffers of the caller, when arena is NULL */
+    tar_arena_t *arena;
+    const char **paths;     /* array allocated from the arena */
+    int copy;               /* whether paths added to the arena array are copied into the arena */
+    size_t count, capacity;
+};
+
+/* Makes room in the arena array of a sink for at least capacity paths. */
+static int tar_list_sink_reserve(struct tar_list_sink *sink, size_t capacity) {
+    if (capacity <= sink->capacity) {
+        return 0;
+    }
+    if (capacity > SIZE_MAX / sizeof(*sink->paths)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    const char **paths = tar_arena_alloc(sink->arena, capacity * sizeof(*paths));
+
+    if (paths == NULL) {
+        return -1;
+    }
+    if (sink->count > 0) {
+        memcpy(paths, sink->paths, sink->count * sizeof(*paths));
+    }
+    sink->paths = paths;
+    sink->capacity = capacity;
+    return 0;
+}
+
+/* Adds a path to a sink. Paths beyond the buffers of the caller are dropped, as list() does. */
+static int tar_list_sink_add(struct tar_list_sink *sink, const char *path, size_t len) {
+    if (sink->arena == NULL) {
+        if (sink->count < sink->capacity) {
+            memcpy(sink->entries[sink->count], path, len);
+            sink->entries[sink->count][len] = '\0';
+            sink->count++;
+        }
+        return 0;
+    }
+    if (sink->count == sink->capacity && tar_list_sink_reserve(sink, sink->capacity ? 2 * sink->capacity : 64) == -1) {
+        return -1;
+    }
+    if (sink->copy && (path = tar_arena_strndup(sink->arena, path, len)) == NULL) {
+        return -1;
+    }
+    sink->paths[sink->count++] = path;
+    return 0;
+}
+
+
+/*
+ * Buffered header scanner.
+ *
+ * Rather than one read() per header and one lseek() per data region, the scanner reads the archive in large chunks
+ * and walks the headers inside the buffer. It only reads again when the next header lies past the buffered region.
+ * All reads are positional pread() calls: scanning never moves the offset of the file descriptor, so that several
+ * threads can scan the same descriptor at once.
+ *
+ * Each refill is sized after the previous one: when the next header was found right after the buffer (many small
+ * members), the read size doubles up to the configured chunk size; when it was far past it (large members), it halves,
+ * so that archives of big files do not pay for a chunk of data per header.
+ */
+
+#define TAR_SCAN_MIN_READ (8 * TAR_HEADER_SIZE)
+
+static size_t tar_scan_chunk_size = TAR_SCAN_DEFAULT_CHUNK_SIZE;
+static int tar_lazy_validation;
+
+struct tar_scanner {
+    int fd;
+    uint8_t *buf;
+    size_t capacity;
+    size_t read_size;
+    off_t buf_offset;           /* archive offset of buf[0] */
+    size_t buf_len;             /* number of valid bytes in buf */
+    off_t next;                 /* offset of the next header */
+    struct tar_member member;   /* the member of the last header, once decoded */
+    tar_header_t extra;         /* copy of the last header when it is an extra header, whose data was read */
+    int verify;                 /* headers are checked as they are walked, see tar_set_lazy_validation() */
+};
+
+/**
+ * Sets the size of the chunks read by the functions that scan the archive.
+ */
+void tar_set_scan_chunk_size(size_t size) {
+    if (size < TAR_SCAN_MIN_READ) {
+        size = TAR_SCAN_MIN_READ;
+    }
+    tar_scan_chunk_size = size - size % TAR_HEADER_SIZE;
+}
+
+/**
+ * Enables or disables the checking of headers as they are walked.
+ */
+void tar_set_lazy_validation(int enabled) {
+    tar_lazy_validation = enabled != 0;
+}
+
+static int tar_scanner_open(struct tar_scanner *scanner, int tar_fd) {
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->fd = tar_fd;
+    scanner->capacity = tar_scan_chunk_size;
+    scanner->read_size = scanner->capacity;
+    scanner->verify = tar_lazy_validation;
+    scanner->buf = malloc(scanner->capacity);
+    if (scanner->buf == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static void tar_scanner_close(struct tar_scanner *scanner) {
+    free(scanner->buf);
+}
+
+/* Reads the chunk starting at the given offset into the buffer. */
+static int tar_scanner_fill(struct tar_scanner *scanner, off_t offset) {
+    off_t buf_end = scanner->buf_offset + (off_t)scanner->buf_len;
+    ssize_t bytes_read;
+
+    if (scanner->buf_len > 0 && offset == buf_end) {
+        if (scanner->read_size < scanner->capacity) {
+            size_t doubled = scanner->read_size * 2;
+            scanner->read_size = doubled < scanner->capacity ? doubled : scanner->capacity;
+        }
+    } else if (scanner->buf_len > 0 && scanner->read_size > TAR_SCAN_MIN_READ) {
+        scanner->read_size /= 2;
+    }
+    if (scanner->buf_len > 0 && offset != buf_end) {
+        TAR_COUNT(seeks, 1);
+    }
+
+    do {
+        bytes_read = pread(scanner->fd, scanner->buf, scanner->read_size, offset);
+        TAR_COUNT(syscalls, 1);
+    } while (bytes_read == -1 && errno == EINTR);
+    if (bytes_read == -1) {
+        return -1;
+    }
+    TAR_COUNT(bytes_read, bytes_read);
+
+    scanner->buf_offset = offset;
+    scanner->buf_len = (size_t)bytes_read;
+    return 0;
+}
+
+/**
+ * Reads len bytes at the given archive offset, from the buffer when they are in it.
+ *
+ * @return the number of bytes read, -1 on error.
+ */
+static ssize_t tar_scanner_read(struct tar_scanner *scanner, off_t offset, uint8_t *dest, size_t len) {
+    off_t buf_end = scanner->buf_offset + (off_t)scanner->buf_len;
+    size_t copied = 0;
+
+    if (offset >= scanner->buf_offset && offset < buf_end) {
+        copied = (size_t)(buf_end - offset);
+        if (copied > len) {
+            copied = len;
+        }
+        memcpy(dest, scanner->buf + (offset - scanner->buf_offset), copied);
+        offset += (off_t)copied;
+    }
+
+    if (copied < len) {
+        ssize_t bytes_read = tar_pread(scanner->fd, dest + copied, len - copied, offset);
+        if (bytes_read == -1) {
+            return -1;
+        }
+        copied += (size_t)bytes_read;
+    }
+    return (ssize_t)copied;
+}
+
+/**
+ * Moves to the next header of the archive, extra headers included. The data of an extra header is read, so that the
+ * member it applies to is decoded with its long path or size in scanner->member.
+ *
+ * @return 1 and sets header to point inside the scanner, valid until the next call,
+ *         0 at the end of the archive,
+ *         -1 if the archive could not be read, or if scanner->verify is set and the header is invalid (errno is set
+ *         to EBADMSG).
+ */
+static int tar_scanner_next(struct tar_scanner *scanner, const tar_header_t **header, off_t *header_offset) {
+    off_t offset = scanner->next;
+    off_t buf_end = scanner->buf_offset + (off_t)scanner->buf_len;
+
+    if (offset < scanner->buf_offset || offset + TAR_HEADER_SIZE > buf_end) {
+        if (tar_scanner_fill(scanner, offset) == -1) {
+            return -1;
+        }
+        if (scanner->buf_len < TAR_HEADER_SIZE) {
+            return 0;
+        }
+    }
+
+    const tar_header_t *current = (const tar_header_t *)(scanner->buf + (offset - scanner->buf_offset));
+    if (current->name[0] == '\0') {
+        return 0;
+    }
+    if (scanner->verify && tar_header_verify(current) != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (tar_is_extra(current->typeflag)) {
+        uint64_t extra_size = tar_field_to_u64(current->size, sizeof(current->size));
+
+        // The header is copied, as reading its data may refill the buffer it is in.
+        scanner->extra = *current;
+        current = &scanner->extra;
+        scanner->next = offset + TAR_HEADER_SIZE + (off_t)tar_padded_size(extra_size);
+        if (extra_size <= TAR_EXTRA_MAX) {
+            uint8_t *data = malloc(extra_size ? extra_size : 1);
+            ssize_t bytes_read;
+
+            if (data == NULL) {
+                return -1;
+            }
+            bytes_read = tar_scanner_read(scanner, offset + TAR_HEADER_SIZE, data, extra_size);
+            if (bytes_read != -1) {
+                tar_member_extra(&scanner->member, current->typeflag, data, (size_t)bytes_read);
+            }
+            free(data);
+            if (bytes_read == -1) {
+                return -1;
+            }
+        }
+    } else {
+        tar_member_finish(&scanner->member, current);
+        scanner->next = offset + TAR_HEADER_SIZE + (off_t)tar_padded_size(scanner->member.size);
+    }
+
+    *header = current;
+    if (header_offset != NULL) {
+        *header_offset = offset;
+    }
+    TAR_COUNT(headers_scanned, 1);
+    return 1;
+}
+
+
+/*
+ * Passes the size bytes at the given archive offset to callback, in chunks taken straight from the buffer, which is
+ * refilled as needed. The data is not copied anywhere else. Returns 0, -1 if the archive could not be read or
+ * truncated, or -2 if the callback stopped.
+ */
+static int tar_scanner_deliver(struct tar_scanner *scanner, off_t offset, uint64_t size, size_t i,
+                               tar_batch_cb_t callback, void *arg) {
+    uint64_t done = 0;
+
+    do {
+        off_t buf_end = scanner->buf_offset + (off_t)scanner->buf_len;
+
+        if (size > 0 && (offset < scanner->buf_offset || offset >= buf_end)) {
+            if (tar_scanner_fill(scanner, offset) == -1) {
+                return -1;
+            }
+            if (scanner->buf_len == 0) {
+                errno = EIO;
+                return -1;
+            }
+            buf_end = scanner->buf_offset + (off_t)scanner->buf_len;
+        }
+
+        size_t chunk = size - done < (uint64_t)(buf_end - offset) ? (size_t)(size - done) : (size_t)(buf_end - offset);
+        const uint8_t *data = size > 0 ? scanner->buf + (offset - scanner->buf_offset) : NULL;
+
+        if (callback(i, done, data, chunk, size, arg) != 0) {
+            return -2;
+        }
+        done += chunk;
+        offset += (off_t)chunk;
+    } while (done < size);
+    return 0;
+}
+
+/* Moves to the header of the next member of the archive, past any extra header, decoded in scanner->member. */
+static int tar_scanner_next_member(struct tar_scanner *scanner, const tar_header_t **header, off_t *header_offset) {
+    int ret;
+
+    while ((ret = tar_scanner_next(scanner, header, header_offset)) == 1 && tar_is_extra((*header)->typeflag)) {
+    }
+    return ret;
+}
+
+/* Goes back to the first header of the archive, keeping the buffer. */
+static void tar_scanner_rewind(struct tar_scanner *scanner) {
+    scanner->next = 0;
+    scanner->member.has_path = scanner->member.has_link = scanner->member.has_size = 0;
+}
+
+/*
+ * Finds the header at the given path. When or_dir is set, a directory header at the path followed by a '/' matches
+ * too, as link targets name directories without their trailing '/'. Returns 1 if found, 0 if not, -1 on error.
+ */
+static int tar_scanner_find(struct tar_scanner *scanner, const char *path, int or_dir, const tar_header_t **header,
+                            off_t *header_offset) {
+    size_t path_len = strlen(path);
+    int ret;
+
+    while ((ret = tar_scanner_next_member(scanner, header, header_offset)) == 1) {
+        if (tar_member_is(&scanner->member, path, path_len, or_dir)) {
+            return 1;
+        }
+    }
+    return ret;
+}
+
+/* Finds the header at the given path, following links. Returns 1 if found, 0 if not, -1 on error. */
+static int tar_scanner_find_resolved(struct tar_scanner *scanner, const char *path, const tar_header_t **header,
+                                     off_t *header_offset) {
+    char target[PATH_MAX];
+    int found = tar_scanner_find(scanner, path, 0, header, header_offset);
+
+    // Each hop rescans the archive from its first header.
+    for (int depth = 0; found == 1 && tar_is_link((*header)->typeflag); depth++) {
+        if (depth == TAR_MAX_LINK_DEPTH ||
+            tar_member_link_target(&scanner->member, (*header)->typeflag, target) == -1) {
+            return 0;
+        }
+        tar_scanner_rewind(scanner);
+        found = tar_scanner_find(scanner, target, 1, header, header_offset);
+    }
+    return found;
+}
+
+/* Returns the typeflag of the entry at the given path, or -1 if there is none. */
+static int tar_find_typeflag(int tar_fd, const char *path) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    int typeflag = -1;
+
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        return -1;
+    }
+    if (tar_scanner_find(&scanner, path, 0, &header, NULL) == 1) {
+        typeflag = (unsigned char)header->typeflag;
+    }
+    tar_scanner_close(&scanner);
+    return typeflag;
+}
+
+
+/*
+ * Header validation kernel.
+ *
+ * The checksum of a header is the sum of its 512 bytes, the chksum field being counted as eight spaces. It is computed
+ * as the plain sum of the header, from which the bytes actually stored in the chksum field are taken out and eight
+ * spaces are put back, so that the header is never copied nor modified. The plain sum is vectorized with the widest
+ * instruction set available, chosen once at runtime.
+ */
+
+#define TAR_CHKSUM_OFFSET 148
+#define TAR_CHKSUM_LEN    8
+
+static uint32_t tar_sum_scalar(const uint8_t *bytes) {
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < TAR_HEADER_SIZE; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static uint32_t tar_sum_sse2(const uint8_t *bytes) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    for (size_t i = 0; i < TAR_HEADER_SIZE; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    return (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+}
+
+__attribute__((target("avx2")))
+static uint32_t tar_sum_avx2(const uint8_t *bytes) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    for (size_t i = 0; i < TAR_HEADER_SIZE; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return (uint32_t)(_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+}
+
+static uint32_t (*tar_resolve_sum(void))(const uint8_t *) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return tar_sum_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return tar_sum_sse2;
+    }
+    return tar_sum_scalar;
+}
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+static uint32_t tar_sum_neon(const uint8_t *bytes) {
+    uint16x8_t acc = vdupq_n_u16(0);
+
+    // 32 pairwise additions of two bytes per lane stay below 65535.
+    for (size_t i = 0; i < TAR_HEADER_SIZE; i += 16) {
+        acc = vpadalq_u8(acc, vld1q_u8(bytes + i));
+    }
+    return vaddlvq_u16(acc);
+}
+
+static uint32_t (*tar_resolve_sum(void))(const uint8_t *) {
+    return tar_sum_neon;
+}
+
+#else
+
+static uint32_t (*tar_resolve_sum(void))(const uint8_t *) {
+    return tar_sum_scalar;
+}
+
+#endif
+
+static uint32_t (*tar_sum_kernel)(const uint8_t *);
+
+/* Computes the checksum of a header, with the chksum field counted as spaces. */
+static uint32_t tar_header_chksum(const tar_header_t *header) {
+    const uint8_t *bytes = (const uint8_t *)header;
+    uint32_t (*kernel)(const uint8_t *) = __atomic_load_n(&tar_sum_kernel, __ATOMIC_RELAXED);
+    uint32_t sum;
+
+    if (kernel == NULL) {
+        kernel = tar_resolve_sum();
+        __atomic_store_n(&tar_sum_kernel, kernel, __ATOMIC_RELAXED);
+    }
+
+    sum = kernel(bytes);
+    for (size_t i = TAR_CHKSUM_OFFSET; i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LEN; i++) {
+        sum -= bytes[i];
+    }
+    return sum + TAR_CHKSUM_LEN * ' ';
+}
+
+/**
+ * Checks the magic value, the version and the checksum of a header.
+ */
+int tar_header_verify(const tar_header_t *header) {
+    // magic and version are contiguous: compare them as a single 8-byte word, then tell them apart.
+    static const char expected[TMAGLEN + TVERSLEN] = TMAGIC "\0" TVERSION;
+
+    if (memcmp(header->magic, expected, TMAGLEN + TVERSLEN) != 0) {
+        // Invalid magic value
+        if (memcmp(header->magic, TMAGIC, TMAGLEN) != 0) {
+            return -1;
+        }
+        // Invalid version value
+        return -2;
+    }
+
+    if (tar_field_to_u64(header->chksum, sizeof(header->chksum)) != tar_header_chksum(header)) {
+        return -3;
+    }
+    return 0;
+}
+
+
+/* Validates the headers of the archive, as check_archive() does. */
+static int tar_check_archive(int tar_fd) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    int count = 0, ret;
+
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        perror("An error occurred while allocating the scan buffer");
+        return -4;
+    }
+    scanner.verify = 0; // The status of a bad header is reported below.
+
+    // Only headers are checked: the data blocks of each entry are skipped according to its size.
+    while ((ret = tar_scanner_next(&scanner, &header, NULL)) == 1) {
+        int status = tar_header_verify(header);
+
+        if (status != 0) {
+            tar_scanner_close(&scanner);
+            return status;
+        }
+        count++;
+    }
+    tar_scanner_close(&scanner);
+
+    if (ret < 0) {
+        perror("Error reading from file descriptor");
+        return -4;
+    }
+    return count;
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_check_archive(tar_fd);
+
+    TAR_TRACE_END(trace, TAR_OP_CHECK_ARCHIVE, NULL, ret);
+    return ret;
+}
+
+
+/*
+ * Parallel validation.
+ *
+ * A first sequential pass only follows the size fields to locate the headers. Their validation, which is what costs
+ * CPU time, is then split in contiguous ranges among worker threads. Every worker stops as soon as it finds a bad
+ * header or goes past the earliest bad header found so far, so that the reported error is the one check_archive()
+ * would have returned.
+ */
+
+struct tar_check_shared {
+    int fd;
+    const uint8_t *base;        /* the mapped archive, or NULL to read the headers with pread() */
+    const off_t *offsets;
+    size_t first_bad;           /* position of the earliest bad header found so far */
+    int io_error;
+};
+
+struct tar_check_task {
+    struct tar_check_shared *shared;
+    size_t begin, end;
+    int status;                 /* validation result of the header at shared->first_bad, if this task found it */
+};
+
+static void tar_check_report(struct tar_check_shared *shared, size_t position) {
+    size_t current = __atomic_load_n(&shared->first_bad, __ATOMIC_RELAXED);
+
+    while (position < current &&
+           !__atomic_compare_exchange_n(&shared->first_bad, &current, position, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+static void *tar_check_worker(void *arg) {
+    struct tar_check_task *task = arg;
+    struct tar_check_shared *shared = task->shared;
+
+    for (size_t i = task->begin; i < task->end; i++) {
+        const tar_header_t *header;
+        tar_header_t buffer;
+
+        if (i > __atomic_load_n(&shared->first_bad, __ATOMIC_RELAXED)) {
+            break;
+        }
+
+        if (shared->base != NULL) {
+            header = (const tar_header_t *)(shared->base + shared->offsets[i]);
+        } else if (tar_pread(shared->fd, &buffer, TAR_HEADER_SIZE, shared->offsets[i]) == TAR_HEADER_SIZE) {
+            header = &buffer;
+        } else {
+            __atomic_store_n(&shared->io_error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        int status = tar_header_verify(header);
+        if (status != 0) {
+            task->status = status;
+            tar_check_report(shared, i);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Collects the offsets of the headers in the archive. Returns their number, or -1 on error. */
+static ssize_t tar_collect_headers(int tar_fd, off_t **offsets) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    size_t count = 0, capacity = 0;
+    off_t header_offset;
+    int ret;
+
+    *offsets = NULL;
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        return -1;
+    }
+    scanner.verify = 0; // The headers are checked by the threads.
+    while ((ret = tar_scanner_next(&scanner, &header, &header_offset)) == 1) {
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 1024;
+            off_t *grown = realloc(*offsets, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            *offsets = grown;
+            capacity = new_capacity;
+        }
+        (*offsets)[count++] = header_offset;
+    }
+    tar_scanner_close(&scanner);
+
+    if (ret < 0) {
+        free(*offsets);
+        *offsets = NULL;
+        return -1;
+    }
+    return (ssize_t)count;
+}
+
+static int tar_check_archive_parallel(int tar_fd, int nthreads) {
+    struct tar_check_shared shared = { .fd = tar_fd };
+    struct tar_check_task *tasks = NULL;
+    pthread_t *threads = NULL;
+    off_t *offsets;
+    void *map = MAP_FAILED;
+    size_t map_size = 0;
+    struct stat st;
+    int started = 0, ret = -4;
+
+    ssize_t count = tar_collect_headers(tar_fd, &offsets);
+    if (count < 0) {
+        perror("Error reading from file descriptor");
+        return -4;
+    }
+    if (count > INT_MAX) {
+        free(offsets);
+        return -4;
+    }
+
+    if (nthreads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = online > 0 ? (int)online : 1;
+    }
+    if ((ssize_t)nthreads > count) {
+        nthreads = count > 0 ? (int)count : 1;
+    }
+
+    // Workers read the headers out of a mapping when the archive can be mapped, with pread() otherwise.
+    if (fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map_size = (size_t)st.st_size;
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+    }
+    shared.base = map != MAP_FAILED ? map : NULL;
+    shared.offsets = offsets;
+    shared.first_bad = (size_t)count;
+
+    tasks = calloc((size_t)nthreads, sizeof(*tasks));
+    threads = calloc((size_t)nthreads, sizeof(*threads));
+    if (tasks == NULL || threads == NULL) {
+        goto out;
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        tasks[t].shared = &shared;
+        tasks[t].begin = (size_t)count * t / nthreads;
+        tasks[t].end = (size_t)count * (t + 1) / nthreads;
+    }
+
+    // The calling thread takes the first range itself.
+    for (started = 1; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, tar_check_worker, &tasks[started]) != 0) {
+            break;
+        }
+    }
+    tar_check_worker(&tasks[0]);
+    for (int t = started; t < nthreads; t++) {
+        tar_check_worker(&tasks[t]);   // Ranges whose thread could not be started.
+    }
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    if (shared.first_bad < (size_t)count) {
+        for (int t = 0; t < nthreads; t++) {
+            if (shared.first_bad >= tasks[t].begin && shared.first_bad < tasks[t].end) {
+                ret = tasks[t].status;
+            }
+        }
+    } else if (!shared.io_error) {
+        ret = (int)count;
+    }
+
+out:
+    if (map != MAP_FAILED) {
+        munmap(map, map_size);
+    }
+    free(threads);
+    free(tasks);
+    free(offsets);
+    return ret;
+}
+
+/**
+ * Checks whether the archive is valid, validating its headers on several threads.
+ */
+int check_archive_parallel(int tar_fd, int nthreads) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_check_archive_parallel(tar_fd, nthreads);
+
+    TAR_TRACE_END(trace, TAR_OP_CHECK_ARCHIVE_PARALLEL, NULL, ret);
+    return ret;
+}
+
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_find_typeflag(tar_fd, path) != -1;
+
+    TAR_TRACE_END(trace, TAR_OP_EXISTS, path, ret);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_find_typeflag(tar_fd, path) == DIRTYPE;
+
+    TAR_TRACE_END(trace, TAR_OP_IS_DIR, path, ret);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+
+int is_file(int tar_fd, char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int typeflag = tar_find_typeflag(tar_fd, path);
+    int ret = typeflag != -1 && tar_is_regular((char)typeflag);
+
+    TAR_TRACE_END(trace, TAR_OP_IS_FILE, path, ret);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+
+int is_symlink(int tar_fd, char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_find_typeflag(tar_fd, path) == SYMTYPE;
+
+    TAR_TRACE_END(trace, TAR_OP_IS_SYMLINK, path, ret);
+    return ret;
+}
+
+
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * With recursive set, the entries below the subdirectories are listed too.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         -1 if the archive could not be read or memory could not be allocated (errno is set),
+ *         any other value otherwise.
+ */
+static int tar_list(int tar_fd, const char *path, struct tar_list_sink *sink, int recursive, int depth) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    size_t path_len = strlen(path);
+    // The entries are below "path/" when the directory is named without its trailing '/'.
+    size_t prefix_len = path_len > 0 && path[path_len - 1] == '/' ? path_len : path_len + 1;
+    char target[PATH_MAX + 1];
+    int found = 0, linked = 0, ret;
+
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        return -1;
+    }
+    sink->count = 0;
+
+    // The directory itself and its entries are looked for in the same pass.
+    while ((ret = tar_scanner_next_member(&scanner, &header, NULL)) == 1) {
+        const char *name = scanner.member.path;
+        size_t name_len = scanner.member.path_len;
+
+        if (name_len == path_len || (name_len + 1 == path_len && path[name_len] == '/')) {
+            if (!found && !linked && memcmp(name, path, name_len) == 0) {
+                if (header->typeflag == DIRTYPE && name_len == path_len) {
+                    found = 1;
+                } else if (tar_is_link(header->typeflag) &&
+                           tar_member_link_target(&scanner.member, header->typeflag, target) != -1) {
+                    linked = 1;
+                }
+            }
+            continue;
+        }
+
+        // Entries are only collected once the directory was found, which tar writes before what it contains, so that
+        // the buffers are left alone when path is not a directory.
+        // Vérifie si l'entrée est dans le répertoire spécifié.
+        if (!found || name_len <= prefix_len || memcmp(name, path, path_len) != 0 ||
+            (prefix_len > path_len && name[path_len] != '/')) {
+            continue;
+        }
+
+        // direct fichier ou sous dossier ? Le seul '/' permis est le dernier caractère.
+        const char *relative_path = name + prefix_len;
+        const char *slash = memchr(relative_path, '/', name_len - prefix_len);
+        if (!recursive && slash != NULL && slash != name + name_len - 1) {
+            continue;
+        }
+
+        if (tar_list_sink_add(sink, name, name_len) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    tar_scanner_close(&scanner);
+
+    if (ret == -1) {
+        return -1;
+    }
+    if (!found) {
+        // A link to a directory lists the directory it points to, named with its trailing '/'.
+        if (linked && depth < TAR_MAX_LINK_DEPTH) {
+            strcat(target, "/");
+            return tar_list(tar_fd, target, sink, recursive, depth + 1);
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    TAR_TRACE_BEGIN(trace);
+    struct tar_list_sink sink = {.entries = entries, .capacity = *no_entries};
+    int ret = tar_list(tar_fd, path, &sink, 0, 0) == 1;
+
+    if (ret) {
+        *no_entries = sink.count;
+    }
+    TAR_TRACE_END(trace, TAR_OP_LIST, path, ret);
+    return ret;
+}
+
+static ssize_t tar_list_arena(int tar_fd, const char *path, tar_arena_t *arena, char ***entries) {
+    struct tar_list_sink sink = {.arena = arena, .copy = 1};
+    int ret = tar_list(tar_fd, path, &sink, 0, 0);
+
+    if (ret == 0) {
+        errno = ENOENT;
+    }
+    if (ret != 1) {
+        return -1;
+    }
+    *entries = (char **)sink.paths;
+    return (ssize_t)sink.count;
+}
+
+/**
+ * Lists the entries at a given path in the archive into an arena.
+ */
+ssize_t list_arena(int tar_fd, const char *path, tar_arena_t *arena, char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_list_arena(tar_fd, path, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_LIST_ARENA, path, ret);
+    return ret;
+}
+
+static ssize_t tar_list_recursive(int tar_fd, const char *path, tar_arena_t *arena, char ***entries) {
+    struct tar_list_sink sink = {.arena = arena, .copy = 1};
+    int ret = tar_list(tar_fd, path, &sink, 1, 0);
+
+    if (ret == 0) {
+        errno = ENOENT;
+    }
+    if (ret != 1) {
+        return -1;
+    }
+    *entries = (char **)sink.paths;
+    return (ssize_t)sink.count;
+}
+
+/**
+ * Lists the entries below a given directory of the archive, at any depth, into an arena.
+ */
+ssize_t list_recursive(int tar_fd, const char *path, tar_arena_t *arena, char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_list_recursive(tar_fd, path, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_LIST_RECURSIVE, path, ret);
+    return ret;
+}
+
+/*
+ * Matches a bracket expression at the start of pattern against a character, and moves pattern past it.
+ * Returns -1, leaving pattern as it is, if the expression is not closed.
+ */
+static int tar_glob_class(const char **pattern, char c) {
+    const char *p = *pattern + 1, *first;
+    int negate = 0, match = 0;
+
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    // A ']' right after the opening bracket is a member of the set.
+    for (first = p; *p != ']' || p == first; p++) {
+        unsigned char lo = (unsigned char)*p, hi = lo;
+
+        if (*p == '\0') {
+            return -1;
+        }
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            hi = (unsigned char)p[2];
+            p += 2;
+        }
+        match |= lo <= (unsigned char)c && (unsigned char)c <= hi;
+    }
+    *pattern = p + 1;
+    return c != '/' && match != negate;
+}
+
+/* Matches len bytes of a path against a glob pattern, as described for find(). */
+static int tar_glob_match(const char *pattern, const char *path, size_t len) {
+    while (*pattern != '\0') {
+        char c = *pattern;
+        int match;
+
+        if (c == '*') {
+            int any = pattern[1] == '*';
+
+            pattern += any ? 2 : 1;
+            if (any && *pattern == '/' && tar_glob_match(pattern + 1, path, len)) {
+                return 1;
+            }
+            for (size_t i = 0;; i++) {
+                if (tar_glob_match(pattern, path + i, len - i)) {
+                    return 1;
+                }
+                if (i == len || (!any && path[i] == '/')) {
+                    return 0;
+                }
+            }
+        }
+        if (len == 0) {
+            return 0;
+        }
+        if (c == '?') {
+            if (*path == '/') {
+                return 0;
+            }
+            pattern++;
+        } else if (c == '[' && (match = tar_glob_class(&pattern, *path)) != -1) {
+            if (!match) {
+                return 0;
+            }
+        } else {
+            // An unclosed '[' matches itself.
+            if (c == '\\' && pattern[1] != '\0') {
+                c = *++pattern;
+            }
+            if (c != *path) {
+                return 0;
+            }
+            pattern++;
+        }
+        path++;
+        len--;
+    }
+    return len == 0;
+}
+
+/* Matches the path of an entry against a pattern, the trailing '/' of a directory only by a pattern ending with one. */
+static int tar_glob_entry(const char *pattern, size_t pattern_len, const char *path, size_t len) {
+    if (len > 0 && path[len - 1] == '/' && (pattern_len == 0 || pattern[pattern_len - 1] != '/')) {
+        len--;
+    }
+    return tar_glob_match(pattern, path, len);
+}
+
+static ssize_t tar_find(int tar_fd, const char *pattern, tar_arena_t *arena, char ***entries) {
+    struct tar_list_sink sink = {.arena = arena, .copy = 1};
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    size_t pattern_len = strlen(pattern);
+    int ret;
+
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        return -1;
+    }
+    while ((ret = tar_scanner_next_member(&scanner, &header, NULL)) == 1) {
+        const struct tar_member *member = &scanner.member;
+
+        if (tar_glob_entry(pattern, pattern_len, member->path, member->path_len) &&
+            tar_list_sink_add(&sink, member->path, member->path_len) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    tar_scanner_close(&scanner);
+
+    if (ret == -1) {
+        return -1;
+    }
+    *entries = (char **)sink.paths;
+    return (ssize_t)sink.count;
+}
+
+/**
+ * Lists the entries of the archive whose path matches a glob pattern into an arena.
+ */
+ssize_t find(int tar_fd, const char *pattern, tar_arena_t *arena, char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_find(tar_fd, pattern, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_FIND, pattern, ret);
+    return ret;
+}
+
+
+
+/* Reads a file of the archive, as read_file() does. */
+static ssize_t tar_read_file(int tar_fd, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    off_t header_offset;
+    ssize_t ret = -1;
+
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        return -1;
+    }
+
+    if (tar_scanner_find_resolved(&scanner, path, &header, &header_offset) == 1 && tar_is_regular(header->typeflag)) {
+        uint64_t file_size = scanner.member.size;
+
+        if (offset >= file_size) {
+            ret = -2;
+        } else {
+            size_t bytes_left = file_size - offset;
+            size_t bytes_to_read = (*len < bytes_left) ? *len : bytes_left;
+            off_t data_offset = header_offset + TAR_HEADER_SIZE + (off_t)offset;
+
+            ssize_t bytes_read = tar_scanner_read(&scanner, data_offset, dest, bytes_to_read);
+            if (bytes_read != -1) {
+                *len = bytes_read;
+                ret = bytes_left - bytes_read;
+            }
+        }
+    }
+
+    tar_scanner_close(&scanner);
+    return ret;
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_file(tar_fd, path, offset, dest, len);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILE, path, ret);
+    return ret;
+}
+
+
+/*
+ * Content hashes.
+ *
+ * The content of a file is hashed with XXH64, with a seed of zero, so that hashes can be compared with those of other
+ * tools. XXH64 runs at several gigabytes per second on a single core with 64-bit multiplies only and no tables.
+ * The state is streaming, since the data of a file is delivered in the chunks it is read in.
+ */
+
+#define TAR_XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define TAR_XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define TAR_XXH_PRIME3 0x165667B19E3779F9ULL
+#define TAR_XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define TAR_XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+struct tar_xxh64 {
+    uint64_t acc[4];
+    uint64_t total;
+    uint8_t stripe[32];         /* the bytes of an incomplete stripe */
+    size_t stripe_len;
+};
+
+static uint64_t tar_xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t tar_xxh_read64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t tar_xxh_read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t tar_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * TAR_XXH_PRIME2;
+    return tar_xxh_rotl(acc, 31) * TAR_XXH_PRIME1;
+}
+
+static void tar_xxh64_init(struct tar_xxh64 *state) {
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = TAR_XXH_PRIME1 + TAR_XXH_PRIME2;
+    state->acc[1] = TAR_XXH_PRIME2;
+    state->acc[3] = -TAR_XXH_PRIME1;
+}
+
+/* Folds 32-byte stripes into the four accumulators, which are independent so that the rounds are pipelined. */
+static void tar_xxh64_stripes(struct tar_xxh64 *state, const uint8_t *p, size_t stripes) {
+    uint64_t a0 = state->acc[0], a1 = state->acc[1], a2 = state->acc[2], a3 = state->acc[3];
+
+    for (size_t i = 0; i < stripes; i++, p += 32) {
+        a0 = tar_xxh_round(a0, tar_xxh_read64(p));
+        a1 = tar_xxh_round(a1, tar_xxh_read64(p + 8));
+        a2 = tar_xxh_round(a2, tar_xxh_read64(p + 16));
+        a3 = tar_xxh_round(a3, tar_xxh_read64(p + 24));
+    }
+    state->acc[0] = a0;
+    state->acc[1] = a1;
+    state->acc[2] = a2;
+    state->acc[3] = a3;
+}
+
+static void tar_xxh64_update(struct tar_xxh64 *state, const uint8_t *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    state->total += len;
+    if (state->stripe_len > 0) {
+        size_t fill = 32 - state->stripe_len < len ? 32 - state->stripe_len : len;
+
+        memcpy(state->stripe + state->stripe_len, data, fill);
+        state->stripe_len += fill;
+        data += fill;
+        len -= fill;
+        if (state->stripe_len < 32) {
+            return;
+        }
+        tar_xxh64_stripes(state, state->stripe, 1);
+        state->stripe_len = 0;
+    }
+    tar_xxh64_stripes(state, data, len / 32);
+    memcpy(state->stripe, data + len - len % 32, len % 32);
+    state->stripe_len = len % 32;
+}
+
+static uint64_t tar_xxh64_digest(const struct tar_xxh64 *state) {
+    const uint8_t *p = state->stripe, *end = state->stripe + state->stripe_len;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = tar_xxh_rotl(state->acc[0], 1) + tar_xxh_rotl(state->acc[1], 7) + tar_xxh_rotl(state->acc[2], 12) +
+            tar_xxh_rotl(state->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ tar_xxh_round(0, state->acc[i])) * TAR_XXH_PRIME1 + TAR_XXH_PRIME4;
+        }
+    } else {
+        h = TAR_XXH_PRIME5;
+    }
+    h += state->total;
+
+    for (; p + 8 <= end; p += 8) {
+        h = tar_xxh_rotl(h ^ tar_xxh_round(0, tar_xxh_read64(p)), 27) * TAR_XXH_PRIME1 + TAR_XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        h = tar_xxh_rotl(h ^ (uint64_t)tar_xxh_read32(p) * TAR_XXH_PRIME1, 23) * TAR_XXH_PRIME2 + TAR_XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h = tar_xxh_rotl(h ^ *p * TAR_XXH_PRIME5, 11) * TAR_XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= TAR_XXH_PRIME2;
+    h ^= h >> 29;
+    h *= TAR_XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Hashes bytes the way the content of files is hashed in an index.
+ */
+uint64_t tar_content_hash(const void *data, size_t len) {
+    struct tar_xxh64 state;
+
+    tar_xxh64_init(&state);
+    tar_xxh64_update(&state, data, len);
+    return tar_xxh64_digest(&state);
+}
+
+/* Adds a chunk of a file delivered by tar_scanner_deliver() to the hash state given as argument. */
+static int tar_xxh64_deliver(size_t i, uint64_t offset, const uint8_t *data, size_t len, uint64_t size, void *arg) {
+    (void)i;
+    (void)offset;
+    (void)size;
+    tar_xxh64_update(arg, data, len);
+    return 0;
+}
+
+
+/*
+ * In-memory index.
+ *
+ * Entries are stored in archive order so that an entry keeps its position for the lifetime of the index. Their paths
+ * live one after the other in a single arena, and are found through an open-addressing hash table of the live
+ * entries (the last one of each path). `sorted` holds the positions of the live entries ordered by path.
+ *
+ * The children of every directory are computed once the entries are sorted, so that listing a directory is a lookup.
+ * Likewise, the entry every link finally points to is resolved once, so that following a link is a lookup.
+ */
+
+#define TAR_SLOT_EMPTY UINT32_MAX
+#define TAR_TARGET_NONE UINT32_MAX              /* dangling link or loop */
+#define TAR_TARGET_UNRESOLVED (UINT32_MAX - 1)
+
+struct tar_index_entry {
+    uint64_t hash;
+    uint64_t size;
+    off_t data_offset;
+    size_t name_offset;         /* offset of the null-terminated path in the arena */
+    size_t link_offset;         /* offset of the null-terminated linkname in the arena, for links */
+    uint32_t name_len;
+    uint32_t link_len;
+    uint64_t mtime;
+    uint32_t target;            /* position of the entry a link resolves to, the entry itself for other types */
+    uint32_t mode;
+    char typeflag;
+};
+
+/* A slot of the hash table: an entry position and the upper half of the hash of its path. */
+struct tar_slot {
+    uint32_t id;
+    uint32_t tag;
+};
+
+struct tar_index {
+    int fd;
+    uint64_t archive_size;      /* size and modification time of the archive when it was indexed */
+    struct timespec archive_mtime;
+    off_t end_offset;           /* offset of the end-of-archive marker, where appended members start */
+    void *map;                  /* the sidecar file the tables below point into, NULL if they are allocated */
+    size_t map_size;
+    struct tar_index_entry *entries;
+    size_t count;
+    char *names;
+    size_t names_len;
+    struct tar_slot *slots;
+    size_t slot_mask;           /* number of slots minus one, the number of slots being a power of two */
+    uint32_t *sorted;
+    size_t sorted_count;
+    /*
+     * Parent-to-children table: the entries of the directory at position i are
+     * children[child_start[i]] to children[child_start[i + 1] - 1], in name order.
+     */
+    uint32_t *child_start;
+    uint32_t *children;
+    /*
+     * Decoded metadata of the live entries, one array per field, in name order: position i describes the entry
+     * sorted[i]. Scans that filter on a field only go through the array of that field.
+     */
+    uint8_t *types;             /* enum tar_type */
+    uint64_t *sizes;
+    uint64_t *data_offsets;
+    uint64_t *mtimes;
+    uint32_t *modes;
+    uint64_t *name_offsets;
+    uint64_t *content_hashes;   /* XXH64 of the data of the first content_hash_count entries, zero for non-files */
+    size_t content_hash_count;
+    /*
+     * One byte per entry, set once the header of the entry has been checked, which is never saved to a sidecar file.
+     * Readers set bytes concurrently, with atomic stores. NULL for an archive not read through the file descriptor.
+     */
+    uint8_t *verified;
+};
+
+/* The tables of an index, which are allocated, or mapped from a sidecar file, one after the other. */
+enum tar_table {
+    TAR_TABLE_ENTRIES,
+    TAR_TABLE_NAMES,
+    TAR_TABLE_SLOTS,
+    TAR_TABLE_SORTED,
+    TAR_TABLE_CHILD_START,
+    TAR_TABLE_CHILDREN,
+    TAR_TABLE_CONTENT_HASHES,
+    TAR_TABLE_TYPES,
+    TAR_TABLE_SIZES,
+    TAR_TABLE_DATA_OFFSETS,
+    TAR_TABLE_MTIMES,
+    TAR_TABLE_MODES,
+    TAR_TABLE_NAME_OFFSETS,
+    TAR_TABLE_COUNT
+};
+
+struct tar_table_ref {
+    void **table;
+    uint64_t count;             /* number of items, given the counts recorded in the index */
+    size_t item_size;
+};
+
+static void tar_index_tables(tar_index_t *index, struct tar_table_ref tables[TAR_TABLE_COUNT]) {
+    size_t live = index->sorted_count;
+    struct tar_table_ref refs[TAR_TABLE_COUNT] = {
+        [TAR_TABLE_ENTRIES] = { (void **)&index->entries, index->count, sizeof(*index->entries) },
+        [TAR_TABLE_NAMES] = { (void **)&index->names, index->names_len, 1 },
+        [TAR_TABLE_SLOTS] = { (void **)&index->slots, index->slot_mask + 1, sizeof(*index->slots) },
+        [TAR_TABLE_SORTED] = { (void **)&index->sorted, live, sizeof(*index->sorted) },
+        [TAR_TABLE_CHILD_START] = { (void **)&index->child_start, index->count + 1, sizeof(*index->child_start) },
+        [TAR_TABLE_CHILDREN] = { (void **)&index->children, live, sizeof(*index->children) },
+        [TAR_TABLE_CONTENT_HASHES] = { (void **)&index->content_hashes, index->content_hash_count,
+                                       sizeof(*index->content_hashes) },
+        [TAR_TABLE_TYPES] = { (void **)&index->types, live, sizeof(*index->types) },
+        [TAR_TABLE_SIZES] = { (void **)&index->sizes, live, sizeof(*index->sizes) },
+        [TAR_TABLE_DATA_OFFSETS] = { (void **)&index->data_offsets, live, sizeof(*index->data_offsets) },
+        [TAR_TABLE_MTIMES] = { (void **)&index->mtimes, live, sizeof(*index->mtimes) },
+        [TAR_TABLE_MODES] = { (void **)&index->modes, live, sizeof(*index->modes) },
+        [TAR_TABLE_NAME_OFFSETS] = { (void **)&index->name_offsets, live, sizeof(*index->name_offsets) },
+    };
+
+    memcpy(tables, refs, sizeof(refs));
+}
+
+static uint64_t tar_hash_path(const char *path, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static const char *tar_index_name(const tar_index_t *index, const struct tar_index_entry *entry) {
+    return index->names + entry->name_offset;
+}
+
+/* Appends len bytes and a null to the arena. Returns the offset of the copy, or -1. */
+static ssize_t tar_index_intern(tar_index_t *index, size_t *names_capacity, const char *bytes, size_t len) {
+    size_t offset = index->names_len;
+
+    if (index->names_len + len + 1 > *names_capacity) {
+        size_t new_capacity = *names_capacity ? *names_capacity * 2 : 4096;
+        while (index->names_len + len + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *names = realloc(index->names, new_capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        index->names = names;
+        *names_capacity = new_capacity;
+    }
+
+    memcpy(index->names + offset, bytes, len);
+    index->names[offset + len] = '\0';
+    index->names_len += len + 1;
+    return (ssize_t)offset;
+}
+
+static int tar_index_push(tar_index_t *index, size_t *capacity, size_t *names_capacity, const tar_header_t *header,
+                          const struct tar_member *member, off_t data_offset) {
+    struct tar_index_entry *entry;
+    const char *path = member->path;
+    size_t path_len = member->path_len;
+    ssize_t name_offset, link_offset = 0;
+    size_t link_len = 0;
+
+    if (index->count == TAR_TARGET_UNRESOLVED - 1) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (index->count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        struct tar_index_entry *entries = realloc(index->entries, new_capacity * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        index->entries = entries;
+        *capacity = new_capacity;
+    }
+
+    name_offset = tar_index_intern(index, names_capacity, path, path_len);
+    if (name_offset != -1 && tar_is_link(header->typeflag)) {
+        link_len = member->link_len;
+        link_offset = tar_index_intern(index, names_capacity, member->link, link_len);
+    }
+    if (name_offset == -1 || link_offset == -1) {
+        return -1;
+    }
+
+    entry = &index->entries[index->count];
+    entry->name_offset = (size_t)name_offset;
+    entry->name_len = (uint32_t)path_len;
+    entry->hash = tar_hash_path(path, path_len);
+    entry->link_offset = (size_t)link_offset;
+    entry->link_len = (uint32_t)link_len;
+    entry->target = tar_is_link(header->typeflag) ? TAR_TARGET_UNRESOLVED : (uint32_t)index->count;
+
+    entry->size = member->size;
+    entry->data_offset = data_offset;
+    entry->mode = (uint32_t)tar_field_to_u64(header->mode, sizeof(header->mode));
+    entry->mtime = tar_field_to_u64(header->mtime, sizeof(header->mtime));
+    entry->typeflag = header->typeflag;
+    index->count++;
+    return 0;
+}
+
+struct tar_sort_key {
+    const char *name;
+    uint32_t id;
+};
+
+static int tar_sort_key_cmp(const void *a, const void *b) {
+    const struct tar_sort_key *ka = a, *kb = b;
+    int cmp = strcmp(ka->name, kb->name);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (ka->id > kb->id) - (ka->id < kb->id);
+}
+
+/* Fills index->sorted, keeping only the last entry of each path. */
+static int tar_index_sort(tar_index_t *index) {
+    struct tar_sort_key *keys;
+    size_t i;
+
+    index->sorted_count = 0;
+    keys = malloc((index->count ? index->count : 1) * sizeof(*keys));
+    index->sorted = malloc((index->count ? index->count : 1) * sizeof(*index->sorted));
+    if (keys == NULL || index->sorted == NULL) {
+        free(keys);
+        return -1;
+    }
+
+    for (i = 0; i < index->count; i++) {
+        keys[i].name = tar_index_name(index, &index->entries[i]);
+        keys[i].id = (uint32_t)i;
+    }
+    qsort(keys, index->count, sizeof(*keys), tar_sort_key_cmp);
+
+    for (i = 0; i < index->count; i++) {
+        if (i + 1 < index->count && strcmp(keys[i].name, keys[i + 1].name) == 0) {
+            continue; // Shadowed by a later entry with the same path.
+        }
+        index->sorted[index->sorted_count++] = keys[i].id;
+    }
+
+    free(keys);
+    return 0;
+}
+
+/* Fills the hash table with the live entries, keeping it at most half full. */
+static int tar_index_hash(tar_index_t *index) {
+    size_t slot_count = 16;
+
+    while (slot_count < 2 * index->sorted_count) {
+        slot_count *= 2;
+    }
+    index->slots = malloc(slot_count * sizeof(*index->slots));
+    if (index->slots == NULL) {
+        return -1;
+    }
+    index->slot_mask = slot_count - 1;
+    for (size_t i = 0; i < slot_count; i++) {
+        index->slots[i].id = TAR_SLOT_EMPTY;
+    }
+
+    for (size_t i = 0; i < index->sorted_count; i++) {
+        uint32_t id = index->sorted[i];
+        uint64_t hash = index->entries[id].hash;
+        size_t slot = hash & index->slot_mask;
+
+        while (index->slots[slot].id != TAR_SLOT_EMPTY) {
+            slot = (slot + 1) & index->slot_mask;
+        }
+        index->slots[slot].id = id;
+        index->slots[slot].tag = (uint32_t)(hash >> 32);
+    }
+    return 0;
+}
+
+/* Returns the position of the live entry whose path is the first len bytes of path, or -1. */
+static ssize_t tar_index_get(const tar_index_t *index, const char *path, size_t len) {
+    uint64_t hash = tar_hash_path(path, len);
+    uint32_t tag = (uint32_t)(hash >> 32);
+
+    for (size_t slot = hash & index->slot_mask; index->slots[slot].id != TAR_SLOT_EMPTY;
+         slot = (slot + 1) & index->slot_mask) {
+        const struct tar_index_entry *entry = &index->entries[index->slots[slot].id];
+
+        if (index->slots[slot].tag == tag && entry->name_len == len &&
+            memcmp(tar_index_name(index, entry), path, len) == 0) {
+            return index->slots[slot].id;
+        }
+    }
+    return -1;
+}
+
+/* Returns the live entry at the given path, or NULL. */
+static const struct tar_index_entry *tar_index_lookup(const tar_index_t *index, const char *path) {
+    ssize_t id = tar_index_get(index, path, strlen(path));
+
+    if (id == -1) {
+        TAR_COUNT(index_misses, 1);
+        return NULL;
+    }
+    TAR_COUNT(index_hits, 1);
+    return &index->entries[id];
+}
+
+/* Returns the position of the directory containing the entry at the given path, or -1. */
+static ssize_t tar_index_parent(const tar_index_t *index, const char *name, size_t len) {
+    // "dir/sub/" and "dir/file" are both in "dir/": skip the trailing '/' of directories, then the last component.
+    if (len > 0 && name[len - 1] == '/') {
+        len--;
+    }
+    while (len > 0 && name[len - 1] != '/') {
+        len--;
+    }
+    if (len == 0) {
+        return -1;
+    }
+
+    ssize_t id = tar_index_get(index, name, len);
+    if (id == -1 || index->entries[id].typeflag != DIRTYPE) {
+        return -1;
+    }
+    return id;
+}
+
+/* Fills the parent-to-children table of the index. */
+static int tar_index_link_children(tar_index_t *index) {
+    size_t n = index->sorted_count, i;
+    ssize_t *parents = malloc((n ? n : 1) * sizeof(*parents));
+    uint32_t *next = malloc((index->count + 1) * sizeof(*next));
+    int ret = -1;
+
+    index->child_start = calloc(index->count + 1, sizeof(*index->child_start));
+    index->children = malloc((n ? n : 1) * sizeof(*index->children));
+    if (parents == NULL || next == NULL || index->child_start == NULL || index->children == NULL) {
+        goto out;
+    }
+
+    // Count the children of each directory, then turn the counts into start positions.
+    for (i = 0; i < n; i++) {
+        const struct tar_index_entry *entry = &index->entries[index->sorted[i]];
+
+        parents[i] = tar_index_parent(index, tar_index_name(index, entry), entry->name_len);
+        if (parents[i] != -1) {
+            index->child_start[parents[i] + 1]++;
+        }
+    }
+    for (i = 0; i < index->count; i++) {
+        index->child_start[i + 1] += index->child_start[i];
+    }
+
+    // Visiting the entries in name order leaves the children of each directory in name order.
+    memcpy(next, index->child_start, index->count * sizeof(*next));
+    for (i = 0; i < n; i++) {
+        if (parents[i] != -1) {
+            index->children[next[parents[i]]++] = index->sorted[i];
+        }
+    }
+    ret = 0;
+
+out:
+    free(next);
+    free(parents);
+    return ret;
+}
+
+/*
+ * Resolves the link at the given position to the entry it finally points to, and records the result on every link of
+ * the chain.
+ */
+static void tar_index_resolve(tar_index_t *index, uint32_t id) {
+    uint32_t chain[TAR_MAX_LINK_DEPTH];
+    uint32_t target = id;
+    int depth = 0;
+
+    while (index->entries[target].target == TAR_TARGET_UNRESOLVED) {
+        const struct tar_index_entry *link = &index->entries[target];
+        char path[PATH_MAX];
+        ssize_t len, next = -1;
+
+        if (depth == TAR_MAX_LINK_DEPTH) {
+            // The chain is too long from its first link only: the others are resolved from themselves later.
+            while (depth > 1) {
+                index->entries[chain[--depth]].target = TAR_TARGET_UNRESOLVED;
+            }
+            return;
+        }
+        chain[depth++] = target;
+        // Mark the link while its chain is followed, so that a loop ends on it.
+        index->entries[target].target = TAR_TARGET_NONE;
+
+        len = tar_link_target(tar_index_name(index, link), link->name_len, link->typeflag,
+                              index->names + link->link_offset, link->link_len, path);
+        if (len != -1) {
+            next = tar_index_get(index, path, (size_t)len);
+            if (next == -1 && len + 1 < PATH_MAX) {
+                path[len] = '/';
+                next = tar_index_get(index, path, (size_t)len + 1);
+            }
+        }
+        if (next == -1) {
+            target = TAR_TARGET_NONE;
+            break;
+        }
+        target = (uint32_t)next;
+    }
+
+    if (target != TAR_TARGET_NONE) {
+        target = index->entries[target].target;
+    }
+    while (depth > 0) {
+        index->entries[chain[--depth]].target = target;
+    }
+}
+
+/* Resolves every live link of the index. */
+static void tar_index_resolve_links(tar_index_t *index) {
+    for (size_t i = 0; i < index->sorted_count; i++) {
+        uint32_t id = index->sorted[i];
+
+        if (index->entries[id].target == TAR_TARGET_UNRESOLVED) {
+            tar_index_resolve(index, id);
+        }
+    }
+}
+
+static uint8_t tar_type_of(char typeflag) {
+    if (tar_is_regular(typeflag)) {
+        return TAR_TYPE_FILE;
+    }
+    switch (typeflag) {
+    case DIRTYPE:
+        return TAR_TYPE_DIR;
+    case SYMTYPE:
+        return TAR_TYPE_SYMLINK;
+    case LNKTYPE:
+        return TAR_TYPE_HARDLINK;
+    default:
+        return TAR_TYPE_OTHER;
+    }
+}
+
+/* Fills the metadata arrays of the live entries from the entries they describe. */
+static int tar_index_decode(tar_index_t *index) {
+    size_t n = index->sorted_count ? index->sorted_count : 1;
+
+    index->types = malloc(n * sizeof(*index->types));
+    index->sizes = malloc(n * sizeof(*index->sizes));
+    index->data_offsets = malloc(n * sizeof(*index->data_offsets));
+    index->mtimes = malloc(n * sizeof(*index->mtimes));
+    index->modes = malloc(n * sizeof(*index->modes));
+    index->name_offsets = malloc(n * sizeof(*index->name_offsets));
+    if (index->types == NULL || index->sizes == NULL || index->data_offsets == NULL || index->mtimes == NULL ||
+        index->modes == NULL || index->name_offsets == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < index->sorted_count; i++) {
+        const struct tar_index_entry *entry = &index->entries[index->sorted[i]];
+
+        index->types[i] = tar_type_of(entry->typeflag);
+        index->sizes[i] = entry->size;
+        index->data_offsets[i] = (uint64_t)entry->data_offset;
+        index->mtimes[i] = entry->mtime;
+        index->modes[i] = entry->mode;
+        index->name_offsets[i] = entry->name_offset;
+    }
+    return 0;
+}
+
+/* Returns the live entry at the given path once links are followed, or NULL. */
+static const struct tar_index_entry *tar_index_lookup_resolved(const tar_index_t *index, const char *path) {
+    const struct tar_index_entry *entry = tar_index_lookup(index, path);
+
+    if (entry == NULL || entry->target == TAR_TARGET_NONE) {
+        return NULL;
+    }
+    return &index->entries[entry->target];
+}
+
+/* Builds an index of the archive, as tar_index_build() does. */
+static tar_index_t *tar_index_scan(int tar_fd) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    tar_index_t *index;
+    size_t capacity = 0, names_capacity = 0;
+    off_t header_offset;
+    int ret;
+
+    index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->fd = tar_fd;
+
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1 || tar_scanner_open(&scanner, tar_fd) == -1) {
+        goto error;
+    }
+    index->archive_size = (uint64_t)st.st_size;
+    index->archive_mtime = st.st_mtim;
+    while ((ret = tar_scanner_next_member(&scanner, &header, &header_offset)) == 1) {
+        if (tar_index_push(index, &capacity, &names_capacity, header, &scanner.member,
+                           header_offset + TAR_HEADER_SIZE) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    index->end_offset = scanner.next;
+    tar_scanner_close(&scanner);
+
+    // With lazy validation, the scanner checked every header it walked.
+    if (ret != -1 && (index->verified = calloc(index->count ? index->count : 1, 1)) == NULL) {
+        ret = -1;
+    }
+    if (ret != -1 && scanner.verify) {
+        memset(index->verified, 1, index->count);
+    }
+    if (ret == -1 || tar_index_sort(index) == -1 || tar_index_hash(index) == -1 ||
+        tar_index_link_children(index) == -1 || tar_index_decode(index) == -1) {
+        goto error;
+    }
+    tar_index_resolve_links(index);
+    return index;
+
+error:
+    tar_index_free(index);
+    return NULL;
+}
+
+/**
+ * Builds an index of the archive in a single pass over its headers.
+ */
+tar_index_t *tar_index_build(int tar_fd) {
+    TAR_TRACE_BEGIN(trace);
+    tar_index_t *index = tar_index_scan(tar_fd);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_BUILD, NULL, index != NULL);
+    return index;
+}
+
+/* Copies the tables of an index loaded from a sidecar file out of the mapping, so that they can be grown. */
+static int tar_index_unmap(tar_index_t *index) {
+    struct tar_table_ref tables[TAR_TABLE_COUNT];
+    void *copies[TAR_TABLE_COUNT];
+    int i;
+
+    if (index->map == NULL) {
+        return 0;
+    }
+    tar_index_tables(index, tables);
+    for (i = 0; i < TAR_TABLE_COUNT; i++) {
+        size_t size = (size_t)tables[i].count * tables[i].item_size;
+
+        copies[i] = malloc(size ? size : 1);
+        if (copies[i] == NULL) {
+            while (i > 0) {
+                free(copies[--i]);
+            }
+            return -1;
+        }
+        memcpy(copies[i], *tables[i].table, size);
+    }
+    for (i = 0; i < TAR_TABLE_COUNT; i++) {
+        *tables[i].table = copies[i];
+    }
+    munmap(index->map, index->map_size);
+    index->map = NULL;
+    index->map_size = 0;
+    return 0;
+}
+
+/*
+ * Merges the entries from position first onwards into index->sorted, where they shadow the entries with the same
+ * path, and into the hash table.
+ */
+static int tar_index_merge(tar_index_t *index, size_t first) {
+    size_t added = index->count - first, n = 0, i = 0, j = 0;
+    struct tar_sort_key *keys = malloc(added * sizeof(*keys));
+    uint32_t *sorted = malloc((index->sorted_count + added) * sizeof(*sorted));
+
+    if (keys == NULL || sorted == NULL) {
+        free(keys);
+        free(sorted);
+        return -1;
+    }
+    for (i = 0; i < added; i++) {
+        keys[i].name = tar_index_name(index, &index->entries[first + i]);
+        keys[i].id = (uint32_t)(first + i);
+    }
+    qsort(keys, added, sizeof(*keys), tar_sort_key_cmp);
+
+    // Only the appended entries are sorted, then merged with the live entries, which are sorted already.
+    for (i = 0; i < added; i++) {
+        if (i + 1 < added && strcmp(keys[i].name, keys[i + 1].name) == 0) {
+            continue;
+        }
+        while (j < index->sorted_count &&
+               strcmp(tar_index_name(index, &index->entries[index->sorted[j]]), keys[i].name) < 0) {
+            sorted[n++] = index->sorted[j++];
+        }
+        if (j < index->sorted_count &&
+            strcmp(tar_index_name(index, &index->entries[index->sorted[j]]), keys[i].name) == 0) {
+            j++;
+        }
+        sorted[n++] = keys[i].id;
+    }
+    while (j < index->sorted_count) {
+        sorted[n++] = index->sorted[j++];
+    }
+    free(keys);
+    free(index->sorted);
+    index->sorted = sorted;
+    index->sorted_count = n;
+
+    if (2 * n > index->slot_mask + 1) {
+        free(index->slots);
+        return tar_index_hash(index);
+    }
+    for (i = first; i < index->count; i++) {
+        const struct tar_index_entry *entry = &index->entries[i];
+        size_t slot = entry->hash & index->slot_mask;
+
+        // An entry replaces the one it shadows in its slot, later entries with the same path replacing it in turn.
+        while (index->slots[slot].id != TAR_SLOT_EMPTY) {
+            const struct tar_index_entry *other = &index->entries[index->slots[slot].id];
+
+            if (other->hash == entry->hash && other->name_len == entry->name_len &&
+                memcmp(tar_index_name(index, other), tar_index_name(index, entry), entry->name_len) == 0) {
+                break;
+            }
+            slot = (slot + 1) & index->slot_mask;
+        }
+        index->slots[slot].id = (uint32_t)i;
+        index->slots[slot].tag = (uint32_t)(entry->hash >> 32);
+    }
+    return 0;
+}
+
+/* Hashes the content of the entries from position first onwards, in a single sweep over their data. */
+static int tar_index_hash_range(tar_index_t *index, size_t first) {
+    uint64_t *hashes = realloc(index->content_hashes, (index->count ? index->count : 1) * sizeof(*hashes));
+    struct tar_scanner scanner;
+
+    if (hashes == NULL) {
+        return -1;
+    }
+    index->content_hashes = hashes;
+    if (tar_scanner_open(&scanner, index->fd) == -1) {
+        return -1;
+    }
+    // The entries are in archive order: the sweep only moves forward.
+    for (size_t i = first; i < index->count; i++) {
+        const struct tar_index_entry *entry = &index->entries[i];
+        struct tar_xxh64 state;
+
+        hashes[i] = 0;
+        if (!tar_is_regular(entry->typeflag)) {
+            continue;
+        }
+        tar_xxh64_init(&state);
+        if (tar_scanner_deliver(&scanner, entry->data_offset, entry->size, i, tar_xxh64_deliver, &state) != 0) {
+            tar_scanner_close(&scanner);
+            return -1;
+        }
+        hashes[i] = tar_xxh64_digest(&state);
+    }
+    tar_scanner_close(&scanner);
+    index->content_hash_count = index->count;
+    return 0;
+}
+
+static int tar_index_hash_members(tar_index_t *index) {
+    if (index->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    if (tar_index_unmap(index) == -1) {
+        return -1;
+    }
+    return tar_index_hash_range(index, index->content_hash_count);
+}
+
+/**
+ * Hashes the content of every file of the index.
+ */
+int tar_index_hash_contents(tar_index_t *index) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_index_hash_members(index);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_HASH_CONTENTS, NULL, ret);
+    return ret;
+}
+
+static int tar_index_find_hash(const tar_index_t *index, const char *path, uint64_t *hash) {
+    const struct tar_index_entry *entry = tar_index_lookup_resolved(index, path);
+    size_t id;
+
+    if (entry == NULL || !tar_is_regular(entry->typeflag)) {
+        errno = ENOENT;
+        return -1;
+    }
+    id = (size_t)(entry - index->entries);
+    if (id >= index->content_hash_count) {
+        errno = ENODATA;
+        return -1;
+    }
+    *hash = index->content_hashes[id];
+    return 0;
+}
+
+/**
+ * Gives the hash of the content of a file of the index.
+ */
+int tar_index_content_hash(const tar_index_t *index, const char *path, uint64_t *hash) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_index_find_hash(index, path, hash);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_CONTENT_HASH, path, ret);
+    return ret;
+}
+
+/*
+ * Tells whether the entries from position first onwards, not merged yet, can change the chain of a link which resolved
+ * to an entry they do not shadow: they do if they shadow a link, which may be in the middle of a chain, or if they
+ * add "path" where "path/" is, which a chain looking for "path" found instead.
+ */
+static int tar_index_appended_chains(const tar_index_t *index, size_t first) {
+    char path[PATH_MAX];
+
+    for (size_t i = first; i < index->count; i++) {
+        const struct tar_index_entry *entry = &index->entries[i];
+        ssize_t shadowed = tar_index_get(index, tar_index_name(index, entry), entry->name_len);
+
+        if (shadowed != -1 && tar_is_link(index->entries[shadowed].typeflag)) {
+            return 1;
+        }
+        if (entry->name_len + 1 < PATH_MAX) {
+            memcpy(path, tar_index_name(index, entry), entry->name_len);
+            path[entry->name_len] = '/';
+            if (tar_index_get(index, path, entry->name_len + 1) != -1) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resolves again, once the entries from position first onwards are merged, the links they can change: those which
+ * did not resolve, those which resolved to an entry now shadowed, and all of them if every_link is set.
+ */
+static void tar_index_resolve_appended(tar_index_t *index, size_t first, int every_link) {
+    for (size_t i = 0; i < first; i++) {
+        struct tar_index_entry *link = &index->entries[i];
+        const struct tar_index_entry *target;
+
+        // The links shadowed before are left as they are: they are not resolved, being no longer looked up.
+        if (!tar_is_link(link->typeflag) || link->target == TAR_TARGET_UNRESOLVED) {
+            continue;
+        }
+        target = link->target == TAR_TARGET_NONE ? NULL : &index->entries[link->target];
+        if (every_link || target == NULL ||
+            tar_index_get(index, tar_index_name(index, target), target->name_len) != (ssize_t)link->target) {
+            link->target = TAR_TARGET_UNRESOLVED;
+        }
+    }
+    tar_index_resolve_links(index);
+}
+
+/* Adds the appended members to the index, as tar_index_update() does. */
+static int tar_index_append(tar_index_t *index) {
+    struct tar_table_ref tables[TAR_TABLE_COUNT];
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    size_t first = index->count, names_len = index->names_len;
+    size_t capacity = index->count, names_capacity = index->names_len;
+    off_t header_offset;
+    struct stat st;
+    int ret, status = 0;
+
+    if (fstat(index->fd, &st) == -1) {
+        return -4;
+    }
+    if ((uint64_t)st.st_size < index->archive_size || (off_t)st.st_size < index->end_offset) {
+        errno = ESTALE; // Not an append.
+        return -4;
+    }
+    if (tar_index_unmap(index) == -1 || tar_scanner_open(&scanner, index->fd) == -1) {
+        return -4;
+    }
+    scanner.verify = 0; // The status of a bad header is reported below.
+
+    // The appended members start where the end-of-archive marker was.
+    scanner.next = index->end_offset;
+    while ((ret = tar_scanner_next(&scanner, &header, &header_offset)) == 1) {
+        status = tar_header_verify(header);
+        if (status != 0) {
+            break;
+        }
+        if (!tar_is_extra(header->typeflag) &&
+            tar_index_push(index, &capacity, &names_capacity, header, &scanner.member,
+                           header_offset + TAR_HEADER_SIZE) == -1) {
+            break;
+        }
+    }
+    tar_scanner_close(&scanner);
+
+    if (ret == 1 && status == 0) {
+        ret = -1; // tar_index_push() failed.
+    }
+    if (ret == -1 || status != 0) {
+        // Forget the entries added so far: the index stays as it was before the call.
+        index->count = first;
+        index->names_len = names_len;
+        return status != 0 ? status : -4;
+    }
+    if (index->count == first) {
+        index->archive_size = (uint64_t)st.st_size;
+        index->archive_mtime = st.st_mtim;
+        return 0;
+    }
+
+    // The appended headers have all been checked.
+    uint8_t *verified = realloc(index->verified, index->count);
+    if (verified == NULL) {
+        return -4;
+    }
+    memset(verified + first, 1, index->count - first);
+    index->verified = verified;
+
+    // The appended files are hashed too when all the entries before them were.
+    if (index->content_hash_count > 0 && index->content_hash_count == first &&
+        tar_index_hash_range(index, first) == -1) {
+        return -4;
+    }
+
+    // Appended entries can shadow the targets of links, or be the targets of dangling ones.
+    int every_link = tar_index_appended_chains(index, first);
+
+    // The tables below are in name order, into which the appended entries are merged: they are copied, not read again.
+    tar_index_tables(index, tables);
+    free(index->child_start);
+    free(index->children);
+    index->child_start = NULL;
+    index->children = NULL;
+    for (int i = TAR_TABLE_TYPES; i < TAR_TABLE_COUNT; i++) {
+        free(*tables[i].table);
+        *tables[i].table = NULL;
+    }
+    if (tar_index_merge(index, first) == -1 || tar_index_link_children(index) == -1 ||
+        tar_index_decode(index) == -1) {
+        return -4;
+    }
+    tar_index_resolve_appended(index, first, every_link);
+
+    index->end_offset = scanner.next;
+    index->archive_size = (uint64_t)st.st_size;
+    index->archive_mtime = st.st_mtim;
+    return (int)(index->count - first);
+}
+
+/**
+ * Adds the members appended to the archive since the index was built or last updated.
+ */
+int tar_index_update(tar_index_t *index) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_index_append(index);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_UPDATE, NULL, ret);
+    return ret;
+}
+
+static int tar_index_verify_all(const tar_index_t *index) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    off_t header_offset;
+    size_t id = 0;
+    int count = 0, ret, status = 0;
+
+    if (index->verified == NULL) {
+        errno = EBADF;
+        return -4;
+    }
+    if (tar_scanner_open(&scanner, index->fd) == -1) {
+        return -4;
+    }
+    scanner.verify = 0; // The status of a bad header is reported below.
+
+    // The entries are in archive order, so the one of each member header is found by moving forward.
+    while ((ret = tar_scanner_next(&scanner, &header, &header_offset)) == 1 && header_offset < index->end_offset) {
+        off_t data_offset = header_offset + TAR_HEADER_SIZE;
+
+        if ((status = tar_header_verify(header)) != 0) {
+            break;
+        }
+        count++;
+        while (id < index->count && index->entries[id].data_offset < data_offset) {
+            id++;
+        }
+        if (id < index->count && index->entries[id].data_offset == data_offset && !tar_is_extra(header->typeflag)) {
+            __atomic_store_n(&index->verified[id], 1, __ATOMIC_RELAXED);
+        }
+    }
+    tar_scanner_close(&scanner);
+
+    if (status != 0) {
+        return status;
+    }
+    return ret == -1 ? -4 : count;
+}
+
+/**
+ * Checks every header of the indexed members, marking their entries as checked as the scan goes.
+ */
+int tar_index_validate(const tar_index_t *index) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_index_verify_all(index);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_VALIDATE, NULL, ret);
+    return ret;
+}
+
+/**
+ * Releases an index built by tar_index_build().
+ */
+void tar_index_free(tar_index_t *index) {
+    int saved_errno = errno;
+    struct tar_table_ref tables[TAR_TABLE_COUNT];
+
+    if (index == NULL) {
+        return;
+    }
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    } else {
+        tar_index_tables(index, tables);
+        for (int i = 0; i < TAR_TABLE_COUNT; i++) {
+            free(*tables[i].table);
+        }
+    }
+    free(index->verified);
+    free(index);
+    errno = saved_errno;
+}
+
+int exists_index(const tar_index_t *index, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_index_lookup(index, path) != NULL;
+
+    TAR_TRACE_END(trace, TAR_OP_EXISTS_INDEX, path, ret);
+    return ret;
+}
+
+int is_dir_index(const tar_index_t *index, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_index_entry *entry = tar_index_lookup(index, path);
+    int ret = entry != NULL && entry->typeflag == DIRTYPE;
+
+    TAR_TRACE_END(trace, TAR_OP_IS_DIR_INDEX, path, ret);
+    return ret;
+}
+
+int is_file_index(const tar_index_t *index, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_index_entry *entry = tar_index_lookup(index, path);
+    int ret = entry != NULL && tar_is_regular(entry->typeflag);
+
+    TAR_TRACE_END(trace, TAR_OP_IS_FILE_INDEX, path, ret);
+    return ret;
+}
+
+int is_symlink_index(const tar_index_t *index, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_index_entry *entry = tar_index_lookup(index, path);
+    int ret = entry != NULL && entry->typeflag == SYMTYPE;
+
+    TAR_TRACE_END(trace, TAR_OP_IS_SYMLINK_INDEX, path, ret);
+    return ret;
+}
+
+/* Finds the directory at a path of the index, or the one a link at the path points to, NULL if there is none. */
+static const struct tar_index_entry *tar_index_lookup_dir(const tar_index_t *index, const char *path) {
+    const struct tar_index_entry *dir = tar_index_lookup_resolved(index, path);
+    size_t path_len = strlen(path);
+
+    // A link to a directory may be named with a trailing '/', as the directory would be.
+    if (dir == NULL && path_len > 0 && path[path_len - 1] == '/') {
+        ssize_t id = tar_index_get(index, path, path_len - 1);
+
+        if (id != -1 && tar_is_link(index->entries[id].typeflag) && index->entries[id].target != TAR_TARGET_NONE) {
+            dir = &index->entries[index->entries[id].target];
+        }
+    }
+    return dir != NULL && dir->typeflag == DIRTYPE ? dir : NULL;
+}
+
+/* Lists a directory of the index, as list_index() does, returning -1 if memory could not be allocated. */
+static int tar_list_index(const tar_index_t *index, const char *path, struct tar_list_sink *sink) {
+    const struct tar_index_entry *dir = tar_index_lookup_dir(index, path);
+
+    if (dir == NULL) {
+        return 0;
+    }
+
+    size_t id = (size_t)(dir - index->entries);
+    uint32_t start = index->child_start[id], end = index->child_start[id + 1];
+
+    if (sink->arena != NULL && tar_list_sink_reserve(sink, end - start) == -1) {
+        return -1;
+    }
+    for (uint32_t i = start; i < end && sink->count < sink->capacity; i++) {
+        const struct tar_index_entry *child = &index->entries[index->children[i]];
+
+        tar_list_sink_add(sink, tar_index_name(index, child), child->name_len);
+    }
+
+    return 1;
+}
+
+/**
+ * Lists the entries of a directory from the parent-to-children table of the index.
+ */
+int list_index(const tar_index_t *index, const char *path, char **entries, size_t *no_entries) {
+    TAR_TRACE_BEGIN(trace);
+    struct tar_list_sink sink = {.entries = entries, .capacity = *no_entries};
+    int ret = tar_list_index(index, path, &sink);
+
+    if (ret) {
+        *no_entries = sink.count;
+    }
+    TAR_TRACE_END(trace, TAR_OP_LIST_INDEX, path, ret);
+    return ret;
+}
+
+static ssize_t tar_list_index_arena(const tar_index_t *index, const char *path, tar_arena_t *arena,
+                                    const char ***entries) {
+    struct tar_list_sink sink = {.arena = arena};
+    int ret = tar_list_index(index, path, &sink);
+
+    if (ret == 0) {
+        errno = ENOENT;
+    }
+    if (ret != 1) {
+        return -1;
+    }
+    *entries = sink.paths;
+    return (ssize_t)sink.count;
+}
+
+/**
+ * Lists the entries of a directory of the index into an arena.
+ */
+ssize_t list_index_arena(const tar_index_t *index, const char *path, tar_arena_t *arena, const char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_list_index_arena(index, path, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_LIST_INDEX_ARENA, path, ret);
+    return ret;
+}
+
+/*
+ * With lazy validation, checks the header of an entry the first time its data is read through the index.
+ * Returns 0, or -1 with errno set to EBADMSG if the header is invalid, or by the failed read.
+ */
+static int tar_index_verify_entry(const tar_index_t *index, const struct tar_index_entry *entry) {
+    size_t id = (size_t)(entry - index->entries);
+    tar_header_t header;
+    ssize_t bytes_read;
+
+    if (!tar_lazy_validation || index->verified == NULL || __atomic_load_n(&index->verified[id], __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    bytes_read = tar_pread(index->fd, &header, sizeof(header), entry->data_offset - TAR_HEADER_SIZE);
+    if (bytes_read == -1) {
+        return -1;
+    }
+    if (bytes_read != TAR_HEADER_SIZE || tar_header_verify(&header) != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    __atomic_store_n(&index->verified[id], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Reads the data of an entry of the index, as read_file_index() does once links are followed. */
+static ssize_t tar_index_read_entry(const tar_index_t *index, const struct tar_index_entry *entry, size_t offset,
+                                    uint8_t *dest, size_t *len) {
+    if (entry == NULL || !tar_is_regular(entry->typeflag) || tar_index_verify_entry(index, entry) == -1) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    size_t bytes_left = entry->size - offset;
+    size_t bytes_to_read = (*len < bytes_left) ? *len : bytes_left;
+
+    ssize_t bytes_read = tar_pread(index->fd, dest, bytes_to_read, entry->data_offset + (off_t)offset);
+    if (bytes_read == -1) {
+        return -1;
+    }
+
+    *len = bytes_read;
+
+    return bytes_left - bytes_read;
+}
+
+/* Reads a file of the archive through the index, as read_file_index() does. */
+static ssize_t tar_read_file_index(const tar_index_t *index, const char *path, size_t offset, uint8_t *dest,
+                                   size_t *len) {
+    return tar_index_read_entry(index, tar_index_lookup_resolved(index, path), offset, dest, len);
+}
+
+/**
+ * Reads a file of the archive at the data offset recorded in the index.
+ */
+ssize_t read_file_index(const tar_index_t *index, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_file_index(index, path, offset, dest, len);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILE_INDEX, path, ret);
+    return ret;
+}
+
+
+/* Returns the first position of the name-ordered live entries whose path is not below path in the first len bytes. */
+static size_t tar_index_lower_bound(const tar_index_t *index, const char *path, size_t len, int past_prefix) {
+    size_t lo = 0, hi = index->sorted_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(index->names + index->name_offsets[mid], path, len);
+
+        if (cmp < 0 || (past_prefix && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+#define TAR_SELECT_BLOCK 1024
+
+/* Selects the live entries matching a filter, as tar_index_select() does, -1 if memory could not be allocated. */
+static ssize_t tar_index_filter(const tar_index_t *index, const tar_filter_t *filter, struct tar_list_sink *sink) {
+    uint8_t types = filter->types ? (uint8_t)filter->types : 0xFF;
+    uint64_t min_size = filter->min_size, max_size = filter->max_size ? filter->max_size : UINT64_MAX;
+    uint64_t min_mtime = filter->min_mtime;
+    size_t lo = 0, hi = index->sorted_count;
+    ssize_t matches = 0;
+
+    // The entries whose path starts with the prefix are contiguous in name order.
+    if (filter->prefix != NULL) {
+        size_t prefix_len = strlen(filter->prefix);
+
+        lo = tar_index_lower_bound(index, filter->prefix, prefix_len, 0);
+        hi = tar_index_lower_bound(index, filter->prefix, prefix_len, 1);
+    }
+
+    for (size_t base = lo; base < hi; base += TAR_SELECT_BLOCK) {
+        size_t n = hi - base < TAR_SELECT_BLOCK ? hi - base : TAR_SELECT_BLOCK;
+        const uint8_t *block_types = index->types + base;
+        const uint64_t *block_sizes = index->sizes + base, *block_mtimes = index->mtimes + base;
+        uint8_t match[TAR_SELECT_BLOCK];
+
+        // Without branches, so that the compiler can vectorize the comparisons.
+        for (size_t i = 0; i < n; i++) {
+            match[i] = ((block_types[i] & types) != 0) & (block_sizes[i] >= min_size) & (block_sizes[i] <= max_size) &
+                       (block_mtimes[i] >= min_mtime);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (!match[i]) {
+                continue;
+            }
+            const char *name = index->names + index->name_offsets[base + i];
+
+            if (tar_list_sink_add(sink, name, strlen(name)) == -1) {
+                return -1;
+            }
+            matches++;
+        }
+    }
+
+    return matches;
+}
+
+static ssize_t tar_index_select_buffers(const tar_index_t *index, const tar_filter_t *filter, char **entries,
+                                        size_t *no_entries) {
+    struct tar_list_sink sink = {.entries = entries, .capacity = *no_entries};
+    ssize_t matches = tar_index_filter(index, filter, &sink);
+
+    *no_entries = sink.count;
+    return matches;
+}
+
+/**
+ * Selects the live entries matching a filter, with a scan over the metadata arrays.
+ */
+ssize_t tar_index_select(const tar_index_t *index, const tar_filter_t *filter, char **entries, size_t *no_entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_index_select_buffers(index, filter, entries, no_entries);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_SELECT, NULL, ret);
+    return ret;
+}
+
+static ssize_t tar_index_select_into_arena(const tar_index_t *index, const tar_filter_t *filter, tar_arena_t *arena,
+                                           const char ***entries) {
+    struct tar_list_sink sink = {.arena = arena};
+    ssize_t matches = tar_index_filter(index, filter, &sink);
+
+    *entries = sink.paths;
+    return matches;
+}
+
+/**
+ * Selects the live entries matching a filter into an arena.
+ */
+ssize_t tar_index_select_arena(const tar_index_t *index, const tar_filter_t *filter, tar_arena_t *arena,
+                               const char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_index_select_into_arena(index, filter, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_SELECT_ARENA, NULL, ret);
+    return ret;
+}
+
+static ssize_t tar_list_recursive_index(const tar_index_t *index, const char *path, tar_arena_t *arena,
+                                        const char ***entries) {
+    const struct tar_index_entry *dir = tar_index_lookup_dir(index, path);
+
+    if (dir == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // The directory itself comes first in the range of the paths it starts.
+    const char *name = tar_index_name(index, dir);
+    size_t lo = tar_index_lower_bound(index, name, dir->name_len, 0);
+    size_t hi = tar_index_lower_bound(index, name, dir->name_len, 1);
+    if (lo < hi && index->names[index->name_offsets[lo] + dir->name_len] == '\0') {
+        lo++;
+    }
+
+    const char **paths = tar_arena_alloc(arena, (hi - lo) * sizeof(*paths));
+    if (paths == NULL) {
+        return -1;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        paths[i - lo] = index->names + index->name_offsets[i];
+    }
+
+    *entries = paths;
+    return (ssize_t)(hi - lo);
+}
+
+/**
+ * Lists the entries below a directory of the index, from the range of their paths in name order.
+ */
+ssize_t list_recursive_index(const tar_index_t *index, const char *path, tar_arena_t *arena, const char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_list_recursive_index(index, path, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_LIST_RECURSIVE_INDEX, path, ret);
+    return ret;
+}
+
+static ssize_t tar_find_index(const tar_index_t *index, const char *pattern, tar_arena_t *arena,
+                              const char ***entries) {
+    struct tar_list_sink sink = {.arena = arena};
+    size_t pattern_len = strlen(pattern), literal_len = strcspn(pattern, "*?[\\");
+    size_t lo = tar_index_lower_bound(index, pattern, literal_len, 0);
+    size_t hi = tar_index_lower_bound(index, pattern, literal_len, 1);
+
+    for (size_t i = lo; i < hi; i++) {
+        const char *name = index->names + index->name_offsets[i];
+        size_t name_len = strlen(name);
+
+        if (tar_glob_entry(pattern, pattern_len, name, name_len) && tar_list_sink_add(&sink, name, name_len) == -1) {
+            return -1;
+        }
+    }
+
+    *entries = sink.paths;
+    return (ssize_t)sink.count;
+}
+
+/**
+ * Lists the entries of the index whose path matches a glob pattern, testing only those starting with its literal part.
+ */
+ssize_t find_index(const tar_index_t *index, const char *pattern, tar_arena_t *arena, const char ***entries) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_find_index(index, pattern, arena, entries);
+
+    TAR_TRACE_END(trace, TAR_OP_FIND_INDEX, pattern, ret);
+    return ret;
+}
+
+/*
+ * Memory-mapped archives.
+ */
+
+struct tar_mmap {
+    int fd;
+    const uint8_t *base;
+    size_t size;
+};
+
+static tar_mmap_t *tar_mmap_open(const char *path) {
+    struct stat st;
+    tar_mmap_t *archive = calloc(1, sizeof(*archive));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    archive->fd = open(path, O_RDONLY);
+    if (archive->fd == -1) {
+        free(archive);
+        return NULL;
+    }
+    if (fstat(archive->fd, &st) == -1) {
+        goto error;
+    }
+
+    archive->size = (size_t)st.st_size;
+    if (archive->size > 0) {
+        void *base = mmap(NULL, archive->size, PROT_READ, MAP_SHARED, archive->fd, 0);
+        if (base == MAP_FAILED) {
+            goto error;
+        }
+        archive->base = base;
+    }
+    return archive;
+
+error:
+    tar_close_mmap(archive);
+    return NULL;
+}
+
+/**
+ * Opens and maps a tar archive read-only.
+ */
+tar_mmap_t *tar_open_mmap(const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    tar_mmap_t *ret = tar_mmap_open(path);
+
+    TAR_TRACE_END(trace, TAR_OP_OPEN_MMAP, path, ret != NULL);
+    return ret;
+}
+
+/**
+ * Unmaps and closes an archive opened by tar_open_mmap().
+ */
+void tar_close_mmap(tar_mmap_t *archive) {
+    int saved_errno = errno;
+
+    if (archive == NULL) {
+        return;
+    }
+    if (archive->base != NULL) {
+        munmap((void *)archive->base, archive->size);
+    }
+    close(archive->fd);
+    free(archive);
+    errno = saved_errno;
+}
+
+/*
+ * Walks the headers of the mapping until the member at the given path, decoded into member. When or_dir is set, a
+ * directory at the path followed by a '/' matches too, as in tar_scanner_find().
+ */
+static const tar_header_t *tar_mmap_find(const tar_mmap_t *archive, const char *path, int or_dir,
+                                         struct tar_member *member) {
+    size_t offset = 0, path_len = strlen(path);
+
+    member->has_path = member->has_link = member->has_size = 0;
+    while (offset + TAR_HEADER_SIZE <= archive->size) {
+        const tar_header_t *header = (const tar_header_t *)(archive->base + offset);
+        uint64_t size = tar_field_to_u64(header->size, sizeof(header->size));
+
+        if (header->name[0] == '\0') {
+            break;
+        }
+        if (tar_is_extra(header->typeflag)) {
+            // The data of an extra header is read in place, as far as the mapping goes.
+            size_t available = archive->size - offset - TAR_HEADER_SIZE;
+
+            if (size <= TAR_EXTRA_MAX) {
+                tar_member_extra(member, header->typeflag, (const uint8_t *)(header + 1),
+                                 size < available ? (size_t)size : available);
+            }
+        } else {
+            tar_member_finish(member, header);
+            if (tar_member_is(member, path, path_len, or_dir)) {
+                return header;
+            }
+            size = member->size;
+        }
+
+        if (size > archive->size) {
+            break;
+        }
+        offset += TAR_HEADER_SIZE + tar_padded_size(size);
+    }
+    return NULL;
+}
+
+/* Same as tar_mmap_find(), following links, each hop walking the mapping from its first header again. */
+static const tar_header_t *tar_mmap_find_resolved(const tar_mmap_t *archive, const char *path,
+                                                  struct tar_member *member) {
+    char target[PATH_MAX];
+    const tar_header_t *header = tar_mmap_find(archive, path, 0, member);
+
+    for (int depth = 0; header != NULL && tar_is_link(header->typeflag); depth++) {
+        if (depth == TAR_MAX_LINK_DEPTH || tar_member_link_target(member, header->typeflag, target) == -1) {
+            return NULL;
+        }
+        header = tar_mmap_find(archive, target, 1, member);
+    }
+    return header;
+}
+
+/**
+ * Walks the headers of the mapping until the one at the given path.
+ */
+const tar_header_t *tar_mmap_header(const tar_mmap_t *archive, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    struct tar_member member;
+    const tar_header_t *ret = tar_mmap_find(archive, path, 0, &member);
+
+    TAR_TRACE_END(trace, TAR_OP_MMAP_HEADER, path, ret != NULL);
+    return ret;
+}
+
+static ssize_t tar_read_file_view(const tar_mmap_t *archive, const char *path, size_t offset, const uint8_t **dest,
+                                  size_t *len) {
+    struct tar_member member;
+    const tar_header_t *header = tar_mmap_find_resolved(archive, path, &member);
+
+    if (header == NULL || !tar_is_regular(header->typeflag)) {
+        return -1;
+    }
+
+    uint64_t file_size = member.size;
+    const uint8_t *data = (const uint8_t *)(header + 1);
+
+    // A truncated archive does not hold the whole file in the mapping.
+    if (file_size > (uint64_t)(archive->base + archive->size - data)) {
+        return -1;
+    }
+    if (offset >= file_size) {
+        return -2;
+    }
+
+    size_t bytes_left = file_size - offset;
+
+    *dest = data + offset;
+    if (*len > bytes_left) {
+        *len = bytes_left;
+    }
+
+    return bytes_left - *len;
+}
+
+/**
+ * Reads a file of a mapped archive without copying it.
+ */
+ssize_t read_file_view(const tar_mmap_t *archive, const char *path, size_t offset, const uint8_t **dest, size_t *len) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_file_view(archive, path, offset, dest, len);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILE_VIEW, path, ret);
+    return ret;
+}
+
+
+/*
+ * Streaming iterator.
+ */
+
+struct tar_iter {
+    struct tar_scanner scanner;
+};
+
+static tar_iter_t *tar_iter_start(int tar_fd) {
+    tar_iter_t *iter = malloc(sizeof(*iter));
+
+    if (iter == NULL) {
+        return NULL;
+    }
+    if (tar_scanner_open(&iter->scanner, tar_fd) == -1) {
+        free(iter);
+        return NULL;
+    }
+    return iter;
+}
+
+/**
+ * Starts iterating over the entries of an archive.
+ */
+tar_iter_t *tar_iter_open(int tar_fd) {
+    TAR_TRACE_BEGIN(trace);
+    tar_iter_t *ret = tar_iter_start(tar_fd);
+
+    TAR_TRACE_END(trace, TAR_OP_ITER_OPEN, NULL, ret != NULL);
+    return ret;
+}
+
+static int tar_iter_advance(tar_iter_t *iter, tar_entry_t *entry) {
+    const tar_header_t *header;
+    off_t header_offset;
+    int ret = tar_scanner_next_member(&iter->scanner, &header, &header_offset);
+
+    if (ret != 1) {
+        return ret;
+    }
+
+    entry->name = iter->scanner.member.path;
+    entry->name_len = iter->scanner.member.path_len;
+    entry->typeflag = header->typeflag;
+    entry->size = iter->scanner.member.size;
+    entry->data_offset = header_offset + TAR_HEADER_SIZE;
+    entry->header = header;
+    return 1;
+}
+
+/**
+ * Moves to the next entry of the archive.
+ */
+int tar_iter_next(tar_iter_t *iter, tar_entry_t *entry) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_iter_advance(iter, entry);
+
+    TAR_TRACE_END(trace, TAR_OP_ITER_NEXT, NULL, ret);
+    return ret;
+}
+
+/**
+ * Releases an iterator.
+ */
+void tar_iter_close(tar_iter_t *iter) {
+    if (iter == NULL) {
+        return;
+    }
+    tar_scanner_close(&iter->scanner);
+    free(iter);
+}
+
+
+/*
+ * Access hints.
+ *
+ * The kernel reads ahead of sequential reads and keeps what was read, which suits neither a lookup through an index,
+ * whose read-ahead is wasted, nor a single scan over an archive larger than the cache, which evicts everything else.
+ * The access patterns map to posix_fadvise() advice for file descriptors and to madvise() advice for mappings.
+ */
+
+/**
+ * Gives the kernel the access pattern of an archive file.
+ */
+int tar_advise(int tar_fd, enum tar_access access) {
+    int err;
+
+    switch (access) {
+    case TAR_ACCESS_NORMAL:
+        err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_NORMAL);
+        break;
+    case TAR_ACCESS_SEQUENTIAL:
+        err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        break;
+    case TAR_ACCESS_RANDOM:
+        err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_RANDOM);
+        break;
+    case TAR_ACCESS_ONCE:
+        // Pages read without reuse are not promoted to the active list, on kernels where the advice is not a no-op.
+        err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (err == 0) {
+            err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_NOREUSE);
+        }
+        break;
+    case TAR_ACCESS_WILLNEED:
+        err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_WILLNEED);
+        break;
+    case TAR_ACCESS_DONTNEED:
+        err = posix_fadvise(tar_fd, 0, 0, POSIX_FADV_DONTNEED);
+        break;
+    default:
+        err = EINVAL;
+        break;
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Gives the kernel the access pattern of a mapped archive.
+ */
+int tar_mmap_advise(tar_mmap_t *archive, enum tar_access access) {
+    int advice;
+
+    switch (access) {
+    case TAR_ACCESS_NORMAL:
+        advice = MADV_NORMAL;
+        break;
+    case TAR_ACCESS_SEQUENTIAL:
+    case TAR_ACCESS_ONCE:
+        // Pages of a sequential mapping are the first reclaimed once accessed.
+        advice = MADV_SEQUENTIAL;
+        break;
+    case TAR_ACCESS_RANDOM:
+        advice = MADV_RANDOM;
+        break;
+    case TAR_ACCESS_WILLNEED:
+        advice = MADV_WILLNEED;
+        break;
+    case TAR_ACCESS_DONTNEED:
+        advice = MADV_DONTNEED;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (archive->size > 0 && madvise((void *)archive->base, archive->size, advice) == -1) {
+        return -1;
+    }
+    // Unmapping the pages leaves them in the page cache, from which they are dropped once no process maps them.
+    return access == TAR_ACCESS_DONTNEED ? tar_advise(archive->fd, access) : 0;
+}
+
+/* Asks the kernel to read the part of [offset, offset + size) past *advised_end, and moves *advised_end past it. */
+static int tar_prefetch_range(int fd, off_t offset, uint64_t size, off_t *advised_end) {
+    off_t start = offset > *advised_end ? offset : *advised_end, end = offset + (off_t)size;
+    int err;
+
+    if (end <= start) {
+        return 0;
+    }
+    if ((err = posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED)) != 0) {
+        errno = err;
+        return -1;
+    }
+    *advised_end = end;
+    return 0;
+}
+
+
+/*
+ * Batched reads.
+ */
+
+struct tar_batch_request {
+    const char *path;
+    size_t i;                   /* position of the path in the caller's array */
+    off_t data_offset;
+    uint64_t size;
+};
+
+static int tar_batch_request_cmp_path(const void *a, const void *b) {
+    const struct tar_batch_request *ra = a, *rb = b;
+    int cmp = strcmp(ra->path, rb->path);
+
+    return cmp != 0 ? cmp : (ra->i > rb->i) - (ra->i < rb->i);
+}
+
+/* A requested path met as a link during the sweep, and the path its chain of links has got to. */
+struct tar_batch_link {
+    size_t r;                   /* position in requests of the first request for the path */
+    int hops;                   /* links followed so far */
+    int matched;                /* set once the target is met during a pass */
+    char *target;
+    char *next;                 /* the next target, when the target is itself a link */
+    char *mark;                 /* a target met earlier, kept at each power of two hops to detect loops */
+};
+
+static int tar_batch_link_cmp(const void *a, const void *b) {
+    return strcmp(((const struct tar_batch_link *)a)->target, ((const struct tar_batch_link *)b)->target);
+}
+
+/* Compares a target to the first len bytes of a path. */
+static int tar_batch_target_cmp(const char *target, const char *path, size_t len) {
+    int cmp = strncmp(target, path, len);
+
+    return cmp != 0 ? cmp : target[len] != '\0';
+}
+
+/* Delivers the data of the member the scanner is on to every request for the path at position r. */
+static int tar_batch_deliver(struct tar_scanner *scanner, struct tar_batch_request *requests, size_t n, size_t r,
+                             off_t header_offset, tar_batch_cb_t callback, void *arg, ssize_t *delivered) {
+    const char *path = requests[r].path;
+    uint64_t size = scanner->member.size;
+    off_t next = scanner->next;
+
+    for (; r < n && strcmp(requests[r].path, path) == 0; r++) {
+        int ret = tar_scanner_deliver(scanner, header_offset + TAR_HEADER_SIZE, size, requests[r].i, callback, arg);
+
+        if (ret != 0) {
+            return ret;
+        }
+        (*delivered)++;
+    }
+    scanner->next = next;
+    return 0;
+}
+
+/*
+ * Resolves the links met during the sweep, all together: each pass over the archive follows one more hop of every
+ * chain, so that the passes are as many as the hops of the longest one. Returns 0, -1 or -2 like tar_scanner_deliver().
+ */
+static int tar_batch_resolve(struct tar_scanner *scanner, struct tar_batch_request *requests, size_t n,
+                             struct tar_batch_link *links, size_t *link_count, tar_batch_cb_t callback, void *arg,
+                             ssize_t *delivered) {
+    const tar_header_t *header;
+    off_t header_offset;
+    char target[PATH_MAX];
+    int ret = 0;
+
+    while (*link_count > 0) {
+        qsort(links, *link_count, sizeof(*links), tar_batch_link_cmp);
+        tar_scanner_rewind(scanner);
+
+        while ((ret = tar_scanner_next_member(scanner, &header, &header_offset)) == 1) {
+            const char *path = scanner->member.path;
+            size_t len = scanner->member.path_len, low = 0, high = *link_count;
+
+            // Targets name directories without their trailing '/'.
+            if (len > 0 && path[len - 1] == '/') {
+                len--;
+            }
+            while (low < high) {
+                size_t mid = low + (high - low) / 2;
+
+                if (tar_batch_target_cmp(links[mid].target, path, len) < 0) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+
+            // As with a rescan for each link, only the first member at the target counts.
+            for (size_t l = low; l < *link_count && tar_batch_target_cmp(links[l].target, path, len) == 0; l++) {
+                if (links[l].matched) {
+                    continue;
+                }
+                links[l].matched = 1;
+                if (tar_is_regular(header->typeflag)) {
+                    ret = tar_batch_deliver(scanner, requests, n, links[l].r, header_offset, callback, arg, delivered);
+                    if (ret != 0) {
+                        return ret;
+                    }
+                } else if (tar_is_link(header->typeflag) && links[l].hops < TAR_MAX_LINK_DEPTH &&
+                           tar_member_link_target(&scanner->member, header->typeflag, target) != -1) {
+                    if ((links[l].next = strdup(target)) == NULL) {
+                        return -1;
+                    }
+                }
+            }
+        }
+        if (ret == -1) {
+            return -1;
+        }
+
+        // Only the chains which met another link go on to the next pass, unless they come back to their mark.
+        size_t kept = 0;
+        for (size_t l = 0; l < *link_count; l++) {
+            struct tar_batch_link link = links[l];
+
+            if (link.next != NULL && (link.mark == NULL || strcmp(link.next, link.mark) != 0)) {
+                if ((link.hops & (link.hops - 1)) == 0) {
+                    free(link.mark);
+                    link.mark = link.target;
+                } else {
+                    free(link.target);
+                }
+                link.target = link.next;
+                link.next = NULL;
+                link.matched = 0;
+                link.hops++;
+                links[kept++] = link;
+            } else {
+                free(link.target);
+                free(link.next);
+                free(link.mark);
+            }
+        }
+        *link_count = kept;
+    }
+    return 0;
+}
+
+static int tar_batch_request_cmp_offset(const void *a, const void *b) {
+    const struct tar_batch_request *ra = a, *rb = b;
+
+    if (ra->data_offset != rb->data_offset) {
+        return ra->data_offset < rb->data_offset ? -1 : 1;
+    }
+    return (ra->i > rb->i) - (ra->i < rb->i);
+}
+
+static ssize_t tar_read_files_batch(int tar_fd, char **paths, size_t n, tar_batch_cb_t callback, void *arg) {
+    struct tar_batch_request *requests = malloc((n ? n : 1) * sizeof(*requests));
+    struct tar_batch_link *links = malloc((n ? n : 1) * sizeof(*links));
+    uint8_t *done = calloc(n ? n : 1, 1);   /* for the first request of a path: 1 once delivered, 2 once a link */
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    off_t header_offset;
+    char target[PATH_MAX];
+    size_t link_count = 0;
+    ssize_t delivered = 0;
+    int ret = -1;
+
+    if (requests == NULL || links == NULL || done == NULL || tar_scanner_open(&scanner, tar_fd) == -1) {
+        free(requests);
+        free(links);
+        free(done);
+        return -1;
+    }
+
+    // Requested paths are sorted, so that matching a header against all of them is a binary search.
+    for (size_t i = 0; i < n; i++) {
+        requests[i].path = paths[i];
+        requests[i].i = i;
+    }
+    qsort(requests, n, sizeof(*requests), tar_batch_request_cmp_path);
+
+    while ((ret = tar_scanner_next_member(&scanner, &header, &header_offset)) == 1) {
+        const char *path = scanner.member.path;
+        size_t low = 0, high = n;
+
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+
+            if (strcmp(requests[mid].path, path) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low == n || strcmp(requests[low].path, path) != 0 || done[low] == 1) {
+            continue;
+        }
+
+        // Links are followed once the sweep is over, as what they point to may already be behind.
+        if (tar_is_link(header->typeflag)) {
+            if (done[low] == 0 && tar_member_link_target(&scanner.member, header->typeflag, target) != -1) {
+                if ((links[link_count].target = strdup(target)) == NULL) {
+                    ret = -1;
+                    goto out;
+                }
+                links[link_count].r = low;
+                links[link_count].hops = 1;
+                links[link_count].matched = 0;
+                links[link_count].next = links[link_count].mark = NULL;
+                link_count++;
+            }
+            done[low] = 2;
+            continue;
+        }
+        if (!tar_is_regular(header->typeflag)) {
+            continue;
+        }
+        if ((ret = tar_batch_deliver(&scanner, requests, n, low, header_offset, callback, arg, &delivered)) != 0) {
+            goto out;
+        }
+        done[low] = 1;
+    }
+    if (ret == -1) {
+        goto out;
+    }
+
+    // A path delivered as a regular member after being met as a link is not resolved.
+    size_t kept = 0;
+    for (size_t l = 0; l < link_count; l++) {
+        if (done[links[l].r] == 1) {
+            free(links[l].target);
+        } else {
+            links[kept++] = links[l];
+        }
+    }
+    link_count = kept;
+    ret = tar_batch_resolve(&scanner, requests, n, links, &link_count, callback, arg, &delivered);
+
+out:
+    for (size_t l = 0; l < link_count; l++) {
+        free(links[l].target);
+        free(links[l].next);
+        free(links[l].mark);
+    }
+    tar_scanner_close(&scanner);
+    free(requests);
+    free(links);
+    free(done);
+    return ret == 0 ? delivered : -1;
+}
+
+/**
+ * Reads several files of the archive in a single pass over it.
+ */
+ssize_t read_files_batch(int tar_fd, char **paths, size_t n, tar_batch_cb_t callback, void *arg) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_files_batch(tar_fd, paths, n, callback, arg);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILES_BATCH, NULL, ret);
+    return ret;
+}
+
+static ssize_t tar_read_files_batch_index(const tar_index_t *index, char **paths, size_t n, tar_batch_cb_t callback,
+                                          void *arg) {
+    struct tar_batch_request *requests = malloc((n ? n : 1) * sizeof(*requests));
+    struct tar_scanner scanner;
+    size_t count = 0;
+    ssize_t delivered = 0;
+
+    if (requests == NULL || tar_scanner_open(&scanner, index->fd) == -1) {
+        free(requests);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const struct tar_index_entry *entry = tar_index_lookup_resolved(index, paths[i]);
+
+        if (entry != NULL && tar_is_regular(entry->typeflag)) {
+            if (tar_index_verify_entry(index, entry) == -1) {
+                tar_scanner_close(&scanner);
+                free(requests);
+                return -1;
+            }
+            requests[count].path = paths[i];
+            requests[count].i = i;
+            requests[count].data_offset = entry->data_offset;
+            requests[count].size = entry->size;
+            count++;
+        }
+    }
+    qsort(requests, count, sizeof(*requests), tar_batch_request_cmp_offset);
+
+    // Members close to each other are served from the same chunk, far ones by moving the buffer forward.
+    size_t ahead = 0;
+    off_t advised_end = 0;
+    for (size_t r = 0; r < count; r++) {
+        // The kernel reads the next members while this one is delivered. A failed hint only costs the prefetch.
+        for (; ahead < count && ahead <= r + TAR_PREFETCH_AHEAD; ahead++) {
+            tar_prefetch_range(index->fd, requests[ahead].data_offset, requests[ahead].size, &advised_end);
+        }
+
+        int ret = tar_scanner_deliver(&scanner, requests[r].data_offset, requests[r].size, requests[r].i, callback,
+                                      arg);
+
+        if (ret != 0) {
+            delivered = -1;
+            break;
+        }
+        delivered++;
+    }
+
+    tar_scanner_close(&scanner);
+    free(requests);
+    return delivered;
+}
+
+/**
+ * Reads several files of the archive in a single ascending sweep, at the data offsets recorded in the index.
+ */
+ssize_t read_files_batch_index(const tar_index_t *index, char **paths, size_t n, tar_batch_cb_t callback, void *arg) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_files_batch_index(index, paths, n, callback, arg);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILES_BATCH_INDEX, NULL, ret);
+    return ret;
+}
+
+static ssize_t tar_index_prefetch_paths(const tar_index_t *index, char **paths, size_t n) {
+    ssize_t prefetched = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const struct tar_index_entry *entry = tar_index_lookup_resolved(index, paths[i]);
+        off_t advised_end = 0;
+
+        if (entry == NULL || !tar_is_regular(entry->typeflag)) {
+            continue;
+        }
+        if (tar_prefetch_range(index->fd, entry->data_offset, entry->size, &advised_end) == -1) {
+            return -1;
+        }
+        prefetched++;
+    }
+    return prefetched;
+}
+
+/**
+ * Asks the kernel to start reading the data of files of the archive, at the data offsets recorded in the index.
+ */
+ssize_t tar_index_prefetch(const tar_index_t *index, char **paths, size_t n) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_index_prefetch_paths(index, paths, n);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_PREFETCH, NULL, ret);
+    return ret;
+}
+
+
+/*
+ * File streams.
+ */
+
+struct tar_file_stream {
+    int fd;
+    off_t data_offset;
+    uint64_t size;
+    uint64_t position;
+};
+
+static tar_file_stream_t *tar_stream_new(int tar_fd, off_t data_offset, uint64_t size) {
+    tar_file_stream_t *stream = malloc(sizeof(*stream));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->fd = tar_fd;
+    stream->data_offset = data_offset;
+    stream->size = size;
+    stream->position = 0;
+    return stream;
+}
+
+static tar_file_stream_t *tar_stream_start(int tar_fd, const char *path) {
+    struct tar_scanner scanner;
+    const tar_header_t *header;
+    off_t header_offset;
+    tar_file_stream_t *stream = NULL;
+    int found;
+
+    if (tar_scanner_open(&scanner, tar_fd) == -1) {
+        return NULL;
+    }
+    found = tar_scanner_find_resolved(&scanner, path, &header, &header_offset);
+    if (found == 1 && tar_is_regular(header->typeflag)) {
+        stream = tar_stream_new(tar_fd, header_offset + TAR_HEADER_SIZE, scanner.member.size);
+    } else if (found != -1) {
+        errno = ENOENT;
+    }
+    tar_scanner_close(&scanner);
+    return stream;
+}
+
+/**
+ * Opens a stream over a file of the archive, looked up with a single scan.
+ */
+tar_file_stream_t *tar_stream_open(int tar_fd, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    tar_file_stream_t *ret = tar_stream_start(tar_fd, path);
+
+    TAR_TRACE_END(trace, TAR_OP_STREAM_OPEN, path, ret != NULL);
+    return ret;
+}
+
+static tar_file_stream_t *tar_stream_start_index(const tar_index_t *index, const char *path) {
+    const struct tar_index_entry *entry = tar_index_lookup_resolved(index, path);
+
+    if (entry == NULL || !tar_is_regular(entry->typeflag)) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (tar_index_verify_entry(index, entry) == -1) {
+        return NULL;
+    }
+    return tar_stream_new(index->fd, entry->data_offset, entry->size);
+}
+
+/**
+ * Opens a stream over a file of the archive, looked up in the index.
+ */
+tar_file_stream_t *tar_stream_open_index(const tar_index_t *index, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    tar_file_stream_t *ret = tar_stream_start_index(index, path);
+
+    TAR_TRACE_END(trace, TAR_OP_STREAM_OPEN_INDEX, path, ret != NULL);
+    return ret;
+}
+
+static ssize_t tar_stream_fill(tar_file_stream_t *stream, uint8_t *dest, size_t *len) {
+    if (stream->position >= stream->size) {
+        return -2;
+    }
+
+    uint64_t bytes_left = stream->size - stream->position;
+    size_t bytes_to_read = (*len < bytes_left) ? *len : (size_t)bytes_left;
+
+    ssize_t bytes_read = tar_pread(stream->fd, dest, bytes_to_read, stream->data_offset + (off_t)stream->position);
+    if (bytes_read == -1) {
+        return -1;
+    }
+
+    *len = bytes_read;
+    stream->position += (uint64_t)bytes_read;
+
+    return bytes_left - bytes_read;
+}
+
+/**
+ * Reads from the current position of the stream.
+ */
+ssize_t tar_stream_read(tar_file_stream_t *stream, uint8_t *dest, size_t *len) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_stream_fill(stream, dest, len);
+
+    TAR_TRACE_END(trace, TAR_OP_STREAM_READ, NULL, ret);
+    return ret;
+}
+
+static int tar_stream_move(tar_file_stream_t *stream, uint64_t offset) {
+    if (offset > stream->size) {
+        return -2;
+    }
+    stream->position = offset;
+    return 0;
+}
+
+/**
+ * Moves the position of the stream.
+ */
+int tar_stream_seek(tar_file_stream_t *stream, uint64_t offset) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_stream_move(stream, offset);
+
+    TAR_TRACE_END(trace, TAR_OP_STREAM_SEEK, NULL, ret);
+    return ret;
+}
+
+uint64_t tar_stream_tell(const tar_file_stream_t *stream) {
+    return stream->position;
+}
+
+uint64_t tar_stream_size(const tar_file_stream_t *stream) {
+    return stream->size;
+}
+
+/**
+ * Releases a stream.
+ */
+void tar_stream_close(tar_file_stream_t *stream) {
+    free(stream);
+}
+
+
+/*
+ * Asynchronous reads.
+ *
+ * io_uring is driven directly through its system calls and shared rings. Each request owns a slot, whose position is
+ * the user_data of its submission and completion entries; free slots are chained in a list.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TAR_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef TAR_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+struct tar_async_slot {
+    tar_async_cb_t callback;
+    void *arg;
+    int fd;
+    uint8_t *dest;
+    size_t len;
+    off_t offset;
+    uint64_t bytes_left;        /* bytes of the file from the start of the read to its end */
+    ssize_t result;             /* bytes read or -errno, once complete without io_uring */
+    uint32_t next;              /* next free slot, or next slot in the queue */
+};
+
+struct tar_async {
+    struct tar_async_slot *slots;
+    unsigned depth;
+    uint32_t free_list;
+    uint32_t queue_head, queue_tail;     /* requests queued but not submitted */
+    uint32_t done_head, done_tail;       /* requests completed without io_uring, waiting for their callbacks */
+    unsigned queued, inflight;
+    int ring_fd;                         /* -1 when io_uring is not used */
+#ifdef TAR_HAVE_IO_URING
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+#define TAR_ASYNC_NONE UINT32_MAX
+
+static void tar_async_push(struct tar_async *async, uint32_t *head, uint32_t *tail, uint32_t slot) {
+    async->slots[slot].next = TAR_ASYNC_NONE;
+    if (*tail == TAR_ASYNC_NONE) {
+        *head = slot;
+    } else {
+        async->slots[*tail].next = slot;
+    }
+    *tail = slot;
+}
+
+static uint32_t tar_async_pop(struct tar_async *async, uint32_t *head, uint32_t *tail) {
+    uint32_t slot = *head;
+
+    if (slot != TAR_ASYNC_NONE) {
+        *head = async->slots[slot].next;
+        if (*head == TAR_ASYNC_NONE) {
+            *tail = TAR_ASYNC_NONE;
+        }
+    }
+    return slot;
+}
+
+/* Runs the callback of a completed request and frees its slot. */
+static void tar_async_complete(struct tar_async *async, uint32_t slot, ssize_t result) {
+    struct tar_async_slot *request = &async->slots[slot];
+    tar_async_cb_t callback = request->callback;
+    void *arg = request->arg;
+    uint64_t bytes_left = request->bytes_left;
+
+    request->next = async->free_list;
+    async->free_list = slot;
+    async->inflight--;
+
+    if (result < 0) {
+        callback(-1, 0, arg);
+    } else {
+        callback((ssize_t)(bytes_left - (uint64_t)result), (size_t)result, arg);
+    }
+}
+
+#ifdef TAR_HAVE_IO_URING
+
+static int tar_uring_setup(struct tar_async *async) {
+    struct io_uring_params params;
+    void *ring;
+
+    memset(&params, 0, sizeof(params));
+    async->ring_fd = (int)syscall(__NR_io_uring_setup, async->depth, &params);
+    if (async->ring_fd == -1) {
+        return -1;
+    }
+
+    async->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    async->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (async->cq_ring_size > async->sq_ring_size) {
+            async->sq_ring_size = async->cq_ring_size;
+        }
+        async->cq_ring_size = 0;
+    }
+
+    ring = mmap(NULL, async->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd,
+                IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        goto error;
+    }
+    async->sq_ring = ring;
+    async->cq_ring = ring;
+    if (async->cq_ring_size > 0) {
+        ring = mmap(NULL, async->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd,
+                    IORING_OFF_CQ_RING);
+        if (ring == MAP_FAILED) {
+            goto error;
+        }
+        async->cq_ring = ring;
+    }
+
+    async->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring = mmap(NULL, async->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd,
+                IORING_OFF_SQES);
+    if (ring == MAP_FAILED) {
+        goto error;
+    }
+    async->sqes = ring;
+
+    async->sq_head = (unsigned *)((char *)async->sq_ring + params.sq_off.head);
+    async->sq_tail = (unsigned *)((char *)async->sq_ring + params.sq_off.tail);
+    async->sq_mask = (unsigned *)((char *)async->sq_ring + params.sq_off.ring_mask);
+    async->sq_array = (unsigned *)((char *)async->sq_ring + params.sq_off.array);
+    async->sq_entries = params.sq_entries;
+    async->cq_head = (unsigned *)((char *)async->cq_ring + params.cq_off.head);
+    async->cq_tail = (unsigned *)((char *)async->cq_ring + params.cq_off.tail);
+    async->cq_mask = (unsigned *)((char *)async->cq_ring + params.cq_off.ring_mask);
+    async->cqes = (struct io_uring_cqe *)((char *)async->cq_ring + params.cq_off.cqes);
+    return 0;
+
+error:
+    if (async->sq_ring != NULL) {
+        munmap(async->sq_ring, async->sq_ring_size);
+    }
+    if (async->cq_ring_size > 0 && async->cq_ring != NULL && async->cq_ring != async->sq_ring) {
+        munmap(async->cq_ring, async->cq_ring_size);
+    }
+    async->sq_ring = async->cq_ring = NULL;
+    close(async->ring_fd);
+    async->ring_fd = -1;
+    return -1;
+}
+
+static void tar_uring_teardown(struct tar_async *async) {
+    if (async->ring_fd == -1) {
+        return;
+    }
+    munmap(async->sqes, async->sqes_size);
+    if (async->cq_ring_size > 0) {
+        munmap(async->cq_ring, async->cq_ring_size);
+    }
+    munmap(async->sq_ring, async->sq_ring_size);
+    close(async->ring_fd);
+}
+
+/* Moves the queued requests to the submission ring and enters the kernel. */
+static int tar_uring_enter(struct tar_async *async, unsigned min_complete) {
+    unsigned tail = *async->sq_tail;
+
+    while (async->queued > 0 && tail - __atomic_load_n(async->sq_head, __ATOMIC_ACQUIRE) < async->sq_entries) {
+        uint32_t slot = tar_async_pop(async, &async->queue_head, &async->queue_tail);
+        struct tar_async_slot *request = &async->slots[slot];
+        unsigned position = tail & *async->sq_mask;
+        struct io_uring_sqe *sqe = &async->sqes[position];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = request->fd;
+        sqe->addr = (uint64_t)(uintptr_t)request->dest;
+        sqe->len = (uint32_t)request->len;
+        sqe->off = (uint64_t)request->offset;
+        sqe->user_data = slot;
+        async->sq_array[position] = position;
+        tail++;
+        async->queued--;
+        async->inflight++;
+    }
+    __atomic_store_n(async->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Entries left over by a previous short submission are sent again along with the new ones.
+    unsigned to_submit = tail - __atomic_load_n(async->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+
+    long ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, async->ring_fd, to_submit, min_complete,
+                      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        TAR_COUNT(syscalls, 1);
+    } while (ret == -1 && errno == EINTR);
+    return ret == -1 ? -1 : 0;
+}
+
+/* Runs the callbacks of the requests in the completion ring. */
+static int tar_uring_reap(struct tar_async *async) {
+    unsigned head = *async->cq_head;
+    unsigned tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+    int completed = 0;
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &async->cqes[head & *async->cq_mask];
+        uint32_t slot = (uint32_t)cqe->user_data;
+        ssize_t result = cqe->res;
+
+        if (result > 0) {
+            TAR_COUNT(bytes_read, result);
+        }
+        head++;
+        __atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+        tar_async_complete(async, slot, result);
+        completed++;
+    }
+    return completed;
+}
+
+#endif
+
+/**
+ * Creates an asynchronous read engine.
+ */
+tar_async_t *tar_async_create(unsigned depth) {
+    tar_async_t *async = calloc(1, sizeof(*async));
+
+    if (async == NULL) {
+        return NULL;
+    }
+    async->depth = depth > 0 ? depth : 1;
+    async->slots = malloc(async->depth * sizeof(*async->slots));
+    if (async->slots == NULL) {
+        free(async);
+        return NULL;
+    }
+    for (unsigned i = 0; i < async->depth; i++) {
+        async->slots[i].next = i + 1 < async->depth ? i + 1 : TAR_ASYNC_NONE;
+    }
+    async->free_list = 0;
+    async->queue_head = async->queue_tail = TAR_ASYNC_NONE;
+    async->done_head = async->done_tail = TAR_ASYNC_NONE;
+    async->ring_fd = -1;
+
+#ifdef TAR_HAVE_IO_URING
+    // Without io_uring (old kernel, seccomp filter), requests are served with pread().
+    tar_uring_setup(async);
+#endif
+    return async;
+}
+
+static int tar_async_enter(tar_async_t *async) {
+    unsigned queued = async->queued;
+
+#ifdef TAR_HAVE_IO_URING
+    if (async->ring_fd != -1) {
+        return tar_uring_enter(async, 0) == -1 ? -1 : (int)(queued - async->queued);
+    }
+#endif
+
+    while (async->queued > 0) {
+        uint32_t slot = tar_async_pop(async, &async->queue_head, &async->queue_tail);
+        struct tar_async_slot *request = &async->slots[slot];
+
+        request->result = tar_pread(request->fd, request->dest, request->len, request->offset);
+        tar_async_push(async, &async->done_head, &async->done_tail, slot);
+        async->queued--;
+        async->inflight++;
+    }
+    return (int)queued;
+}
+
+/**
+ * Sends all queued requests to the kernel at once.
+ */
+int tar_async_submit(tar_async_t *async) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_async_enter(async);
+
+    TAR_TRACE_END(trace, TAR_OP_ASYNC_SUBMIT, NULL, ret);
+    return ret;
+}
+
+static int tar_async_reap(tar_async_t *async, unsigned min_complete) {
+    int completed = 0;
+
+#ifdef TAR_HAVE_IO_URING
+    if (async->ring_fd != -1) {
+        while (1) {
+            unsigned pending = async->inflight + async->queued;
+            unsigned wanted = min_complete - (unsigned)completed;
+
+            if (wanted > pending) {
+                wanted = pending;
+            }
+            if (tar_uring_enter(async, (unsigned)completed < min_complete ? wanted : 0) == -1) {
+                return -1;
+            }
+            completed += tar_uring_reap(async);
+            if ((unsigned)completed >= min_complete || async->inflight + async->queued == 0) {
+                return completed;
+            }
+        }
+    }
+#endif
+
+    if (tar_async_enter(async) == -1) {
+        return -1;
+    }
+    uint32_t slot;
+    while ((slot = tar_async_pop(async, &async->done_head, &async->done_tail)) != TAR_ASYNC_NONE) {
+        tar_async_complete(async, slot, async->slots[slot].result);
+        completed++;
+    }
+    return completed;
+}
+
+/**
+ * Waits for completed requests and runs their callbacks.
+ */
+int tar_async_wait(tar_async_t *async, unsigned min_complete) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_async_reap(async, min_complete);
+
+    TAR_TRACE_END(trace, TAR_OP_ASYNC_WAIT, NULL, ret);
+    return ret;
+}
+
+static int tar_async_queue(tar_async_t *async, const tar_index_t *index, const char *path, size_t offset, uint8_t *dest,
+                           size_t len, tar_async_cb_t callback, void *arg) {
+    const struct tar_index_entry *entry = tar_index_lookup_resolved(index, path);
+
+    if (entry == NULL || !tar_is_regular(entry->typeflag) || tar_index_verify_entry(index, entry) == -1) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    if (async->free_list == TAR_ASYNC_NONE && tar_async_reap(async, 1) == -1) {
+        return -1;
+    }
+
+    uint32_t slot = async->free_list;
+    struct tar_async_slot *request = &async->slots[slot];
+    uint64_t bytes_left = entry->size - offset;
+
+    async->free_list = request->next;
+    request->callback = callback;
+    request->arg = arg;
+    request->fd = index->fd;
+    request->dest = dest;
+    request->len = len < bytes_left ? len : (size_t)bytes_left;
+    if (request->len > UINT32_MAX) {
+        request->len = UINT32_MAX;   // Limit of a single io_uring read.
+    }
+    request->offset = entry->data_offset + (off_t)offset;
+    request->bytes_left = bytes_left;
+    tar_async_push(async, &async->queue_head, &async->queue_tail, slot);
+    async->queued++;
+    return 0;
+}
+
+/**
+ * Queues a read of a file of an archive.
+ */
+int tar_async_read(tar_async_t *async, const tar_index_t *index, const char *path, size_t offset, uint8_t *dest,
+                   size_t len, tar_async_cb_t callback, void *arg) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_async_queue(async, index, path, offset, dest, len, callback, arg);
+
+    TAR_TRACE_END(trace, TAR_OP_ASYNC_READ, path, ret);
+    return ret;
+}
+
+/**
+ * Waits for all requests and releases the engine.
+ */
+void tar_async_destroy(tar_async_t *async) {
+    if (async == NULL) {
+        return;
+    }
+    while (async->inflight + async->queued > 0) {
+        if (tar_async_reap(async, async->inflight + async->queued) == -1) {
+            break;
+        }
+    }
+#ifdef TAR_HAVE_IO_URING
+    tar_uring_teardown(async);
+#endif
+    free(async->slots);
+    free(async);
+}
+
+
+/*
+ * Sidecar index files.
+ *
+ * A sidecar file is the tables of an index written one after the other, each aligned on 8 bytes, after a header
+ * locating them. Loading it maps the file and points the index into the mapping, so that nothing is parsed and the
+ * archive is not read. The header records the archive size and modification time, so that an index is not used once
+ * its archive has changed, and the size of an entry, so that a file written on another platform is rejected.
+ */
+
+#define TAR_SIDECAR_MAGIC "TARIDX\0"
+#define TAR_SIDECAR_VERSION 4
+
+struct tar_sidecar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t end_offset;
+    uint64_t count, sorted_count, names_len, slot_count, content_hash_count;
+    uint64_t offsets[TAR_TABLE_COUNT];      /* file offset of each table of the index */
+};
+
+static uint64_t tar_align8(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static int tar_write_all(int fd, const void *bytes, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(fd, (const uint8_t *)bytes + done, len - done);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/* Lays out the tables of an index in its sidecar file, described in header. Returns the size of the file. */
+static uint64_t tar_sidecar_layout(const tar_index_t *index, struct tar_sidecar_header *header) {
+    struct tar_table_ref tables[TAR_TABLE_COUNT];
+    uint64_t offset = sizeof(*header);
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, TAR_SIDECAR_MAGIC, sizeof(header->magic));
+    header->version = TAR_SIDECAR_VERSION;
+    header->entry_size = sizeof(struct tar_index_entry);
+    header->archive_size = index->archive_size;
+    header->archive_mtime_sec = index->archive_mtime.tv_sec;
+    header->archive_mtime_nsec = index->archive_mtime.tv_nsec;
+    header->end_offset = (uint64_t)index->end_offset;
+    header->count = index->count;
+    header->sorted_count = index->sorted_count;
+    header->names_len = index->names_len;
+    header->slot_count = index->slot_mask + 1;
+    header->content_hash_count = index->content_hash_count;
+
+    tar_index_tables((tar_index_t *)index, tables);
+    for (int i = 0; i < TAR_TABLE_COUNT; i++) {
+        header->offsets[i] = offset;
+        offset = tar_align8(offset + tables[i].count * tables[i].item_size);
+    }
+    return offset;
+}
+
+/* Writes the sidecar file of an index to fd. */
+static int tar_sidecar_write(const tar_index_t *index, int fd) {
+    static const uint8_t padding[8];
+    struct tar_table_ref tables[TAR_TABLE_COUNT];
+    struct tar_sidecar_header header;
+    uint64_t size = tar_sidecar_layout(index, &header);
+    uint64_t written = sizeof(header);
+
+    if (tar_write_all(fd, &header, sizeof(header)) == -1) {
+        return -1;
+    }
+    tar_index_tables((tar_index_t *)index, tables);
+    for (int i = 0; i < TAR_TABLE_COUNT; i++) {
+        size_t len = (size_t)(tables[i].count * tables[i].item_size);
+
+        if (tar_write_all(fd, padding, (size_t)(header.offsets[i] - written)) == -1 ||
+            tar_write_all(fd, *tables[i].table, len) == -1) {
+            return -1;
+        }
+        written = header.offsets[i] + len;
+    }
+    return tar_write_all(fd, padding, (size_t)(size - written));
+}
+
+static int tar_index_write(const tar_index_t *index, const char *path, mode_t mode) {
+    char tmp_path[PATH_MAX];
+    int fd;
+
+    // A temporary name of its own, so that writers of the same path, of this process or others, never share a file,
+    // and nothing that another user put in the directory is written through.
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fchmod(fd, mode) == -1 || tar_sidecar_write(index, fd) == -1 || close(fd) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    if (rename(tmp_path, path) == -1) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the index to a sidecar file, atomically replacing any previous one.
+ */
+int tar_index_save(const tar_index_t *index, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_index_write(index, path, 0644);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_SAVE, path, ret);
+    return ret;
+}
+
+/* Checks that a section of count items of the given size lies inside a mapping of map_size bytes. */
+static int tar_sidecar_fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t map_size) {
+    return offset % 8 == 0 && offset <= map_size && count <= (map_size - offset) / size;
+}
+
+/*
+ * Points an index into a mapped sidecar file, after checking its header against the archive.
+ * Returns 0, or -1 with errno set to ESTALE if the archive changed, EINVAL if the file is not a sidecar file.
+ */
+static int tar_sidecar_attach(tar_index_t *index, const uint8_t *map, size_t map_size, const struct stat *st) {
+    const struct tar_sidecar_header *header = (const struct tar_sidecar_header *)map;
+
+    if (map_size < sizeof(*header) || memcmp(header->magic, TAR_SIDECAR_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TAR_SIDECAR_VERSION || header->entry_size != sizeof(struct tar_index_entry)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (header->archive_size != (uint64_t)st->st_size || header->archive_mtime_sec != st->st_mtim.tv_sec ||
+        header->archive_mtime_nsec != st->st_mtim.tv_nsec) {
+        errno = ESTALE;
+        return -1;
+    }
+    if (header->count >= TAR_TARGET_UNRESOLVED || header->sorted_count > header->count ||
+        header->content_hash_count > header->count ||
+        header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 ||
+        (header->names_len == 0 && header->count > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    index->archive_size = header->archive_size;
+    index->archive_mtime = st->st_mtim;
+    index->end_offset = (off_t)header->end_offset;
+    index->count = header->count;
+    index->sorted_count = header->sorted_count;
+    index->names_len = header->names_len;
+    index->slot_mask = header->slot_count - 1;
+    index->content_hash_count = header->content_hash_count;
+
+    struct tar_table_ref tables[TAR_TABLE_COUNT];
+    tar_index_tables(index, tables);
+    for (int i = 0; i < TAR_TABLE_COUNT; i++) {
+        if (!tar_sidecar_fits(header->offsets[i], tables[i].count, tables[i].item_size, map_size)) {
+            errno = EINVAL;
+            return -1;
+        }
+        *tables[i].table = (void *)(map + header->offsets[i]);
+    }
+    if (index->names_len > 0 && index->names[index->names_len - 1] != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Maps the sidecar file open at fd as the index of an archive, closing fd. */
+static tar_index_t *tar_index_map_fd(int tar_fd, int fd) {
+    struct stat archive_st, st;
+    tar_index_t *index;
+    void *map;
+
+    if (fstat(tar_fd, &archive_st) == -1 || fstat(fd, &st) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof(struct tar_sidecar_header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    index = calloc(1, sizeof(*index));
+    if (index == NULL || tar_sidecar_attach(index, map, (size_t)st.st_size, &archive_st) == -1 ||
+        (index->verified = calloc(index->count ? index->count : 1, 1)) == NULL) {
+        int saved_errno = errno;
+        munmap(map, (size_t)st.st_size);
+        if (index != NULL) {
+            free(index->verified);
+        }
+        free(index);
+        errno = saved_errno;
+        return NULL;
+    }
+    index->fd = tar_fd;
+    index->map = map;
+    index->map_size = (size_t)st.st_size;
+    return index;
+}
+
+static tar_index_t *tar_index_map(int tar_fd, const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return NULL;
+    }
+    return tar_index_map_fd(tar_fd, fd);
+}
+
+/**
+ * Loads an index from a sidecar file by mapping it.
+ */
+tar_index_t *tar_index_load(int tar_fd, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    tar_index_t *ret = tar_index_map(tar_fd, path);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_LOAD, path, ret != NULL);
+    return ret;
+}
+
+
+/*
+ * Shared index cache.
+ *
+ * The cache is a directory of sidecar files, one per archive and modification time. A sidecar file is published by
+ * renaming it into place, so processes that map it never see it half written. One lock file per archive is only
+ * taken when no index is found, so that concurrent misses build the index once.
+ *
+ * A sidecar file is trusted to hold a well-formed index, so only the files of the calling user that no other user can
+ * write are mapped, and the default directory is one of the user's own, which no other user can enter. The lock is
+ * polled rather than waited for, so that whoever holds it can only delay the processes missing the index by
+ * tar_shared_lock_timeout milliseconds, after which they build an index of their own.
+ */
+
+#include <sys/file.h>
+
+static unsigned tar_shared_lock_timeout = TAR_SHARED_LOCK_TIMEOUT_MS;
+
+/**
+ * Sets how long tar_index_open_shared() waits for another process to publish a missing index.
+ */
+void tar_set_shared_lock_timeout(unsigned milliseconds) {
+    tar_shared_lock_timeout = milliseconds;
+}
+
+/* Formats the path of the cache file of an archive, with the given suffix. */
+static int tar_shared_path(char *path, const char *dir, const struct stat *st, const char *suffix) {
+    int len = snprintf(path, PATH_MAX, "%s/tar-index-%llx-%llx-%llx.%09ld%s", dir, (unsigned long long)st->st_dev,
+                       (unsigned long long)st->st_ino, (unsigned long long)st->st_mtim.tv_sec,
+                       (long)st->st_mtim.tv_nsec, suffix);
+
+    if (len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/* Creates the default cache directory of the calling user, or checks that it is private to the user if it exists. */
+static int tar_shared_default_dir(char *dir) {
+    struct stat st;
+
+    if (snprintf(dir, PATH_MAX, "%s/tar-indexes-%ld", TAR_SHARED_INDEX_DIR, (long)geteuid()) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((mkdir(dir, 0700) == -1 && errno != EEXIST) || lstat(dir, &st) == -1) {
+        return -1;
+    }
+    // Another user may have made it first, to read or forge the indexes put there.
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+/* Maps the cache file at path, if it is a regular file of the calling user that no other user can write. */
+static tar_index_t *tar_shared_map(int tar_fd, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0) {
+        close(fd);
+        errno = EACCES;
+        return NULL;
+    }
+    return tar_index_map_fd(tar_fd, fd);
+}
+
+/* Builds the index of an archive and publishes it at path, returning the shared mapping if that succeeds. */
+static tar_index_t *tar_shared_build(int tar_fd, const char *path) {
+    tar_index_t *built = tar_index_scan(tar_fd), *index;
+
+    if (built == NULL) {
+        return NULL;
+    }
+    if (tar_index_write(built, path, 0600) == -1 || (index = tar_shared_map(tar_fd, path)) == NULL) {
+        return built;
+    }
+    tar_index_free(built);
+    return index;
+}
+
+/*
+ * Takes the lock of a missing index, polling it until it is free, and returns 1, or until the index is published,
+ * which is returned in index, or until the timeout. Returns 0 if the lock could not be taken.
+ */
+static int tar_shared_lock(int lock_fd, int tar_fd, const char *path, tar_index_t **index) {
+    struct timespec start, now, pause = {0, 5 * 1000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+        if (errno != EWOULDBLOCK && errno != EINTR) {
+            return 0;
+        }
+        // Another process is building the index: it may have published it meanwhile.
+        if ((*index = tar_shared_map(tar_fd, path)) != NULL) {
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >=
+            (long)tar_shared_lock_timeout) {
+            return 0;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return 1;
+}
+
+static tar_index_t *tar_shared_open(int tar_fd, const char *dir) {
+    char path[PATH_MAX], lock_path[PATH_MAX], default_dir[PATH_MAX];
+    struct stat st;
+    tar_index_t *index = NULL;
+    int lock_fd, saved_errno;
+
+    if (fstat(tar_fd, &st) == -1) {
+        return NULL;
+    }
+    if (dir == NULL) {
+        if (tar_shared_default_dir(default_dir) == -1) {
+            return tar_index_scan(tar_fd);
+        }
+        dir = default_dir;
+    }
+    if (tar_shared_path(path, dir, &st, "") == -1 || tar_shared_path(lock_path, dir, &st, ".lock") == -1) {
+        return tar_index_scan(tar_fd);
+    }
+    if ((index = tar_shared_map(tar_fd, path)) != NULL) {
+        return index;
+    }
+
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (lock_fd == -1) {
+        return tar_index_scan(tar_fd);
+    }
+    if (!tar_shared_lock(lock_fd, tar_fd, path, &index)) {
+        close(lock_fd);
+        return index != NULL ? index : tar_index_scan(tar_fd);
+    }
+    // Another process may have published the index while this one waited for the lock.
+    if ((index = tar_shared_map(tar_fd, path)) == NULL) {
+        index = tar_shared_build(tar_fd, path);
+    }
+    saved_errno = errno;
+    close(lock_fd);
+    errno = saved_errno;
+    return index;
+}
+
+/**
+ * Opens the index of an archive from the shared cache, building and publishing it on a miss.
+ */
+tar_index_t *tar_index_open_shared(int tar_fd, const char *dir) {
+    TAR_TRACE_BEGIN(trace);
+    tar_index_t *ret = tar_shared_open(tar_fd, dir);
+
+    TAR_TRACE_END(trace, TAR_OP_INDEX_OPEN_SHARED, NULL, ret != NULL);
+    return ret;
+}
+
+/*
+ * Compressed archives.
+ *
+ * The decompressed archive is produced into a ring of TAR_Z_WINDOW bytes, from which reads copy what they want. While
+ * the archive is opened, its members are indexed from the ring and a checkpoint is recorded at the first block
+ * boundary (between frames for zstd) after every span bytes of output. For gzip, a checkpoint is the offset of the
+ * boundary in both streams, the bits of the compressed byte already consumed, and the last TAR_Z_WINDOW bytes of
+ * output, which deflate data after it may refer to: resuming there is a raw inflate primed with those bits, with the
+ * window as its dictionary. The gzip trailer of a member is then skipped by hand, as a raw inflate
+ * stops before it, and the next member is inflated as gzip again.
+ */
+
+#include <zlib.h>
+#ifdef TAR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define TAR_Z_WINDOW 32768
+#define TAR_Z_INPUT (64 * 1024)
+#define TAR_Z_GZIP_BITS (15 + 16)
+#define TAR_Z_GZIP_TRAILER 8
+
+enum tar_z_format {
+    TAR_Z_GZIP,
+    TAR_Z_ZSTD,
+};
+
+struct tar_z_point {
+    uint64_t out;               /* offset in the decompressed archive */
+    off_t in;                   /* offset in the compressed file of the first byte not fully consumed */
+    int bits;                   /* bits of the byte at in already consumed, gzip only */
+    uint8_t *window;            /* the TAR_Z_WINDOW bytes of output before out, gzip only */
+};
+
+struct tar_compressed {
+    int fd;
+    enum tar_z_format format;
+    size_t span;
+    int recording;              /* checkpoints are recorded, while the archive is being opened */
+    z_stream strm;
+    int raw;                    /* inflating raw deflate data since a checkpoint, rather than gzip members */
+    int member_end;             /* the last gzip member or zstd frame is complete */
+    size_t trailer;             /* bytes of a gzip trailer left to skip after raw deflate data */
+#ifdef TAR_HAVE_ZSTD
+    ZSTD_DCtx *dctx;
+#endif
+    off_t in_offset;            /* compressed file offset of input[0] */
+    size_t in_pos, in_len;      /* input[in_pos..in_len) is left to decompress */
+    int in_eof;
+    uint64_t out;               /* decompressed offset of window[win_pos] */
+    size_t win_pos, win_len;    /* window[win_pos..win_len) is decompressed but not read yet */
+    struct tar_z_point *points;
+    size_t point_count, point_capacity;
+    tar_index_t *index;
+    uint8_t input[TAR_Z_INPUT];
+    uint8_t window[TAR_Z_WINDOW];
+};
+
+static int tar_z_refill(struct tar_compressed *z) {
+    ssize_t n;
+
+    z->in_offset += (off_t)z->in_len;
+    z->in_pos = z->in_len = 0;
+    n = tar_pread(z->fd, z->input, sizeof(z->input), z->in_offset);
+    if (n == -1) {
+        return -1;
+    }
+    z->in_len = (size_t)n;
+    z->in_eof = n == 0;
+    return 0;
+}
+
+/* Records a checkpoint at the end of the output decompressed so far, when it is far enough from the last one. */
+static int tar_z_record(struct tar_compressed *z, int bits) {
+    uint64_t out = z->out + (z->win_len - z->win_pos);
+    struct tar_z_point *point;
+
+    if (z->point_count > 0 && out - z->points[z->point_count - 1].out < z->span) {
+        return 0;
+    }
+    if (z->point_count == z->point_capacity) {
+        size_t capacity = z->point_capacity ? z->point_capacity * 2 : 16;
+        struct tar_z_point *points = realloc(z->points, capacity * sizeof(*points));
+
+        if (points == NULL) {
+            return -1;
+        }
+        z->points = points;
+        z->point_capacity = capacity;
+    }
+
+    point = &z->points[z->point_count];
+    point->out = out;
+    point->in = z->in_offset + (off_t)z->in_pos;
+    point->bits = bits;
+    point->window = NULL;
+    if (z->format == TAR_Z_GZIP) {
+        // The ring holds the newest output up to win_len, preceded by the older output after it.
+        point->window = malloc(TAR_Z_WINDOW);
+        if (point->window == NULL) {
+            return -1;
+        }
+        memcpy(point->window, z->window + z->win_len, TAR_Z_WINDOW - z->win_len);
+        memcpy(point->window + TAR_Z_WINDOW - z->win_len, z->window, z->win_len);
+    }
+    z->point_count++;
+    return 0;
+}
+
+/* Inflates into the free end of the ring. Returns the number of bytes produced, 0 at the end of the archive or -1. */
+static ssize_t tar_z_inflate(struct tar_compressed *z) {
+    for (;;) {
+        if (z->in_pos == z->in_len && !z->in_eof && tar_z_refill(z) == -1) {
+            return -1;
+        }
+        if (z->trailer > 0) {
+            size_t skip = z->in_len - z->in_pos < z->trailer ? z->in_len - z->in_pos : z->trailer;
+
+            z->in_pos += skip;
+            z->trailer -= skip;
+            if (z->trailer > 0 && !z->in_eof) {
+                continue;
+            }
+            z->trailer = 0;
+            z->raw = 0;
+            if (inflateReset2(&z->strm, TAR_Z_GZIP_BITS) != Z_OK) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        if (z->in_pos == z->in_len) {
+            if (z->member_end) {
+                return 0;
+            }
+            errno = EINVAL; // Truncated.
+            return -1;
+        }
+
+        size_t space = TAR_Z_WINDOW - z->win_len;
+        z->strm.next_in = z->input + z->in_pos;
+        z->strm.avail_in = (uInt)(z->in_len - z->in_pos);
+        z->strm.next_out = z->window + z->win_len;
+        z->strm.avail_out = (uInt)space;
+        int ret = inflate(&z->strm, Z_BLOCK);
+        size_t produced = space - z->strm.avail_out;
+
+        z->in_pos = z->in_len - z->strm.avail_in;
+        z->win_len += produced;
+        if (ret == Z_STREAM_END) {
+            // Another member may follow: gzip inflates its header once reset, raw deflate stops before the trailer.
+            z->member_end = 1;
+            if (z->raw) {
+                z->trailer = TAR_Z_GZIP_TRAILER;
+            } else if (inflateReset(&z->strm) != Z_OK) {
+                errno = EINVAL;
+                return -1;
+            }
+        } else if (ret == Z_DATA_ERROR && z->member_end) {
+            // Whatever follows the last member is not gzip data, such as the padding of a tape block.
+            z->in_pos = z->in_len;
+            z->in_eof = 1;
+            return 0;
+        } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            z->member_end = 0;
+            if (z->recording && (z->strm.data_type & 128) && !(z->strm.data_type & 64) &&
+                tar_z_record(z, z->strm.data_type & 7) == -1) {
+                return -1;
+            }
+        } else {
+            errno = ret == Z_MEM_ERROR ? ENOMEM : EINVAL;
+            return -1;
+        }
+        if (produced > 0) {
+            return (ssize_t)produced;
+        }
+    }
+}
+
+#ifdef TAR_HAVE_ZSTD
+/* Same as tar_z_inflate(), for zstd frames. */
+static ssize_t tar_z_unzstd(struct tar_compressed *z) {
+    for (;;) {
+        if (z->in_pos == z->in_len && !z->in_eof && tar_z_refill(z) == -1) {
+            return -1;
+        }
+        if (z->in_pos == z->in_len) {
+            if (z->member_end) {
+                return 0;
+            }
+            errno = EINVAL; // Truncated.
+            return -1;
+        }
+
+        ZSTD_inBuffer in = {z->input, z->in_len, z->in_pos};
+        ZSTD_outBuffer out = {z->window, TAR_Z_WINDOW, z->win_len};
+        size_t ret = ZSTD_decompressStream(z->dctx, &out, &in);
+        size_t produced = out.pos - z->win_len;
+
+        if (ZSTD_isError(ret)) {
+            errno = EINVAL;
+            return -1;
+        }
+        z->in_pos = in.pos;
+        z->win_len = out.pos;
+        z->member_end = ret == 0;
+        if (z->recording && ret == 0 && tar_z_record(z, 0) == -1) {
+            return -1;
+        }
+        if (produced > 0) {
+            return (ssize_t)produced;
+        }
+    }
+}
+#endif
+
+/* Decompresses more of the archive into the ring, once it is read up to win_len. Returns as tar_z_inflate(). */
+static ssize_t tar_z_decompress(struct tar_compressed *z) {
+    if (z->win_len == TAR_Z_WINDOW) {
+        z->win_pos = z->win_len = 0;
+    }
+#ifdef TAR_HAVE_ZSTD
+    if (z->format == TAR_Z_ZSTD) {
+        return tar_z_unzstd(z);
+    }
+#endif
+    return tar_z_inflate(z);
+}
+
+/*
+ * Reads len bytes of the decompressed archive at the current offset into dest, or skips them when dest is NULL.
+ * Returns the number of bytes read, which is short only at the end of the archive, or -1.
+ */
+static ssize_t tar_z_read(struct tar_compressed *z, uint8_t *dest, uint64_t len) {
+    uint64_t done = 0;
+
+    while (done < len) {
+        if (z->win_pos == z->win_len) {
+            ssize_t n = tar_z_decompress(z);
+
+            if (n == -1) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+        }
+
+        size_t chunk = z->win_len - z->win_pos;
+        if (chunk > len - done) {
+            chunk = (size_t)(len - done);
+        }
+        if (dest != NULL) {
+            memcpy(dest + done, z->window + z->win_pos, chunk);
+        }
+        z->win_pos += chunk;
+        z->out += chunk;
+        done += chunk;
+    }
+    return (ssize_t)done;
+}
+
+/* Restarts decompressing at a checkpoint, or at the start of the archive when point is NULL. */
+static int tar_z_resume(struct tar_compressed *z, const struct tar_z_point *point) {
+    z->in_offset = point != NULL ? point->in : 0;
+    z->in_pos = z->in_len = 0;
+    z->in_eof = 0;
+    z->out = point != NULL ? point->out : 0;
+    z->win_pos = z->win_len = 0;
+    z->member_end = 0;
+    z->trailer = 0;
+
+#ifdef TAR_HAVE_ZSTD
+    if (z->format == TAR_Z_ZSTD) {
+        ZSTD_DCtx_reset(z->dctx, ZSTD_reset_session_only);
+        return 0;
+    }
+#endif
+    z->raw = point != NULL;
+    if (point == NULL) {
+        return inflateReset2(&z->strm, TAR_Z_GZIP_BITS) == Z_OK ? 0 : -1;
+    }
+    if (inflateReset2(&z->strm, -15) != Z_OK) {
+        return -1;
+    }
+    if (point->bits > 0) {
+        // The checkpoint is in the middle of a byte, whose first bits were consumed already.
+        uint8_t byte;
+
+        if (tar_pread(z->fd, &byte, 1, point->in - 1) != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        inflatePrime(&z->strm, point->bits, byte >> (8 - point->bits));
+    }
+    return inflateSetDictionary(&z->strm, point->window, TAR_Z_WINDOW) == Z_OK ? 0 : -1;
+}
+
+/* Moves to the given offset of the decompressed archive, from the current offset or from the closest checkpoint. */
+static int tar_z_seek(struct tar_compressed *z, uint64_t offset) {
+    size_t low = 0, high = z->point_count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (z->points[mid].out <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    // While checkpoints are recorded, the last one may lie in the output not read yet: decompression goes on.
+    const struct tar_z_point *point = low > 0 ? &z->points[low - 1] : NULL;
+    if (offset < z->out || (!z->recording && point != NULL && point->out > z->out)) {
+        if (tar_z_resume(z, point) == -1) {
+            return -1;
+        }
+    }
+    return tar_z_read(z, NULL, offset - z->out) == -1 ? -1 : 0;
+}
+
+/* Indexes the members of the archive in a single pass over the decompressed archive. */
+static int tar_z_index(struct tar_compressed *z) {
+    tar_index_t *index = calloc(1, sizeof(*index));
+    struct tar_member member;
+    tar_header_t header;
+    size_t capacity = 0, names_capacity = 0;
+    uint64_t offset = 0;
+    struct stat st;
+
+    if (index == NULL) {
+        return -1;
+    }
+    z->index = index;
+    index->fd = -1; // Reading the data through the index would read compressed bytes.
+    memset(&member, 0, sizeof(member));
+    if (fstat(z->fd, &st) == -1) {
+        return -1;
+    }
+    index->archive_size = (uint64_t)st.st_size;
+    index->archive_mtime = st.st_mtim;
+
+    for (;;) {
+        ssize_t n = tar_z_read(z, (uint8_t *)&header, TAR_HEADER_SIZE);
+        uint64_t size;
+
+        if (n == -1) {
+            return -1;
+        }
+        if (n < TAR_HEADER_SIZE || header.name[0] == '\0') {
+            break;
+        }
+        TAR_COUNT(headers_scanned, 1);
+        if (tar_header_verify(&header) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        size = tar_field_to_u64(header.size, sizeof(header.size));
+        if (tar_is_extra(header.typeflag)) {
+            if (size <= TAR_EXTRA_MAX) {
+                uint8_t *data = malloc(size ? size : 1);
+
+                if (data == NULL) {
+                    return -1;
+                }
+                n = tar_z_read(z, data, size);
+                if (n != -1) {
+                    tar_member_extra(&member, header.typeflag, data, (size_t)n);
+                }
+                free(data);
+                if (n == -1) {
+                    return -1;
+                }
+            }
+        } else {
+            tar_member_finish(&member, &header);
+            if (tar_index_push(index, &capacity, &names_capacity, &header, &member,
+                               (off_t)offset + TAR_HEADER_SIZE) == -1) {
+                return -1;
+            }
+            size = member.size;
+        }
+
+        offset += TAR_HEADER_SIZE + tar_padded_size(size);
+        if (tar_z_seek(z, offset) == -1) {
+            return -1;
+        }
+    }
+    index->end_offset = (off_t)offset;
+    // Decompress what follows the end-of-archive marker too, so that the checksums of the compressed data are checked.
+    if (tar_z_read(z, NULL, UINT64_MAX) == -1) {
+        return -1;
+    }
+
+    if (tar_index_sort(index) == -1 || tar_index_hash(index) == -1 || tar_index_link_children(index) == -1 ||
+        tar_index_decode(index) == -1) {
+        return -1;
+    }
+    tar_index_resolve_links(index);
+    return 0;
+}
+
+static tar_compressed_t *tar_compressed_open(int tar_fd, size_t span) {
+    static const uint8_t gzip_magic[] = {0x1f, 0x8b}, zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    struct tar_compressed *z;
+    uint8_t magic[4] = {0};
+
+    if (tar_pread(tar_fd, magic, sizeof(magic), 0) == -1) {
+        return NULL;
+    }
+    z = calloc(1, sizeof(*z));
+    if (z == NULL) {
+        return NULL;
+    }
+    z->fd = tar_fd;
+    z->span = span ? span : TAR_COMPRESSED_DEFAULT_SPAN;
+
+    if (memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) {
+        z->format = TAR_Z_GZIP;
+        if (inflateInit2(&z->strm, TAR_Z_GZIP_BITS) != Z_OK) {
+            free(z);
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) {
+#ifdef TAR_HAVE_ZSTD
+        z->format = TAR_Z_ZSTD;
+        z->dctx = ZSTD_createDCtx();
+        if (z->dctx == NULL) {
+            free(z);
+            errno = ENOMEM;
+            return NULL;
+        }
+#else
+        free(z);
+        errno = ENOTSUP;
+        return NULL;
+#endif
+    } else {
+        free(z);
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    z->recording = 1;
+    if (tar_z_index(z) == -1) {
+        tar_close_compressed(z);
+        return NULL;
+    }
+    z->recording = 0;
+    return z;
+}
+
+/**
+ * Opens a compressed archive and indexes it, recording checkpoints on the way.
+ */
+tar_compressed_t *tar_open_compressed(int tar_fd, size_t span) {
+    TAR_TRACE_BEGIN(trace);
+    tar_compressed_t *ret = tar_compressed_open(tar_fd, span);
+
+    TAR_TRACE_END(trace, TAR_OP_OPEN_COMPRESSED, NULL, ret != NULL);
+    return ret;
+}
+
+const tar_index_t *tar_compressed_index(const tar_compressed_t *archive) {
+    return archive->index;
+}
+
+static ssize_t tar_read_file_compressed(tar_compressed_t *archive, const char *path, size_t offset, uint8_t *dest,
+                                        size_t *len) {
+    const struct tar_index_entry *entry = tar_index_lookup_resolved(archive->index, path);
+
+    if (entry == NULL || !tar_is_regular(entry->typeflag)) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    size_t bytes_left = entry->size - offset;
+    size_t bytes_to_read = (*len < bytes_left) ? *len : bytes_left;
+
+    if (tar_z_seek(archive, (uint64_t)entry->data_offset + offset) == -1) {
+        return -1;
+    }
+    ssize_t bytes_read = tar_z_read(archive, dest, bytes_to_read);
+    if (bytes_read == -1) {
+        return -1;
+    }
+
+    *len = bytes_read;
+
+    return bytes_left - bytes_read;
+}
+
+/**
+ * Reads a file of a compressed archive, decompressing from the closest checkpoint before it.
+ */
+ssize_t read_file_compressed(tar_compressed_t *archive, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_file_compressed(archive, path, offset, dest, len);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILE_COMPRESSED, path, ret);
+    return ret;
+}
+
+void tar_close_compressed(tar_compressed_t *archive) {
+    int saved_errno = errno;
+
+    if (archive == NULL) {
+        return;
+    }
+    if (archive->format == TAR_Z_GZIP) {
+        inflateEnd(&archive->strm);
+    }
+#ifdef TAR_HAVE_ZSTD
+    ZSTD_freeDCtx(archive->dctx);
+#endif
+    for (size_t i = 0; i < archive->point_count; i++) {
+        free(archive->points[i].window);
+    }
+    free(archive->points);
+    tar_index_free(archive->index);
+    free(archive);
+    errno = saved_errno;
+}
+
+
+/*
+ * Extraction.
+ *
+ * Members are created relative to a descriptor of the destination directory with the *at() system calls. Every
+ * directory above a member is created as a real directory before the first symlink is, and files are opened with
+ * O_NOFOLLOW, so that no path of the archive resolves through a symlink it contains. Regular files, the bulk of the
+ * work, go to a pool of threads which take the next file from a shared cursor over the files sorted by decreasing
+ * size: the largest files start first, and the small ones fill in around them.
+ */
+
+#define TAR_EXTRACT_BUFFER (1 << 20)
+
+struct tar_extract_job {
+    uint64_t size;
+    uint32_t id;
+};
+
+struct tar_extract_shared {
+    const tar_index_t *index;
+    int dir_fd;
+    const struct tar_extract_job *jobs;
+    size_t count;
+    size_t next;                /* position in jobs of the next file to write */
+    int error;                  /* errno of the first failure, zero if none */
+};
+
+static int tar_extract_job_cmp(const void *a, const void *b) {
+    const struct tar_extract_job *ja = a, *jb = b;
+
+    return (ja->size < jb->size) - (ja->size > jb->size);
+}
+
+/* Records a failure, of which only the first one is reported. */
+static void tar_extract_fail(struct tar_extract_shared *shared, int errnum) {
+    int none = 0;
+
+    __atomic_compare_exchange_n(&shared->error, &none, errnum ? errnum : EIO, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Checks that a path stays below the destination: it is relative and has no ".." component. */
+static int tar_extract_safe(const char *path) {
+    if (path[0] == '/') {
+        return 0;
+    }
+    for (const char *component = path;;) {
+        const char *end = strchrnul(component, '/');
+
+        if (end - component == 2 && component[0] == '.' && component[1] == '.') {
+            return 0;
+        }
+        if (*end == '\0') {
+            return 1;
+        }
+        component = end + 1;
+    }
+}
+
+/* Creates the directories above path that do not exist yet. */
+static int tar_extract_parents(int dir_fd, const char *path) {
+    char parent[PATH_MAX];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(parent)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(parent, path, len + 1);
+    if (len > 0 && parent[len - 1] == '/') {
+        len--; // The path of a directory is not one of its parents.
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (parent[i] != '/') {
+            continue;
+        }
+        parent[i] = '\0';
+        if (mkdirat(dir_fd, parent, 0777) == -1 && errno != EEXIST) {
+            return -1;
+        }
+        parent[i] = '/';
+    }
+    return 0;
+}
+
+/* Creates a directory, writable by its owner until its own mode is set at the end of the extraction. */
+static int tar_extract_dir(int dir_fd, const char *path) {
+    if (mkdirat(dir_fd, path, 0700) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    if (errno != ENOENT || tar_extract_parents(dir_fd, path) == -1) {
+        return -1;
+    }
+    return mkdirat(dir_fd, path, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/*
+ * Copies size bytes of src_fd at offset to the current offset of fd, within the kernel when possible. The buffer used
+ * otherwise is allocated on first use, for the caller to free.
+ */
+static int tar_copy_data(int src_fd, off_t offset, uint64_t size, int fd, uint8_t **buffer) {
+    uint64_t done = 0;
+
+    while (done < size) {
+        off_t in = offset + (off_t)done;
+        ssize_t n = copy_file_range(src_fd, &in, fd, NULL, size - done, 0);
+
+        TAR_COUNT(syscalls, 1);
+        if (n > 0) {
+            TAR_COUNT(bytes_read, n);
+            done += (uint64_t)n;
+        } else if (n == 0) {
+            errno = EIO; // Truncated source.
+            return -1;
+        } else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+            break; // Not between these files: the rest goes through user space.
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (done < size && *buffer == NULL && (*buffer = malloc(TAR_EXTRACT_BUFFER)) == NULL) {
+        return -1;
+    }
+    while (done < size) {
+        size_t chunk = size - done < TAR_EXTRACT_BUFFER ? (size_t)(size - done) : TAR_EXTRACT_BUFFER;
+        ssize_t n = tar_pread(src_fd, *buffer, chunk, offset + (off_t)done);
+
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        if (tar_write_all(fd, *buffer, (size_t)n) == -1) {
+            return -1;
+        }
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int tar_extract_file(const struct tar_extract_shared *shared, const struct tar_index_entry *entry,
+                            uint8_t **buffer) {
+    const char *path = tar_index_name(shared->index, entry);
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+    struct timespec times[2] = {{.tv_sec = (time_t)entry->mtime}, {.tv_sec = (time_t)entry->mtime}};
+    int fd, ret;
+
+    fd = openat(shared->dir_fd, path, flags, (mode_t)(entry->mode & 0777));
+    if (fd == -1 && errno == ENOENT && tar_extract_parents(shared->dir_fd, path) == 0) {
+        fd = openat(shared->dir_fd, path, flags, (mode_t)(entry->mode & 0777));
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    ret = tar_copy_data(shared->index->fd, entry->data_offset, entry->size, fd, buffer);
+    if (ret == 0) {
+        ret = futimens(fd, times);
+    }
+    if (close(fd) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static void *tar_extract_worker(void *arg) {
+    struct tar_extract_shared *shared = arg;
+    uint8_t *buffer = NULL;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+
+        if (i >= shared->count) {
+            break;
+        }
+        if (tar_extract_file(shared, &shared->index->entries[shared->jobs[i].id], &buffer) == -1) {
+            tar_extract_fail(shared, errno);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Creates a link, replacing what may be at its path. A hard link is made to the entry it resolves to in the index,
+ * which has been extracted already.
+ */
+static int tar_extract_link(const struct tar_extract_shared *shared, const struct tar_index_entry *entry) {
+    const tar_index_t *index = shared->index;
+    const char *path = tar_index_name(index, entry);
+    struct timespec times[2] = {{.tv_sec = (time_t)entry->mtime}, {.tv_sec = (time_t)entry->mtime}};
+
+    unlinkat(shared->dir_fd, path, 0);
+    if (entry->typeflag == SYMTYPE) {
+        if (symlinkat(index->names + entry->link_offset, shared->dir_fd, path) == -1) {
+            return -1;
+        }
+        return utimensat(shared->dir_fd, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    if (entry->target >= index->count) {
+        errno = ENOENT; // Dangling.
+        return -1;
+    }
+    const char *target = tar_index_name(index, &index->entries[entry->target]);
+    if (!tar_extract_safe(target)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return linkat(shared->dir_fd, target, shared->dir_fd, path, 0);
+}
+
+static int tar_extract(int tar_fd, const char *dest_dir, int nthreads) {
+    struct tar_extract_shared shared = { .dir_fd = -1 };
+    struct tar_extract_job *jobs = NULL;
+    pthread_t *threads = NULL;
+    tar_index_t *index = NULL;
+    int started;
+
+    if (mkdir(dest_dir, 0777) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    shared.dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (shared.dir_fd == -1) {
+        return -1;
+    }
+    index = tar_index_scan(tar_fd);
+    jobs = index != NULL ? malloc((index->sorted_count ? index->sorted_count : 1) * sizeof(*jobs)) : NULL;
+    if (jobs == NULL) {
+        tar_extract_fail(&shared, errno);
+        goto out;
+    }
+    shared.index = index;
+    shared.jobs = jobs;
+
+    // Name order puts every directory after its parent. The parents of links are made now, before any symlink is.
+    for (size_t i = 0; i < index->sorted_count; i++) {
+        const struct tar_index_entry *entry = &index->entries[index->sorted[i]];
+        const char *path = tar_index_name(index, entry);
+        int ret = 0;
+
+        if (!tar_extract_safe(path)) {
+            tar_extract_fail(&shared, EINVAL);
+        } else if (entry->typeflag == DIRTYPE) {
+            ret = tar_extract_dir(shared.dir_fd, path);
+        } else if (tar_is_regular(entry->typeflag)) {
+            jobs[shared.count].size = entry->size;
+            jobs[shared.count++].id = index->sorted[i];
+        } else if (tar_is_link(entry->typeflag)) {
+            ret = tar_extract_parents(shared.dir_fd, path);
+        } else {
+            tar_extract_fail(&shared, EOPNOTSUPP);
+        }
+        if (ret == -1) {
+            tar_extract_fail(&shared, errno);
+        }
+    }
+    qsort(jobs, shared.count, sizeof(*jobs), tar_extract_job_cmp);
+
+    if (nthreads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = online > 0 ? (int)online : 1;
+    }
+    if ((size_t)nthreads > shared.count) {
+        nthreads = shared.count > 0 ? (int)shared.count : 1;
+    }
+    threads = calloc((size_t)nthreads, sizeof(*threads));
+
+    // The calling thread writes files too, alone if no thread could be started.
+    for (started = 1; threads != NULL && started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, tar_extract_worker, &shared) != 0) {
+            break;
+        }
+    }
+    tar_extract_worker(&shared);
+    for (int t = 1; threads != NULL && t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Symlinks before hard links, which may be to symlinks.
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < index->sorted_count; i++) {
+            const struct tar_index_entry *entry = &index->entries[index->sorted[i]];
+
+            if (entry->typeflag == (pass == 0 ? SYMTYPE : LNKTYPE) && tar_extract_safe(tar_index_name(index, entry)) &&
+                tar_extract_link(&shared, entry) == -1) {
+                tar_extract_fail(&shared, errno);
+            }
+        }
+    }
+
+    // Directories get their mode and time once nothing is written into them any more, the deepest ones first.
+    for (size_t i = index->sorted_count; i-- > 0;) {
+        const struct tar_index_entry *entry = &index->entries[index->sorted[i]];
+        const char *path = tar_index_name(index, entry);
+        struct timespec times[2] = {{.tv_sec = (time_t)entry->mtime}, {.tv_sec = (time_t)entry->mtime}};
+
+        if (entry->typeflag == DIRTYPE && tar_extract_safe(path) &&
+            (fchmodat(shared.dir_fd, path, (mode_t)(entry->mode & 07777), 0) == -1 ||
+             utimensat(shared.dir_fd, path, times, 0) == -1)) {
+            tar_extract_fail(&shared, errno);
+        }
+    }
+
+out:
+    close(shared.dir_fd);
+    free(threads);
+    free(jobs);
+    tar_index_free(index);
+    if (shared.error != 0) {
+        errno = shared.error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Extracts the archive from its index: directories, then files on several threads, then links.
+ */
+int tar_extract_all(int tar_fd, const char *dest_dir, int nthreads) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_extract(tar_fd, dest_dir, nthreads);
+
+    TAR_TRACE_END(trace, TAR_OP_EXTRACT_ALL, dest_dir, ret);
+    return ret;
+}
+
+
+/*
+ * Archive writer.
+ *
+ * The writer queues the archive as a list of iovecs: headers and small files are laid out one after the other in its
+ * buffer, where consecutive pieces share an iovec, and padding points to a block of zeros which is never copied. The
+ * queue is written with writev() when the buffer or the list is full, before the data of a large file is copied
+ * straight from its descriptor, and at the end.
  */
-int check_archive(int tar_fd) {
-    tar_header_t buffer;
-    unsigned long int header_chksum, calculated_chksum;
-    ssize_t bytes_read;
 
-    // Initialize the position to the top of the file
-    if (lseek(tar_fd, 0, SEEK_SET) == -1) {
-        perror("An error occurred with lseek");
-        return -4;
+#include <sys/uio.h>
+
+#define TAR_WRITER_BUFFER (256 * 1024)
+#define TAR_WRITER_IOVS 64
+#define TAR_WRITER_DIRECT (64 * 1024)   /* files this large are copied from their descriptor, not through the buffer */
+#define TAR_RECORD_SIZE (20 * TAR_HEADER_SIZE)
+#define TAR_PAX_NAME "././@PaxHeader"
+
+static const uint8_t tar_zeros[TAR_RECORD_SIZE];
+
+struct tar_writer {
+    int fd;
+    int error;                  /* errno of the failure that stopped the writer, zero if none */
+    uint64_t written;           /* bytes of the archive queued so far, from its start */
+    size_t used;                /* bytes of buf queued */
+    int iov_count;
+    uint8_t *copy_buffer;       /* for tar_copy_data() */
+    struct iovec iov[TAR_WRITER_IOVS];
+    uint8_t buf[TAR_WRITER_BUFFER];
+};
+
+/**
+ * Creates a writer appending to the current offset of the descriptor.
+ */
+tar_writer_t *tar_writer_open(int tar_fd) {
+    struct tar_writer *writer = malloc(sizeof(*writer));
+
+    if (writer == NULL) {
+        return NULL;
     }
+    writer->fd = tar_fd;
+    writer->error = 0;
+    writer->written = 0;
+    writer->used = 0;
+    writer->iov_count = 0;
+    writer->copy_buffer = NULL;
+    return writer;
+}
 
-    while ((bytes_read = read(tar_fd, &buffer, TAR_HEADER_SIZE)) > 0 && buffer.name[0] != '\0') {
+/* Writes the queue out. */
+static int tar_writer_flush(struct tar_writer *writer) {
+    struct iovec *iov = writer->iov;
+    int count = writer->iov_count;
 
-        // Invalid magic value
-        if (strncmp(buffer.magic, TMAGIC, TMAGLEN) != 0){
+    while (count > 0) {
+        ssize_t n = writev(writer->fd, iov, count);
+
+        TAR_COUNT(syscalls, 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
             return -1;
         }
-        // Invalid version value
-        if (strncmp(buffer.version, TVERSION, TVERSLEN) != 0){
-            return -2;
+        // A short write leaves the rest of the queue, starting in the middle of an iovec.
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
         }
-        // - Checksum section - 
-        header_chksum = TAR_INT(buffer.chksum);
-        memset(buffer.chksum, ' ', 8);              // Neutralises the chksum field as required by TAR standards
-        calculated_chksum = 0;
-
-        uint8_t *current_byte = (uint8_t *)&buffer;
-        for (size_t i = 0; i < TAR_HEADER_SIZE; i++) {
-            calculated_chksum += current_byte[i];
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
         }
+    }
+    writer->used = 0;
+    writer->iov_count = 0;
+    return 0;
+}
 
-        if (header_chksum != calculated_chksum){
-            return -3;
+/* Queues len bytes of the buffer, for the caller to fill, after writing the queue out if they do not fit. */
+static uint8_t *tar_writer_reserve(struct tar_writer *writer, size_t len) {
+    if (writer->used + len > sizeof(writer->buf) || writer->iov_count == TAR_WRITER_IOVS) {
+        if (tar_writer_flush(writer) == -1) {
+            return NULL;
         }
     }
 
-    if (bytes_read < 0) {
-        perror("Error reading from file descriptor");
-        return -4;
+    uint8_t *bytes = writer->buf + writer->used;
+    struct iovec *last = writer->iov_count > 0 ? &writer->iov[writer->iov_count - 1] : NULL;
+    if (last != NULL && (uint8_t *)last->iov_base + last->iov_len == bytes) {
+        last->iov_len += len;
+    } else {
+        writer->iov[writer->iov_count].iov_base = bytes;
+        writer->iov[writer->iov_count++].iov_len = len;
+    }
+    writer->used += len;
+    writer->written += len;
+    return bytes;
+}
+
+/* Queues len zeros, at most TAR_RECORD_SIZE. */
+static int tar_writer_zeros(struct tar_writer *writer, size_t len) {
+    if (len == 0) {
+        return 0;
     }
+    if (writer->iov_count == TAR_WRITER_IOVS && tar_writer_flush(writer) == -1) {
+        return -1;
+    }
+    writer->iov[writer->iov_count].iov_base = (void *)tar_zeros;
+    writer->iov[writer->iov_count++].iov_len = len;
+    writer->written += len;
     return 0;
 }
 
+static void tar_writer_octal(char *field, size_t width, uint64_t value) {
+    for (size_t i = width - 1; i-- > 0; value >>= 3) {
+        field[i] = (char)('0' + (value & 7));
+    }
+    field[width - 1] = '\0';
+}
 
-/**
- * Checks whether an entry exists in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
- */
-int exists(int tar_fd, char *path) {
-    struct posix_header header; 
-    ssize_t read_bytes;
+/* Splits a path between the prefix and name fields of a header. Returns 0, or -1 if it does not fit in them. */
+static int tar_writer_path(tar_header_t *header, const char *path, size_t len) {
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, path, len); // The name field needs no terminating null when the path fills it.
+        return 0;
+    }
+    // The prefix ends at a '/', which is not stored, and leaves at most 100 bytes to the name.
+    for (size_t i = len - sizeof(header->name) - 1; i < len && i <= sizeof(header->prefix); i++) {
+        if (path[i] == '/' && i + 1 < len) {
+            memcpy(header->prefix, path, i);
+            memcpy(header->name, path + i + 1, len - i - 1);
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    while ((read_bytes = read(tar_fd, &header, sizeof(struct posix_header))) == sizeof(struct posix_header)) {
-        // fin d'archive?
-        if (header.name[0] == '\0') {
-            break;
+/* Appends the pax record "<length> <key>=<value>\n" to records, whose length counts its own digits. */
+static size_t tar_writer_pax_record(char *records, const char *key, const char *value, size_t value_len) {
+    size_t base = strlen(key) + value_len + 3, len = base;
+    int digits = snprintf(NULL, 0, "%zu", base);
+
+    len += (size_t)digits;
+    if (snprintf(NULL, 0, "%zu", len) > digits) {
+        len++;
+    }
+    int prefix = sprintf(records, "%zu %s=", len, key);
+    memcpy(records + prefix, value, value_len);
+    records[len - 1] = '\n';
+    return len;
+}
+
+/* Fills the fields of a header other than its path, and its checksum. */
+static void tar_writer_fields(tar_header_t *header, char typeflag, uint32_t mode, uint32_t uid, uint32_t gid,
+                              uint64_t size, int64_t mtime, const char *link, size_t link_len) {
+    tar_writer_octal(header->mode, sizeof(header->mode), mode & 07777);
+    tar_writer_octal(header->uid, sizeof(header->uid), uid & 07777777);
+    tar_writer_octal(header->gid, sizeof(header->gid), gid & 07777777);
+    if (size < (1ULL << 33)) {
+        tar_writer_octal(header->size, sizeof(header->size), size);
+    } else {
+        header->size[0] = (char)0x80;
+        for (size_t i = sizeof(header->size) - 1; i > 0; i--, size >>= 8) {
+            header->size[i] = (char)(size & 0xFF);
         }
+    }
+    tar_writer_octal(header->mtime, sizeof(header->mtime), mtime > 0 ? (uint64_t)mtime : 0);
+    header->typeflag = typeflag;
+    memcpy(header->linkname, link, link_len < sizeof(header->linkname) ? link_len : sizeof(header->linkname));
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+
+    uint32_t sum = tar_header_chksum(header);
+    tar_writer_octal(header->chksum, sizeof(header->chksum) - 1, sum);
+    header->chksum[sizeof(header->chksum) - 1] = ' ';
+}
+
+/* Queues the header of a member, preceded by a pax extended header when its path or link does not fit in it. */
+static int tar_writer_header(struct tar_writer *writer, const char *path, char typeflag, uint32_t mode, uint32_t uid,
+                             uint32_t gid, uint64_t size, int64_t mtime, const char *link) {
+    size_t path_len = strlen(path), link_len = link != NULL ? strlen(link) : 0;
+    tar_header_t *header;
+    int path_fits;
+
+    if (path_len == 0 || path_len >= PATH_MAX || link_len >= PATH_MAX) {
+        errno = path_len == 0 ? EINVAL : ENAMETOOLONG;
+        return -1;
+    }
+
+    header = (tar_header_t *)tar_writer_reserve(writer, TAR_HEADER_SIZE);
+    if (header == NULL) {
+        return -1;
+    }
+    memset(header, 0, sizeof(*header));
+    path_fits = tar_writer_path(header, path, path_len) == 0;
+    if (!path_fits || link_len > sizeof(header->linkname)) {
+        // This header becomes the pax one, the member header is queued after its records.
+        char records[2 * (PATH_MAX + 32)];
+        size_t records_len = 0;
 
-        if (strcmp(header.name, path) == 0) {
-            return 1; // L'entrée existe.
+        if (!path_fits) {
+            records_len += tar_writer_pax_record(records + records_len, "path", path, path_len);
+        }
+        if (link_len > sizeof(header->linkname)) {
+            records_len += tar_writer_pax_record(records + records_len, "linkpath", link, link_len);
         }
+        memset(header, 0, sizeof(*header));
+        memcpy(header->name, TAR_PAX_NAME, sizeof(TAR_PAX_NAME) - 1);
+        tar_writer_fields(header, XHDTYPE, 0644, 0, 0, records_len, mtime, "", 0);
 
-        // Calcule la taille réelle des données du fichier (en octets).
-        unsigned long file_size = strtoul(header.size, NULL, 8);
-        
-        // Avance dans l'archive en sautant les blocs de données correspondants.
-        off_t offset = ((file_size + 511) / 512) * 512; // Taille alignée sur 512 octets.
-        if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-            return 0; // Erreur si impossible de se déplacer dans le fichier.
+        uint8_t *data = tar_writer_reserve(writer, records_len);
+        if (data == NULL) {
+            return -1;
+        }
+        memcpy(data, records, records_len);
+        if (tar_writer_zeros(writer, tar_padded_size(records_len) - records_len) == -1) {
+            return -1;
         }
-    }
 
-    // Retourne 0 si le chemin n'a pas été trouvé.
+        header = (tar_header_t *)tar_writer_reserve(writer, TAR_HEADER_SIZE);
+        if (header == NULL) {
+            return -1;
+        }
+        memset(header, 0, sizeof(*header));
+        if (path_fits) {
+            tar_writer_path(header, path, path_len);
+        } else {
+            memcpy(header->name, path, sizeof(header->name));
+        }
+    }
+    tar_writer_fields(header, typeflag, mode, uid, gid, size, mtime, link != NULL ? link : "", link_len);
     return 0;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a directory.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
- */
-int is_dir(int tar_fd, char *path) {
-    struct posix_header header; 
-    ssize_t read_bytes;
+/* Stops the writer after a failure, of which errno is kept. Returns -1. */
+static int tar_writer_fail(struct tar_writer *writer) {
+    writer->error = errno ? errno : EIO;
+    return -1;
+}
 
-    
-    while ((read_bytes = read(tar_fd, &header, sizeof(struct posix_header))) == sizeof(struct posix_header)) {
-        if (header.name[0] == '\0') {
-            break;
+static int tar_writer_file(tar_writer_t *writer, const char *path, int src_fd) {
+    struct stat st;
+
+    if (writer->error != 0) {
+        errno = writer->error;
+        return -1;
+    }
+    if (fstat(src_fd, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t size = (uint64_t)st.st_size;
+    if (tar_writer_header(writer, path, REGTYPE, st.st_mode, st.st_uid, st.st_gid, size, st.st_mtime, NULL) == -1) {
+        return tar_writer_fail(writer);
+    }
+
+    if (size >= TAR_WRITER_DIRECT) {
+        if (tar_writer_flush(writer) == -1 || tar_copy_data(src_fd, 0, size, writer->fd, &writer->copy_buffer) == -1) {
+            return tar_writer_fail(writer);
         }
+        writer->written += size;
+    } else if (size > 0) {
+        uint8_t *data = tar_writer_reserve(writer, (size_t)size);
+        ssize_t n = data != NULL ? tar_pread(src_fd, data, (size_t)size, 0) : -1;
 
-        if (strcmp(header.name, path) == 0) {
-            // Vérifie si l'entrée est un répertoire.
-            if (header.typeflag == '5') { // '5' indique un répertoire dans les en-têtes POSIX.
-                return 1; 
-            } else {
-                return 0; 
+        if (n != (ssize_t)size) {
+            if (n != -1) {
+                errno = EIO; // The file became shorter.
             }
+            return tar_writer_fail(writer);
         }
+    }
+    if (tar_writer_zeros(writer, tar_padded_size(size) - size) == -1) {
+        return tar_writer_fail(writer);
+    }
+    return 0;
+}
 
-        unsigned long file_size = strtoul(header.size, NULL, 8);
+/**
+ * Adds a regular file, through the buffer when it is small and straight from its descriptor otherwise.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *path, int src_fd) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_writer_file(writer, path, src_fd);
 
-        off_t offset = ((file_size + 511) / 512) * 512; 
-        if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-            return 0; 
-        }
+    TAR_TRACE_END(trace, TAR_OP_WRITER_ADD_FILE, path, ret);
+    return ret;
+}
+
+static int tar_writer_dir(tar_writer_t *writer, const char *path, uint32_t mode, int64_t mtime) {
+    char dir[PATH_MAX];
+    size_t len = strlen(path);
+
+    if (writer->error != 0) {
+        errno = writer->error;
+        return -1;
+    }
+    if (len + 1 >= sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    memcpy(dir, path, len);
+    if (len == 0 || dir[len - 1] != '/') {
+        dir[len++] = '/';
+    }
+    dir[len] = '\0';
 
+    if (tar_writer_header(writer, dir, DIRTYPE, mode, getuid(), getgid(), 0, mtime, NULL) == -1) {
+        return tar_writer_fail(writer);
+    }
     return 0;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * Adds a directory, with a '/' at the end of its path.
  */
+int tar_writer_add_dir(tar_writer_t *writer, const char *path, uint32_t mode, int64_t mtime) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_writer_dir(writer, path, mode, mtime);
 
-int is_file(int tar_fd, char *path) {
-    struct posix_header header; 
-    ssize_t read_bytes;
+    TAR_TRACE_END(trace, TAR_OP_WRITER_ADD_DIR, path, ret);
+    return ret;
+}
 
-    // Positionne le pointeur au début
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) {
-        return 0; 
+static int tar_writer_symlink(tar_writer_t *writer, const char *path, const char *target, int64_t mtime) {
+    if (writer->error != 0) {
+        errno = writer->error;
+        return -1;
+    }
+    if (tar_writer_header(writer, path, SYMTYPE, 0777, getuid(), getgid(), 0, mtime, target) == -1) {
+        return tar_writer_fail(writer);
     }
+    return 0;
+}
 
-    // va jusqu'à la fin de l'archive
-    while ((read_bytes = read(tar_fd, &header, sizeof(struct posix_header))) == sizeof(struct posix_header)) {
-        // fin de l'archive? => sortie de la boucle
-        if (header.name[0] == '\0') {
-            break;
-        }
+/**
+ * Adds a symlink, with a pax linkpath record when its target is longer than the linkname field.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *path, const char *target, int64_t mtime) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_writer_symlink(writer, path, target, mtime);
 
-        
-        if (strcmp(header.name, path) == 0) {
-            if (header.typeflag == '0' || header.typeflag == '\0') { 
-                // '0' ou '\0' pour un fichier régulier dans les en-têtes POSIX.
-                return 1; // L'entrée est donc un fichier régulier.
-            } else {
-                return 0; 
-            }
-        }
+    TAR_TRACE_END(trace, TAR_OP_WRITER_ADD_SYMLINK, path, ret);
+    return ret;
+}
 
-        unsigned long file_size = strtoul(header.size, NULL, 8);
+static int tar_writer_finish(tar_writer_t *writer) {
+    int ret = -1;
 
-        off_t offset = ((file_size + 511) / 512) * 512; 
-        if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-            return 0; 
+    if (writer->error == 0) {
+        uint64_t end = writer->written + 2 * TAR_HEADER_SIZE;
+        size_t padding = (size_t)((TAR_RECORD_SIZE - end % TAR_RECORD_SIZE) % TAR_RECORD_SIZE);
+
+        if (tar_writer_zeros(writer, 2 * TAR_HEADER_SIZE) == 0 && tar_writer_zeros(writer, padding) == 0 &&
+            tar_writer_flush(writer) == 0) {
+            ret = 0;
         }
+    } else {
+        errno = writer->error;
     }
-    return 0;
+
+    int saved_errno = errno;
+    free(writer->copy_buffer);
+    free(writer);
+    errno = saved_errno;
+    return ret;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a symlink.
+ * Ends the archive with two blocks of zeros, padded to a whole record, and writes out what is left of it.
+ */
+int tar_writer_close(tar_writer_t *writer) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_writer_finish(writer);
+
+    TAR_TRACE_END(trace, TAR_OP_WRITER_CLOSE, NULL, ret);
+    return ret;
+}
+
+
+/*
+ * Multi-archive catalogs.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
+ * A catalog owns the index of each of its archives, and a table merging their live entries: an open-addressing hash
+ * table whose slots hold the archive and the position of the entry that wins for a path. The hash of an entry is the
+ * one its own index recorded, so merging an archive only probes, without hashing or copying any path. An archive is
+ * closed once indexed, and opened again the first time one of its files is read.
  */
 
-int is_symlink(int tar_fd, char *path) {
-    struct posix_header header; 
-    ssize_t read_bytes;
+#define TAR_CATALOG_MIN_SLOTS 64
 
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) {
-        return 0; 
-    }
+struct tar_catalog_archive {
+    char *path;
+    tar_index_t *index;         /* index->fd is -1 until the archive is first read */
+};
 
-    while ((read_bytes = read(tar_fd, &header, sizeof(struct posix_header))) == sizeof(struct posix_header)) {
-        if (header.name[0] == '\0') {
-            break;
+struct tar_catalog_slot {
+    uint64_t hash;
+    uint32_t archive;           /* TAR_SLOT_EMPTY for an empty slot */
+    uint32_t entry;
+};
+
+struct tar_catalog {
+    enum tar_catalog_order order;
+    struct tar_catalog_archive *archives;
+    size_t archive_count, archive_capacity;
+    struct tar_catalog_slot *slots;
+    size_t slot_mask;           /* number of slots minus one, the number of slots being a power of two */
+    size_t used;
+    pthread_mutex_t open_lock;  /* taken to open an archive */
+};
+
+static const struct tar_index_entry *tar_catalog_entry(const tar_catalog_t *catalog,
+                                                       const struct tar_catalog_slot *slot) {
+    return &catalog->archives[slot->archive].index->entries[slot->entry];
+}
+
+/* Finds the slot of a path, or the empty slot where it would go. */
+static struct tar_catalog_slot *tar_catalog_probe(const tar_catalog_t *catalog, uint64_t hash, const char *path,
+                                                  size_t len) {
+    size_t i = hash & catalog->slot_mask;
+
+    for (;; i = (i + 1) & catalog->slot_mask) {
+        struct tar_catalog_slot *slot = &catalog->slots[i];
+
+        if (slot->archive == TAR_SLOT_EMPTY) {
+            return slot;
         }
-        if (strcmp(header.name, path) == 0) {
-            // lien symbolique ? (champs typeflag des en-têtes POSIX)
-            if (header.typeflag == '2') { 
-                // '2' indique un lien symbolique selon la spécification POSIX.
-                return 1; 
-            } else {
-                return 0; 
-            }
+        const tar_index_t *index = catalog->archives[slot->archive].index;
+        const struct tar_index_entry *entry = &index->entries[slot->entry];
+        if (slot->hash == hash && entry->name_len == len && memcmp(tar_index_name(index, entry), path, len) == 0) {
+            return slot;
         }
+    }
+}
 
-        unsigned long file_size = strtoul(header.size, NULL, 8);
+/* Grows the table so that it stays at most half full with count more paths. */
+static int tar_catalog_reserve(tar_catalog_t *catalog, size_t count) {
+    size_t slot_count = catalog->slot_mask + 1, old_count = slot_count;
+    struct tar_catalog_slot *old = catalog->slots, *slots;
+
+    while ((catalog->used + count) * 2 > slot_count) {
+        slot_count *= 2;
+    }
+    if (slot_count == old_count) {
+        return 0;
+    }
+    if ((slots = malloc(slot_count * sizeof(*slots))) == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < slot_count; i++) {
+        slots[i].archive = TAR_SLOT_EMPTY;
+    }
+    catalog->slots = slots;
+    catalog->slot_mask = slot_count - 1;
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].archive != TAR_SLOT_EMPTY) {
+            size_t j = old[i].hash & catalog->slot_mask;
 
-        off_t offset = ((file_size + 511) / 512) * 512; 
-        if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-            return 0; 
+            while (slots[j].archive != TAR_SLOT_EMPTY) {
+                j = (j + 1) & catalog->slot_mask;
+            }
+            slots[j] = old[i];
         }
     }
+    free(old);
     return 0;
 }
 
-
-
 /**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
- *
- * @return zero if no directory at the given path exists in the archive,
- *         any other value otherwise.
+ * Creates an empty catalog.
  */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    struct posix_header header; 
-    ssize_t read_bytes;
-    size_t entries_count = 0;
+tar_catalog_t *tar_catalog_create(enum tar_catalog_order order) {
+    tar_catalog_t *catalog = calloc(1, sizeof(*catalog));
 
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) {
-        return 0; 
+    if (catalog == NULL) {
+        return NULL;
+    }
+    catalog->order = order;
+    catalog->slots = malloc(TAR_CATALOG_MIN_SLOTS * sizeof(*catalog->slots));
+    if (catalog->slots == NULL) {
+        free(catalog);
+        return NULL;
     }
+    for (size_t i = 0; i < TAR_CATALOG_MIN_SLOTS; i++) {
+        catalog->slots[i].archive = TAR_SLOT_EMPTY;
+    }
+    catalog->slot_mask = TAR_CATALOG_MIN_SLOTS - 1;
+    pthread_mutex_init(&catalog->open_lock, NULL);
+    return catalog;
+}
 
-    if (!is_dir(tar_fd, path)) {
-        return 0; 
+static ssize_t tar_catalog_append(tar_catalog_t *catalog, const char *archive_path, const char *sidecar_path) {
+    struct tar_catalog_archive *archive;
+    tar_index_t *index = NULL;
+    int fd, saved_errno;
+
+    if (catalog->archive_count >= TAR_SLOT_EMPTY) {
+        errno = EOVERFLOW;
+        return -1;
     }
+    if (catalog->archive_count == catalog->archive_capacity) {
+        size_t capacity = catalog->archive_capacity ? 2 * catalog->archive_capacity : 16;
+        struct tar_catalog_archive *archives = realloc(catalog->archives, capacity * sizeof(*archives));
 
-    while ((read_bytes = read(tar_fd, &header, sizeof(struct posix_header))) == sizeof(struct posix_header)) {
-        if (header.name[0] == '\0') {
-            break;
+        if (archives == NULL) {
+            return -1;
         }
+        catalog->archives = archives;
+        catalog->archive_capacity = capacity;
+    }
 
-        // Vérifie si l'entrée est dans le répertoire spécifié.
-        if (strncmp(header.name, path, strlen(path)) == 0) {
-            // Extrait le chemin relatif après `path`.
-            const char *relative_path = header.name + strlen(path);
-
-            // direct répertoire ou sous dossier ?
-            if (strchr(relative_path, '/') == NULL || relative_path[strlen(relative_path) - 1] == '/') {
-                if (entries_count < *no_entries) {
-                    strncpy(entries[entries_count], header.name, strlen(header.name) + 1);
-                    entries_count++;
-                }
-            }
-        }
+    if ((fd = open(archive_path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    // A missing or stale sidecar file is not an error: the archive is scanned instead.
+    if (sidecar_path != NULL) {
+        index = tar_index_map(fd, sidecar_path);
+    }
+    if (index == NULL) {
+        index = tar_index_scan(fd);
+    }
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    if (index == NULL) {
+        return -1;
+    }
+    index->fd = -1;
 
-        unsigned long file_size = strtoul(header.size, NULL, 8);
-        off_t offset = ((file_size + 511) / 512) * 512; 
-        if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-            return 0; 
-        }
+    archive = &catalog->archives[catalog->archive_count];
+    if ((archive->path = strdup(archive_path)) == NULL || tar_catalog_reserve(catalog, index->sorted_count) == -1) {
+        free(archive->path);
+        tar_index_free(index);
+        return -1;
     }
+    archive->index = index;
 
-    *no_entries = entries_count;
+    uint32_t archive_id = (uint32_t)catalog->archive_count++;
+    for (size_t i = 0; i < index->sorted_count; i++) {
+        uint32_t id = index->sorted[i];
+        const struct tar_index_entry *entry = &index->entries[id];
+        struct tar_catalog_slot *slot = tar_catalog_probe(catalog, entry->hash, tar_index_name(index, entry),
+                                                          entry->name_len);
 
-    return 1;
+        if (slot->archive == TAR_SLOT_EMPTY) {
+            catalog->used++;
+        } else if (catalog->order == TAR_CATALOG_FIRST_WINS) {
+            continue;
+        }
+        slot->hash = entry->hash;
+        slot->archive = archive_id;
+        slot->entry = id;
+    }
+    return (ssize_t)archive_id;
 }
 
+/**
+ * Indexes an archive and merges its entries into the catalog.
+ */
+ssize_t tar_catalog_add(tar_catalog_t *catalog, const char *archive_path, const char *sidecar_path) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_catalog_append(catalog, archive_path, sidecar_path);
 
+    TAR_TRACE_END(trace, TAR_OP_CATALOG_ADD, archive_path, ret);
+    return ret;
+}
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
- *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
- *
+ * Releases a catalog, the indexes of its archives, and closes the archives it opened.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-    struct posix_header header; 
-    ssize_t read_bytes;
+void tar_catalog_free(tar_catalog_t *catalog) {
+    int saved_errno = errno;
 
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) {
-        return -1; 
+    if (catalog == NULL) {
+        return;
     }
+    for (size_t i = 0; i < catalog->archive_count; i++) {
+        if (catalog->archives[i].index->fd != -1) {
+            close(catalog->archives[i].index->fd);
+        }
+        tar_index_free(catalog->archives[i].index);
+        free(catalog->archives[i].path);
+    }
+    pthread_mutex_destroy(&catalog->open_lock);
+    free(catalog->archives);
+    free(catalog->slots);
+    free(catalog);
+    errno = saved_errno;
+}
 
-    while ((read_bytes = read(tar_fd, &header, sizeof(struct posix_header))) == sizeof(struct posix_header)) {
-        if (header.name[0] == '\0') {
-            break;
+/* Returns the slot of the entry winning for a path, or NULL. */
+static const struct tar_catalog_slot *tar_catalog_get(const tar_catalog_t *catalog, const char *path) {
+    size_t len = strlen(path);
+    const struct tar_catalog_slot *slot = tar_catalog_probe(catalog, tar_hash_path(path, len), path, len);
+
+    return slot->archive != TAR_SLOT_EMPTY ? slot : NULL;
+}
+
+/* Opens an archive of the catalog the first time it is read, checking that it did not change since it was indexed. */
+static int tar_catalog_open(tar_catalog_t *catalog, struct tar_catalog_archive *archive) {
+    tar_index_t *index = archive->index;
+    struct stat st;
+    int ret = 0;
+
+    if (__atomic_load_n(&index->fd, __ATOMIC_ACQUIRE) != -1) {
+        return 0;
+    }
+    pthread_mutex_lock(&catalog->open_lock);
+    if (index->fd == -1) {
+        int fd = open(archive->path, O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            ret = -1;
+        } else if ((uint64_t)st.st_size != index->archive_size || st.st_mtim.tv_sec != index->archive_mtime.tv_sec ||
+                   st.st_mtim.tv_nsec != index->archive_mtime.tv_nsec) {
+            errno = ESTALE;
+            ret = -1;
         }
+        if (ret == -1 && fd != -1) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+        } else if (ret == 0) {
+            __atomic_store_n(&index->fd, fd, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&catalog->open_lock);
+    return ret;
+}
 
-        if (strcmp(header.name, path) == 0) {
-            if (header.typeflag != '0' && header.typeflag != '\0') {
-                return -1; 
-            }
+/**
+ * Tells which archive of the catalog holds the entry winning for a path.
+ */
+ssize_t tar_catalog_which(const tar_catalog_t *catalog, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_catalog_slot *slot = tar_catalog_get(catalog, path);
+    ssize_t ret = slot != NULL ? (ssize_t)slot->archive : -1;
 
-            unsigned long file_size = strtoul(header.size, NULL, 8);
+    TAR_TRACE_END(trace, TAR_OP_CATALOG_WHICH, path, ret);
+    return ret;
+}
 
-            if (offset >= file_size) {
-                return -2; 
-            }
+int exists_catalog(const tar_catalog_t *catalog, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    int ret = tar_catalog_get(catalog, path) != NULL;
 
-            if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-                return -1; 
-            }
+    TAR_TRACE_END(trace, TAR_OP_EXISTS_CATALOG, path, ret);
+    return ret;
+}
 
-            size_t bytes_left = file_size - offset;
-            size_t bytes_to_read = (*len < bytes_left) ? *len : bytes_left;
+int is_dir_catalog(const tar_catalog_t *catalog, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_catalog_slot *slot = tar_catalog_get(catalog, path);
+    int ret = slot != NULL && tar_catalog_entry(catalog, slot)->typeflag == DIRTYPE;
 
-            ssize_t bytes_read = read(tar_fd, dest, bytes_to_read);
-            if (bytes_read == -1) {
-                return -1; 
-            }
+    TAR_TRACE_END(trace, TAR_OP_IS_DIR_CATALOG, path, ret);
+    return ret;
+}
 
-            *len = bytes_read;
+int is_file_catalog(const tar_catalog_t *catalog, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_catalog_slot *slot = tar_catalog_get(catalog, path);
+    int ret = slot != NULL && tar_is_regular(tar_catalog_entry(catalog, slot)->typeflag);
 
-            return bytes_left - bytes_read;
-        }
+    TAR_TRACE_END(trace, TAR_OP_IS_FILE_CATALOG, path, ret);
+    return ret;
+}
 
-        unsigned long file_size = strtoul(header.size, NULL, 8);
-        off_t offset = ((file_size + 511) / 512) * 512; 
-        if (lseek(tar_fd, offset, SEEK_CUR) == (off_t)-1) {
-            return -1; 
-        }
+int is_symlink_catalog(const tar_catalog_t *catalog, const char *path) {
+    TAR_TRACE_BEGIN(trace);
+    const struct tar_catalog_slot *slot = tar_catalog_get(catalog, path);
+    int ret = slot != NULL && tar_catalog_entry(catalog, slot)->typeflag == SYMTYPE;
+
+    TAR_TRACE_END(trace, TAR_OP_IS_SYMLINK_CATALOG, path, ret);
+    return ret;
+}
+
+static ssize_t tar_read_file_catalog(tar_catalog_t *catalog, const char *path, size_t offset, uint8_t *dest,
+                                     size_t *len) {
+    const struct tar_catalog_slot *slot = tar_catalog_get(catalog, path);
+
+    if (slot == NULL) {
+        return -1;
     }
 
-    return -1;
+    // Links are followed in the archive holding them, as its index resolved them.
+    struct tar_catalog_archive *archive = &catalog->archives[slot->archive];
+    const tar_index_t *index = archive->index;
+    const struct tar_index_entry *entry = &index->entries[slot->entry];
+    if (entry->target == TAR_TARGET_NONE) {
+        return -1;
+    }
+    entry = &index->entries[entry->target];
+    if (!tar_is_regular(entry->typeflag) || tar_catalog_open(catalog, archive) == -1) {
+        return -1;
+    }
+    return tar_index_read_entry(index, entry, offset, dest, len);
+}
+
+/**
+ * Reads a file of the catalog from the archive holding it, opening the archive on its first read.
+ */
+ssize_t read_file_catalog(tar_catalog_t *catalog, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    TAR_TRACE_BEGIN(trace);
+    ssize_t ret = tar_read_file_catalog(catalog, path, offset, dest, len);
+
+    TAR_TRACE_END(trace, TAR_OP_READ_FILE_CATALOG, path, ret);
+    return ret;
 }
@@ -40,12 +40,43 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* pax extended header, for the next member */
+#define XGLTYPE  'g'            /* pax global extended header */
+#define GNUTYPE_LONGNAME 'L'    /* GNU ././@LongLink header holding the path of the next member */
+#define GNUTYPE_LONGLINK 'K'    /* GNU ././@LongLink header holding the link target of the next member */
 
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/* Converts a numeric header field into a regular integer, see tar_field_to_u64() */
+#define TAR_FIELD(field) tar_field_to_u64((field), sizeof(field))
+
 #define TAR_HEADER_SIZE (int)sizeof(tar_header_t)
 
+/*
+ * Maximum length of a ustar path: a prefix, a '/' and a name.  Paths given by pax or GNU long name headers may be
+ * longer, up to PATH_MAX - 1, and entries buffers must be sized for those when such archives are expected.
+ */
+#define TAR_PATH_MAX (155 + 1 + 100)
+
+/* Maximum number of symlinks and hard links followed when resolving a path, beyond which it is considered a loop */
+#define TAR_MAX_LINK_DEPTH 32
+
+/**
+ * Decodes a numeric header field, such as size or mode.
+ *
+ * Unlike TAR_INT(), the field may fill its whole width without a terminating null, and sizes of 8 GiB or more, which
+ * do not fit in 11 octal digits, are read from the GNU base-256 encoding: a first byte with its high bit set, followed
+ * by a big-endian binary number. An octal value is made of the digits following any leading spaces.
+ *
+ * @param field The field.
+ * @param width The width of the field, 16 bytes at most.
+ *
+ * @return the value of the field, 0 if it is empty or a negative base-256 number,
+ *         UINT64_MAX if it is a base-256 number which does not fit in 64 bits.
+ */
+uint64_t tar_field_to_u64(const char *field, size_t width);
+
 /**
  * Checks whether the archive is valid.
  *
@@ -63,6 +94,34 @@ typedef struct posix_header
  */
 int check_archive(int tar_fd);
 
+/**
+ * Same as check_archive(), with the headers validated concurrently by several threads.
+ *
+ * The headers are first located in a sequential pass over the archive, then their magic value, version and checksum
+ * are checked by up to nthreads threads. When the archive has several bad headers, the value returned is the one of
+ * the earliest, as with check_archive().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to use, zero or a negative value for one per online processor.
+ *
+ * @return the same values as check_archive().
+ */
+int check_archive_parallel(int tar_fd, int nthreads);
+
+/**
+ * Checks a single header the way check_archive() does.
+ *
+ * The checksum is computed with vector instructions when the processor supports them, and the header is not modified.
+ *
+ * @param header The header to check.
+ *
+ * @return zero if the header is valid,
+ *         -1 if it has an invalid magic value,
+ *         -2 if it has an invalid version value,
+ *         -3 if it has an invalid checksum value
+ */
+int tar_header_verify(const tar_header_t *header);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -107,6 +166,56 @@ int is_file(int tar_fd, char *path);
  */
 int is_symlink(int tar_fd, char *path);
 
+/**
+ * A bump allocator for the results of listings.
+ *
+ * Memory is taken from large blocks one allocation after the other, and is only given back all at once, by
+ * tar_arena_reset() or tar_arena_destroy(). Listing into an arena needs no buffer sized in advance, costs a malloc()
+ * per block rather than per path, and keeps the paths of a listing next to each other.
+ *
+ * An arena must not be used by several threads at once.
+ */
+typedef struct tar_arena tar_arena_t;
+
+/* Default size of the blocks of an arena */
+#define TAR_ARENA_DEFAULT_BLOCK (64 * 1024)
+
+/**
+ * Creates an arena.
+ *
+ * @param block_size The size of the blocks memory is taken from, zero for the default. Larger allocations get a
+ *                   block of their own.
+ *
+ * @return an arena to be released with tar_arena_destroy(),
+ *         NULL if memory could not be allocated (errno is set).
+ */
+tar_arena_t *tar_arena_create(size_t block_size);
+
+/**
+ * Allocates size bytes, aligned for any type, which stay valid until the arena is reset or destroyed.
+ *
+ * @return the memory, NULL if it could not be allocated (errno is set).
+ */
+void *tar_arena_alloc(tar_arena_t *arena, size_t size);
+
+/**
+ * Copies the len first bytes of a string into the arena, with a terminating null, for instance to keep a path
+ * yielded by tar_iter_next() past the next call.
+ *
+ * @return the copy, NULL if it could not be allocated (errno is set).
+ */
+char *tar_arena_strndup(tar_arena_t *arena, const char *string, size_t len);
+
+/**
+ * Frees everything allocated from the arena at once, keeping one block for the allocations to come.
+ */
+void tar_arena_reset(tar_arena_t *arena);
+
+/**
+ * Releases an arena and everything allocated from it. Does nothing if arena is NULL.
+ */
+void tar_arena_destroy(tar_arena_t *arena);
+
 
 /**
  * Lists the entries at a given path in the archive.
@@ -132,6 +241,50 @@ int is_symlink(int tar_fd, char *path);
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries);
 
+/**
+ * Same as list(), with the array of paths and the paths themselves allocated from an arena, so that every entry is
+ * listed whatever their number.
+ *
+ * @param entries Set to an array of the paths listed, valid until the arena is reset or destroyed.
+ *
+ * @return the number of entries listed,
+ *         -1 if no directory at the given path exists in the archive (errno is set to ENOENT), the archive could not
+ *         be read or memory could not be allocated (errno is set).
+ */
+ssize_t list_arena(int tar_fd, const char *path, tar_arena_t *arena, char ***entries);
+
+/**
+ * Same as list_arena(), with every entry below the directory listed, at any depth, in a single pass over the archive.
+ *
+ * Example:
+ *  dir/          list_recursive(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/", "dir/c/d" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ */
+ssize_t list_recursive(int tar_fd, const char *path, tar_arena_t *arena, char ***entries);
+
+/**
+ * Lists the entries of the archive whose path matches a glob pattern, in a single pass over the archive.
+ *
+ * In a pattern, '*' matches any run of characters but '/', "**" any run of characters including '/', '?' any character
+ * but '/', "[...]" any character of the set and "[!...]" any character out of it, with ranges such as "[a-z]". A "**"
+ * followed by a '/' also matches no directory at all, and a '\' makes the character following it match itself. For
+ * instance, "**.json" matches "a.json" as well as "x/y/b.json". The trailing '/' of a directory is only matched by a
+ * pattern which ends with one, so that a '*' after "dir/" matches the subdirectories of dir/ as well as its files.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param pattern The pattern, matched against the whole path of each entry.
+ * @param arena The arena the array of paths and the paths are allocated from.
+ * @param entries Set to an array of the paths matched, in archive order, valid until the arena is reset or destroyed.
+ *
+ * @return the number of entries matched,
+ *         -1 if the archive could not be read or memory could not be allocated (errno is set).
+ */
+ssize_t find(int tar_fd, const char *pattern, tar_arena_t *arena, char ***entries);
+
 /**
  * Reads a file at a given path in the archive.
  *
@@ -152,4 +305,985 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/*
+ * None of the functions of this library move the offset of the file descriptors they are given: every read is a
+ * positional pread(), so that a descriptor can be shared by several threads and the result of a call never depends
+ * on the calls made before it.
+ */
+
+/**
+ * Receives the data of a file read by read_files_batch() or read_files_batch_index().
+ *
+ * The data of a file is passed in one or more chunks, in ascending order. An empty file is passed as a single empty
+ * chunk.
+ *
+ * @param i The position of the file's path in the array of paths given to the batch.
+ * @param offset The offset in the file of the first byte of the chunk.
+ * @param data The bytes of the chunk, valid until the callback returns.
+ * @param len The number of bytes in the chunk.
+ * @param size The total size of the file: the file is complete when offset + len == size.
+ * @param arg The argument given to the batch.
+ *
+ * @return zero to go on with the batch, any other value to stop it.
+ */
+typedef int (*tar_batch_cb_t)(size_t i, uint64_t offset, const uint8_t *data, size_t len, uint64_t size, void *arg);
+
+/* Default size of the chunks read by the functions that scan the archive. */
+#define TAR_SCAN_DEFAULT_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Sets the size of the chunks read by the functions that scan the archive headers (exists(), is_dir(), is_file(),
+ * is_symlink(), list(), read_file() and tar_index_build()).
+ *
+ * These functions read the archive in chunks of up to this size and walk the headers inside them, instead of issuing
+ * a read and a seek per header. The chunk size applies to the scans started after the call.
+ *
+ * @param size The chunk size in bytes, rounded down to a multiple of the header size.
+ */
+void tar_set_scan_chunk_size(size_t size);
+
+/**
+ * Enables or disables lazy validation, so that the headers of an archive are checked as they are used rather than all
+ * at once by check_archive() before the archive is used.
+ *
+ * When enabled, the functions that scan the archive check the magic value, the version and the checksum of each header
+ * they walk through, and fail at the first invalid one, as they would if the archive could not be read, with errno set
+ * to EBADMSG. An index built meanwhile has all its headers checked. The *_index() functions reading the data of an
+ * entry whose header was not checked, because the index was loaded from a sidecar file or built without lazy
+ * validation, check it first, once for the lifetime of the index. tar_index_validate() checks the rest, for instance on
+ * a thread of its own. Disabled by default. The setting applies to the scans and reads started after the call.
+ *
+ * @param enabled Non-zero to enable lazy validation, zero to disable it.
+ */
+void tar_set_lazy_validation(int enabled);
+
+/* Access patterns, given to the kernel with tar_advise() and tar_mmap_advise(). */
+enum tar_access {
+    TAR_ACCESS_NORMAL,          /* the default read-ahead */
+    TAR_ACCESS_SEQUENTIAL,      /* a larger read-ahead, for scans such as check_archive() */
+    TAR_ACCESS_RANDOM,          /* no read-ahead, for lookups through an index */
+    TAR_ACCESS_ONCE,            /* sequential, and read once: the pages read do not displace the cached working set */
+    TAR_ACCESS_WILLNEED,        /* starts reading the whole archive into the page cache */
+    TAR_ACCESS_DONTNEED,        /* drops the cached pages of the archive */
+};
+
+/**
+ * Tells the kernel how the archive is about to be read, with posix_fadvise().
+ *
+ * The first four values set a pattern which holds for the reads through the file descriptor, or any other sharing
+ * its open file description, until the next call. The last two are actions, carried out once.
+ *
+ * @param tar_fd A file descriptor of a tar archive file.
+ * @param access The access pattern.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_advise(int tar_fd, enum tar_access access);
+
+/**
+ * An in-memory index of the entries of a tar archive.
+ *
+ * The index is built in a single pass over the archive and records, for each entry, its typeflag, size, mode and the
+ * offset of its data in the archive. Once built, the *_index() variants below answer without scanning the archive:
+ * paths are looked up in a hash table, in a single probe most of the time.
+ *
+ * Entries are indexed by their full path, that is the ustar prefix followed by the name.
+ * Symlinks and hard links are resolved once, when the index is built, so that list_index() and read_file_index()
+ * follow a link with a single lookup.
+ * When an archive contains several entries with the same path, the last one wins, as it does when tar extracts it.
+ *
+ * The index does not own the file descriptor it was built from: the descriptor must stay open for as long as
+ * read_file_index() is used, and must be closed by the caller.
+ *
+ * Once built, an index is never modified by the *_index() functions, and read_file_index() reads with pread() at the
+ * offset recorded for the entry. They can therefore be called concurrently from several threads on the same index and
+ * the same file descriptor, without locking.
+ */
+typedef struct tar_index tar_index_t;
+
+/**
+ * Builds an index of the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return a newly allocated index to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated (errno is set).
+ */
+tar_index_t *tar_index_build(int tar_fd);
+
+/**
+ * Releases an index built by tar_index_build(). Does nothing if index is NULL.
+ */
+void tar_index_free(tar_index_t *index);
+
+/**
+ * Brings an index up to date with an archive that members were appended to since it was built, as "tar -r" does.
+ *
+ * Only the appended headers are read and validated, starting from the end of the archive recorded in the index, so
+ * that the reads of an update depend on what was appended rather than on the size of the archive. In memory, an update
+ * takes time linear in the number of entries of the index: the appended entries are merged into the tables kept in
+ * name order, which are copied, and the children of every directory are recorded again. Only the links which the
+ * appended entries can change are resolved again. If an appended header is invalid, the index is left as it was.
+ *
+ * @param index The index to update. It must not be in use by other threads during the call.
+ *
+ * @return a zero or positive value on success, the number of entries added to the index,
+ *         -1 if an appended header has an invalid magic value,
+ *         -2 if an appended header has an invalid version value,
+ *         -3 if an appended header has an invalid checksum value,
+ *         -4 if the archive could not be read or shrank (errno is set to ESTALE), in which case the index is left as
+ *         it was, or if memory could not be allocated, in which case the index can only be released.
+ */
+int tar_index_update(tar_index_t *index);
+
+/**
+ * Checks the headers of all the members in the index, as check_archive() does, and records the entries whose header
+ * was checked, so that lazy validation does not check them again.
+ *
+ * It may run on a thread of its own while other threads use the index, so that the archive is fully validated in the
+ * background while requests are served, those needing an entry not yet checked checking it themselves.
+ *
+ * @param index The index, whose archive is read through its file descriptor.
+ *
+ * @return the same values as check_archive() for the part of the archive which is indexed,
+ *         -4 if the archive could not be read (errno is set).
+ */
+int tar_index_validate(const tar_index_t *index);
+
+/**
+ * Hashes the content of every file of the index, in a single sweep over their data in archive order, so that files
+ * can be deduplicated or checked after extraction without reading the archive again.
+ *
+ * The hashes are kept in the index and saved with it by tar_index_save(). The files later appended to the archive are
+ * hashed by tar_index_update() as it adds them. A loaded index is copied out of its sidecar file first.
+ *
+ * @param index The index, whose archive is read through its file descriptor.
+ *
+ * @return zero on success, -1 if the archive could not be read or memory could not be allocated (errno is set).
+ */
+int tar_index_hash_contents(tar_index_t *index);
+
+/**
+ * Gives the hash of the content of a file of the index, computed by tar_index_hash_contents(). Links are resolved
+ * through the index.
+ *
+ * @param index The index.
+ * @param path The path of the file.
+ * @param hash Set to the hash, as tar_content_hash() would compute it over the content of the file.
+ *
+ * @return zero on success,
+ *         -1 if there is no file at the given path (errno is set to ENOENT) or its content was not hashed (errno is set
+ *         to ENODATA).
+ */
+int tar_index_content_hash(const tar_index_t *index, const char *path, uint64_t *hash);
+
+/**
+ * Hashes bytes with XXH64 and a seed of zero, the hash of the content of files in an index.
+ */
+uint64_t tar_content_hash(const void *data, size_t len);
+
+/**
+ * Writes an index to a sidecar file, for instance "archive.tar.idx", so that later processes can load it instead of
+ * scanning the archive. The file is written under a temporary name of its own, then renamed over any previous one,
+ * so that concurrent saves of the same path leave one of the indexes whole. It is created with mode 0644.
+ *
+ * The file records the size and modification time the archive had when it was indexed. It is meant to be read back
+ * on the same platform.
+ *
+ * @param index The index to save.
+ * @param path The path of the sidecar file.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_index_save(const tar_index_t *index, const char *path);
+
+/**
+ * Loads an index from a sidecar file written by tar_index_save().
+ *
+ * The file is mapped and used in place: the archive is not read, and only the pages of the index that lookups touch
+ * are read from disk. The sidecar file is trusted to have been written by tar_index_save(): only its header and the
+ * extents of its tables are checked, so a file that someone else could have written must not be loaded.
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the index was built from.
+ * @param path The path of the sidecar file.
+ *
+ * @return a newly allocated index to be released with tar_index_free(),
+ *         NULL on error, with errno set to ESTALE if the archive changed since it was indexed, to EINVAL if the file
+ *         is not a sidecar file for this platform, or by the failed system call.
+ */
+tar_index_t *tar_index_load(int tar_fd, const char *path);
+
+/*
+ * Directory holding the default index caches shared by the processes of a host, one per user, see
+ * tar_index_open_shared()
+ */
+#define TAR_SHARED_INDEX_DIR "/dev/shm"
+
+/* Default time tar_index_open_shared() waits for another process to publish a missing index, in milliseconds */
+#define TAR_SHARED_LOCK_TIMEOUT_MS 5000
+
+/**
+ * Opens the index of an archive from a cache shared by the processes of a host.
+ *
+ * The index is kept in a sidecar file of the cache directory named after the device, inode and modification time of
+ * the archive. The first process to open an archive builds its index and saves it there, holding a lock which makes
+ * the processes opening it meanwhile wait for the index rather than build their own, for up to the time set by
+ * tar_set_shared_lock_timeout(). Every process then maps the same file read-only, so that the memory taken by the
+ * index on the host does not grow with the number of processes.
+ *
+ * Only the sidecar files of the calling user which no other user can write are used, any other file being replaced
+ * by a new index, or left and the index being built for the calling process alone if it cannot be replaced. The
+ * default directory, "tar-indexes-<uid>" below TAR_SHARED_INDEX_DIR, is created private to the calling user, and is
+ * not used if it exists but is not: a directory given by the caller should be private likewise, since other users can
+ * read the indexes it holds, or hold their locks.
+ *
+ * The files of archives which have since changed are left in the directory, to be removed by hand or with it. When
+ * the index cannot be saved to the directory, it is built for the calling process alone.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param dir The cache directory, NULL for the default directory of the calling user, on a memory-backed file system.
+ *
+ * @return an index to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated (errno is set).
+ */
+tar_index_t *tar_index_open_shared(int tar_fd, const char *dir);
+
+/**
+ * Sets how long tar_index_open_shared() waits for another process to publish a missing index before building one of
+ * its own, TAR_SHARED_LOCK_TIMEOUT_MS by default.
+ *
+ * @param milliseconds The time to wait, zero not to wait.
+ */
+void tar_set_shared_lock_timeout(unsigned milliseconds);
+
+/**
+ * Same as exists(), answered from the index.
+ */
+int exists_index(const tar_index_t *index, const char *path);
+
+/**
+ * Same as is_dir(), answered from the index.
+ */
+int is_dir_index(const tar_index_t *index, const char *path);
+
+/**
+ * Same as is_file(), answered from the index.
+ */
+int is_file_index(const tar_index_t *index, const char *path);
+
+/**
+ * Same as is_symlink(), answered from the index.
+ */
+int is_symlink_index(const tar_index_t *index, const char *path);
+
+/**
+ * Same as list(), answered from the index: the entries of every directory are recorded when the index is built.
+ * The entries are listed in name order.
+ */
+int list_index(const tar_index_t *index, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * Same as list_arena(), answered from the index. Only the array is allocated from the arena: the paths point into
+ * the index, and are valid until the index is freed.
+ */
+ssize_t list_index_arena(const tar_index_t *index, const char *path, tar_arena_t *arena, const char ***entries);
+
+/**
+ * Same as list_recursive(), answered from the index in name order. The entries below a directory are contiguous in
+ * name order, so they are found with two binary searches, and listing them costs O(log n + k) for k entries.
+ */
+ssize_t list_recursive_index(const tar_index_t *index, const char *path, tar_arena_t *arena, const char ***entries);
+
+/**
+ * Same as find(), answered from the index in name order. Only the entries starting with the part of the pattern before
+ * its first special character are tested, a range found with two binary searches, so that a pattern starting
+ * with "data/" costs O(log n + k) for the k entries below data/.
+ */
+ssize_t find_index(const tar_index_t *index, const char *pattern, tar_arena_t *arena, const char ***entries);
+
+/**
+ * Same as read_file(), except that the data of the entry is read directly at the offset recorded in the index.
+ */
+ssize_t read_file_index(const tar_index_t *index, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/* Types of entries, as bits of tar_filter_t.types */
+enum tar_type {
+    TAR_TYPE_FILE = 1,          /* REGTYPE or AREGTYPE */
+    TAR_TYPE_DIR = 2,
+    TAR_TYPE_SYMLINK = 4,
+    TAR_TYPE_HARDLINK = 8,
+    TAR_TYPE_OTHER = 16
+};
+
+/* Criteria of tar_index_select(), all of which an entry must meet. Fields left to zero select anything. */
+typedef struct tar_filter {
+    unsigned types;             /* entries of any of these enum tar_type bits */
+    uint64_t min_size;          /* entries with at least this size */
+    uint64_t max_size;          /* entries with at most this size */
+    uint64_t min_mtime;         /* entries modified at this time or after it */
+    const char *prefix;         /* entries whose path starts with this prefix, "dir/" selecting dir/ and all below it */
+} tar_filter_t;
+
+/**
+ * Selects the entries of the index matching a filter, for instance all regular files over 1 MB with
+ * { .types = TAR_TYPE_FILE, .min_size = 1000000 }, or all directories below dir/ with
+ * { .types = TAR_TYPE_DIR, .prefix = "dir/" }.
+ *
+ * The index keeps the type, size, data offset, mode and modification time of its entries in one array per field, in
+ * name order, so that the scan only goes through the arrays of the fields it tests, and only through the range of
+ * entries starting with the prefix. Links are selected as links, not as what they point to.
+ *
+ * @param index The index.
+ * @param filter The criteria.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed, in name order.
+ *
+ * @return the number of matching entries, which may be more than the number listed.
+ */
+ssize_t tar_index_select(const tar_index_t *index, const tar_filter_t *filter, char **entries, size_t *no_entries);
+
+/**
+ * Same as tar_index_select(), with every matching entry listed in an array allocated from an arena. The paths point
+ * into the index, and are valid until the index is freed.
+ *
+ * @return the number of matching entries, -1 if memory could not be allocated (errno is set).
+ */
+ssize_t tar_index_select_arena(const tar_index_t *index, const tar_filter_t *filter, tar_arena_t *arena,
+                               const char ***entries);
+
+/**
+ * Reads several files of the archive in a single pass.
+ *
+ * The archive is scanned once, and the data of each requested file is passed to the callback as its header is met,
+ * so the files are delivered in archive order, not in the order of paths. When a path is requested several times,
+ * its data is delivered once for each. Requested symlinks and hard links are resolved together after the pass, with
+ * one more scan for each hop of the longest chain of links.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths of the files to read.
+ * @param n The number of paths.
+ * @param callback Called with the data of each file found.
+ * @param arg Passed to the callback.
+ *
+ * @return the number of paths that were delivered, the others not being files of the archive,
+ *         -1 if the archive could not be read or the callback stopped the batch.
+ */
+ssize_t read_files_batch(int tar_fd, char **paths, size_t n, tar_batch_cb_t callback, void *arg);
+
+/**
+ * Same as read_files_batch(), with the files sorted by the data offset recorded in the index and read in a single
+ * ascending sweep over the archive. Links are resolved through the index. While a file is delivered, the kernel is
+ * asked to start reading the next TAR_PREFETCH_AHEAD files, so that the sweep seldom waits for the disk.
+ */
+ssize_t read_files_batch_index(const tar_index_t *index, char **paths, size_t n, tar_batch_cb_t callback, void *arg);
+
+/* Number of files read_files_batch_index() prefetches ahead of the one it delivers */
+#define TAR_PREFETCH_AHEAD 8
+
+/**
+ * Asks the kernel to start reading the data of files of the archive into the page cache, without waiting for it, for
+ * instance for the next files of a batch while the current ones are processed. Paths which are not files of the index
+ * are skipped, and links are resolved through the index.
+ *
+ * @param index The index.
+ * @param paths The paths of the files to prefetch.
+ * @param n The number of paths.
+ *
+ * @return the number of files prefetched, -1 on error (errno is set).
+ */
+ssize_t tar_index_prefetch(const tar_index_t *index, char **paths, size_t n);
+
+/**
+ * Extracts the archive under a directory.
+ *
+ * The archive is indexed once, so that a path given several times is extracted as its last member. Directories are
+ * created first, then regular files are written by nthreads threads, the largest ones first, the data being copied
+ * in the kernel with copy_file_range() when the file systems allow it. Symlinks and hard links are created once all
+ * files exist, and the modes and modification times of directories are set last, so that writing into them does not
+ * undo them. Members whose path is absolute or goes through "..", devices and fifos are not extracted, and nothing
+ * is ever written through a symlink of the archive. Owners are not restored.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param dest_dir The directory to extract into, which is created if it does not exist.
+ * @param nthreads The number of threads writing files, zero or a negative value for one per online processor.
+ *
+ * @return zero if every member was extracted,
+ *         -1 otherwise, the other members being extracted even so (errno is set after the first failure, EINVAL for
+ *         a member that is not extracted because of its path, EOPNOTSUPP for a device, a fifo or any other member
+ *         of a type that is not extracted).
+ */
+int tar_extract_all(int tar_fd, const char *dest_dir, int nthreads);
+
+/**
+ * A writer producing an archive which check_archive() accepts, with a pax extended header before a member whose path
+ * or link target does not fit in its ustar header, and sizes of 8 GiB or more in the GNU base-256 encoding.
+ *
+ * Headers, the data of small files and padding are gathered in a buffer which is written with a single writev() once
+ * full, so that adding a small file costs the read of its data and a share of one write. The data of larger files is
+ * copied from their descriptor within the kernel with copy_file_range() when the file systems allow it.
+ *
+ * After a failure the archive is incomplete, and every further call fails.
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Starts writing an archive.
+ *
+ * @param tar_fd A file descriptor open for writing, not in append mode, the archive being written from its current
+ *               offset. It stays owned by the caller.
+ *
+ * @return a writer to be finished with tar_writer_close(),
+ *         NULL if memory could not be allocated (errno is set).
+ */
+tar_writer_t *tar_writer_open(int tar_fd);
+
+/**
+ * Adds a regular file, with the mode, owner, size and modification time of src_fd and its content from its start.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param path The path of the member in the archive.
+ * @param src_fd A file descriptor of a regular file open for reading, whose offset is not used.
+ *
+ * @return zero, -1 if the file could not be read or the archive written (errno is set, EIO if the file became
+ *         shorter while being added).
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *path, int src_fd);
+
+/**
+ * Adds a directory, owned by the calling user. A '/' is appended to the path if it does not end with one.
+ *
+ * @return zero, -1 if the archive could not be written (errno is set).
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *path, uint32_t mode, int64_t mtime);
+
+/**
+ * Adds a symlink pointing to target, owned by the calling user.
+ *
+ * @return zero, -1 if the archive could not be written (errno is set).
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *path, const char *target, int64_t mtime);
+
+/**
+ * Writes the end-of-archive marker, padded to a whole record of 10 KiB as tar does, and releases the writer. The file
+ * descriptor is not closed.
+ *
+ * @return zero if the whole archive was written, -1 otherwise (errno is set).
+ */
+int tar_writer_close(tar_writer_t *writer);
+
+/**
+ * A catalog of many archives, whose entries are looked up in a single namespace.
+ *
+ * The indexes of the archives are merged into one hash table from path to archive and entry, so that finding a path
+ * in any of the archives is a single probe. Once added, an archive is closed until one of its files is read, so that
+ * a catalog of many archives does not hold a descriptor for each of them.
+ *
+ * Once archives are added, the lookup and read functions below can be called concurrently from several threads.
+ */
+typedef struct tar_catalog tar_catalog_t;
+
+/* Which archive holds a path found in several archives of a catalog. */
+enum tar_catalog_order {
+    TAR_CATALOG_LAST_WINS,      /* the archive added last, as with members appended to an archive */
+    TAR_CATALOG_FIRST_WINS,     /* the archive added first, as with a search path */
+};
+
+/**
+ * Creates an empty catalog.
+ *
+ * @param order Which archive holds a path found in several of them.
+ *
+ * @return a catalog to be released with tar_catalog_free(),
+ *         NULL if memory could not be allocated (errno is set).
+ */
+tar_catalog_t *tar_catalog_create(enum tar_catalog_order order);
+
+/**
+ * Adds an archive to a catalog, loading its index from a sidecar file, or scanning it when there is no such file or
+ * the archive changed since it was saved.
+ *
+ * @param catalog The catalog.
+ * @param archive_path The path of a valid tar archive file, opened again under this path when a file is first read.
+ * @param sidecar_path The path of a sidecar file written by tar_index_save(), NULL to scan the archive.
+ *
+ * @return the number of the archive in the catalog, counting from zero in the order they are added,
+ *         -1 if the archive could not be opened or read, or memory could not be allocated (errno is set).
+ */
+ssize_t tar_catalog_add(tar_catalog_t *catalog, const char *archive_path, const char *sidecar_path);
+
+/**
+ * Releases a catalog and the indexes of its archives, closing the archives it opened. Does nothing if catalog is
+ * NULL.
+ */
+void tar_catalog_free(tar_catalog_t *catalog);
+
+/**
+ * Tells which archive of a catalog holds a path.
+ *
+ * @return the number of the archive as returned by tar_catalog_add(), -1 if no archive holds the path.
+ */
+ssize_t tar_catalog_which(const tar_catalog_t *catalog, const char *path);
+
+/**
+ * Same as exists(), answered from the catalog.
+ */
+int exists_catalog(const tar_catalog_t *catalog, const char *path);
+
+/**
+ * Same as is_dir(), answered from the catalog.
+ */
+int is_dir_catalog(const tar_catalog_t *catalog, const char *path);
+
+/**
+ * Same as is_file(), answered from the catalog.
+ */
+int is_file_catalog(const tar_catalog_t *catalog, const char *path);
+
+/**
+ * Same as is_symlink(), answered from the catalog.
+ */
+int is_symlink_catalog(const tar_catalog_t *catalog, const char *path);
+
+/**
+ * Same as read_file_index(), for the archive of the catalog holding the path, which is opened if it is the first read
+ * of one of its files. Links are followed inside the archive holding them.
+ *
+ * @return the same values as read_file(), -1 also if the archive could not be opened, or changed since its entries
+ *         were added (errno is set to ESTALE).
+ */
+ssize_t read_file_catalog(tar_catalog_t *catalog, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * A tar archive mapped in memory.
+ *
+ * Headers and data are read straight out of the mapping, without any system call once the archive is open.
+ */
+typedef struct tar_mmap tar_mmap_t;
+
+/**
+ * Opens and maps a tar archive read-only.
+ *
+ * @param path The path of a valid tar archive file.
+ *
+ * @return a handle to be released with tar_close_mmap(),
+ *         NULL if the file could not be opened or mapped (errno is set).
+ */
+tar_mmap_t *tar_open_mmap(const char *path);
+
+/**
+ * Unmaps and closes an archive opened by tar_open_mmap(). Does nothing if archive is NULL.
+ */
+void tar_close_mmap(tar_mmap_t *archive);
+
+/**
+ * Finds the header of an entry in a mapped archive.
+ *
+ * @return a pointer to the header inside the mapping, valid until tar_close_mmap(),
+ *         NULL if no entry at the given path exists in the archive.
+ */
+const tar_header_t *tar_mmap_header(const tar_mmap_t *archive, const char *path);
+
+/**
+ * Same as read_file(), except that nothing is copied: dest is set to point to the requested bytes inside the mapping.
+ *
+ * @param archive A mapped tar archive.
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink or a hard link, it is resolved
+ *             to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest Set to the start of the requested bytes, valid until tar_close_mmap().
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes wanted, SIZE_MAX for the rest of the file.
+ *            The callee set it to the number of bytes available at dest.
+ *
+ * @return the same values as read_file().
+ */
+ssize_t read_file_view(const tar_mmap_t *archive, const char *path, size_t offset, const uint8_t **dest, size_t *len);
+
+/**
+ * Same as tar_advise(), for the mapping of the archive, with madvise(). TAR_ACCESS_DONTNEED also drops the pages of
+ * the archive from the page cache once no other process maps them.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_mmap_advise(tar_mmap_t *archive, enum tar_access access);
+
+/**
+ * A lightweight description of an archive entry, as yielded by tar_iter_next().
+ *
+ * Nothing is copied: name and header point into the iterator's buffer and stay valid until the next call to
+ * tar_iter_next() or tar_iter_close().
+ */
+typedef struct tar_entry {
+    const char *name;               /* full path of the entry, not necessarily null-terminated */
+    size_t name_len;                /* length of the path */
+    char typeflag;
+    uint64_t size;                  /* size of the data of the entry */
+    off_t data_offset;              /* offset in the archive of the first byte of data */
+    const tar_header_t *header;     /* raw header of the entry, for the other fields */
+} tar_entry_t;
+
+/**
+ * A pull-style iterator over the entries of an archive, in archive order.
+ *
+ * Pax and GNU long name headers are not yielded: they are folded into the path, link and size of the entry they
+ * describe.
+ *
+ * The iterator reads the archive through a fixed-size buffer, so its memory use does not depend on the size of the
+ * archive.
+ */
+typedef struct tar_iter tar_iter_t;
+
+/**
+ * Starts iterating over the entries of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return an iterator to be released with tar_iter_close(),
+ *         NULL if the archive could not be read or memory could not be allocated (errno is set).
+ */
+tar_iter_t *tar_iter_open(int tar_fd);
+
+/**
+ * Moves to the next entry of the archive.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param entry Filled with a description of the entry.
+ *
+ * @return 1 if an entry was yielded,
+ *         0 at the end of the archive,
+ *         -1 if the archive could not be read.
+ */
+int tar_iter_next(tar_iter_t *iter, tar_entry_t *entry);
+
+/**
+ * Releases an iterator. Does nothing if iter is NULL.
+ */
+void tar_iter_close(tar_iter_t *iter);
+
+/**
+ * A cursor over the data of one file of the archive.
+ *
+ * The file is looked up once, when the stream is opened: reads and seeks then go straight to the data, whatever the
+ * position of the file in the archive.
+ */
+typedef struct tar_file_stream tar_file_stream_t;
+
+/**
+ * Opens a stream over a file of the archive. If the entry is a symlink or a hard link, it is resolved to its
+ * linked-to entry.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, which must stay open for as
+ *               long as the stream is used.
+ * @param path A path to an entry in the archive.
+ *
+ * @return a stream positioned at the start of the file, to be released with tar_stream_close(),
+ *         NULL if no entry at the given path exists in the archive or the entry is not a file (errno is set to ENOENT),
+ *         or if the archive could not be read.
+ */
+tar_file_stream_t *tar_stream_open(int tar_fd, const char *path);
+
+/**
+ * Same as tar_stream_open(), with the file looked up in the index.
+ */
+tar_file_stream_t *tar_stream_open_index(const tar_index_t *index, const char *path);
+
+/**
+ * Reads from the current position of the stream, and moves it past the bytes read.
+ *
+ * @param stream A stream opened by tar_stream_open() or tar_stream_open_index().
+ * @param dest A destination buffer to read the file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if the archive could not be read,
+ *         -2 if the position is at the end of the file,
+ *         zero if the rest of the file was read into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_stream_read(tar_file_stream_t *stream, uint8_t *dest, size_t *len);
+
+/**
+ * Moves the position of the stream.
+ *
+ * @param stream A stream opened by tar_stream_open() or tar_stream_open_index().
+ * @param offset The new position, zero indicates the start of the file.
+ *
+ * @return zero on success,
+ *         -2 if the offset is outside the file total length (the position is left unchanged).
+ */
+int tar_stream_seek(tar_file_stream_t *stream, uint64_t offset);
+
+/**
+ * Returns the current position of the stream.
+ */
+uint64_t tar_stream_tell(const tar_file_stream_t *stream);
+
+/**
+ * Returns the total size of the file the stream reads.
+ */
+uint64_t tar_stream_size(const tar_file_stream_t *stream);
+
+/**
+ * Releases a stream. Does nothing if stream is NULL.
+ */
+void tar_stream_close(tar_file_stream_t *stream);
+
+/**
+ * An asynchronous read engine serving read_file_index() requests.
+ *
+ * Requests are queued with tar_async_read(), sent to the kernel together with tar_async_submit(), and their callbacks
+ * are run by tar_async_wait() as they complete. Each request costs a single data read, its offset coming from the
+ * index. Requests on several indexes, hence several archives, can be mixed in the same engine.
+ *
+ * On Linux the engine uses io_uring. Where io_uring is not available, requests are served with pread() when they
+ * are submitted, and their callbacks are still run by tar_async_wait().
+ *
+ * An engine must only be used by one thread at a time.
+ */
+typedef struct tar_async tar_async_t;
+
+/**
+ * Receives the result of a request queued with tar_async_read().
+ *
+ * @param ret The value read_file_index() would have returned: -1 if the archive could not be read, zero if the file
+ *            was read until its end, otherwise the number of bytes left to be read to reach the end of the file.
+ * @param len The number of bytes written to the destination buffer of the request.
+ * @param arg The argument given to tar_async_read().
+ */
+typedef void (*tar_async_cb_t)(ssize_t ret, size_t len, void *arg);
+
+/**
+ * Creates an asynchronous read engine.
+ *
+ * @param depth The maximum number of requests in flight.
+ *
+ * @return an engine to be released with tar_async_destroy(),
+ *         NULL if memory could not be allocated (errno is set).
+ */
+tar_async_t *tar_async_create(unsigned depth);
+
+/**
+ * Queues a read of a file of an archive.
+ *
+ * The file is looked up in the index straight away. When the engine already holds depth requests, completed requests
+ * are first waited for and their callbacks run.
+ *
+ * @param async The engine.
+ * @param index The index of the archive, which must stay valid until the request completes.
+ * @param path A path to an entry in the archive to read from. If the entry is a link, it is resolved.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer, which must stay valid until the request completes.
+ * @param len The size of dest.
+ * @param callback Called with the result of the request.
+ * @param arg Passed to the callback.
+ *
+ * @return zero if the request was queued,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file, or on error,
+ *         -2 if the offset is outside the file total length.
+ */
+int tar_async_read(tar_async_t *async, const tar_index_t *index, const char *path, size_t offset, uint8_t *dest,
+                   size_t len, tar_async_cb_t callback, void *arg);
+
+/**
+ * Sends all queued requests to the kernel at once.
+ *
+ * @return the number of requests submitted, -1 on error.
+ */
+int tar_async_submit(tar_async_t *async);
+
+/**
+ * Submits the queued requests, waits until at least min_complete requests are complete, and runs the callbacks of
+ * all completed requests. min_complete is capped to the number of requests in flight.
+ *
+ * @return the number of callbacks run, -1 on error.
+ */
+int tar_async_wait(tar_async_t *async, unsigned min_complete);
+
+/**
+ * Waits for all requests and releases the engine. Does nothing if async is NULL.
+ */
+void tar_async_destroy(tar_async_t *async);
+
+/**
+ * A compressed tar archive, .tar.gz or .tar.zst, read through a decompressor.
+ *
+ * Opening the archive decompresses it once, checking its headers and the checksums of the compressed data, indexing
+ * its members and recording a checkpoint of the decompressor state every span bytes of decompressed data. A read then
+ * resumes decompressing at the last checkpoint before the data it wants rather than at the start of the archive, and a
+ * read following the previous one continues where it stopped.
+ *
+ * gzip checkpoints can be taken between any two deflate blocks, at the cost of a 32 KiB window each. zstd checkpoints
+ * can only be taken between frames, so that a single-frame .tar.zst is always read from its start: archives meant for
+ * random access should be compressed in independent frames (by pzstd or t2sz, for instance), or with gzip. zstd
+ * support is only built when the library is compiled with TAR_HAVE_ZSTD (make ZSTD=1).
+ *
+ * A handle holds the decompressor state and must not be used by several threads at once.
+ */
+typedef struct tar_compressed tar_compressed_t;
+
+/* Default distance between two checkpoints, in bytes of decompressed data */
+#define TAR_COMPRESSED_DEFAULT_SPAN (1 << 20)
+
+/**
+ * Opens a compressed tar archive, detecting the compression from its first bytes, and indexes it.
+ *
+ * @param tar_fd A file descriptor pointing to a gzip or zstd compressed tar archive, which stays owned by the caller.
+ * @param span The distance between two checkpoints in bytes of decompressed data, zero for the default.
+ *
+ * @return a handle to be released with tar_close_compressed(),
+ *         NULL if the archive could not be read or decompressed or memory could not be allocated (errno is set,
+ *         EINVAL for corrupt data, ENOTSUP for a compression that is not supported).
+ */
+tar_compressed_t *tar_open_compressed(int tar_fd, size_t span);
+
+/**
+ * Returns the index of the members of a compressed archive, valid until tar_close_compressed().
+ *
+ * The index answers exists_index(), is_dir_index(), is_file_index(), is_symlink_index(), list_index() and
+ * tar_index_select() as for a plain archive. Its data offsets are offsets in the decompressed archive, so that the
+ * files are read with read_file_compressed() rather than with read_file_index(), which fails on it.
+ */
+const tar_index_t *tar_compressed_index(const tar_compressed_t *archive);
+
+/**
+ * Same as read_file_index(), on a compressed archive.
+ *
+ * @return the same values as read_file(), -1 also if the archive could not be read or decompressed.
+ */
+ssize_t read_file_compressed(tar_compressed_t *archive, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Releases a handle returned by tar_open_compressed(), without closing its file descriptor. Does nothing if archive
+ * is NULL.
+ */
+void tar_close_compressed(tar_compressed_t *archive);
+
+/*
+ * Instrumentation.
+ *
+ * When the library is compiled with TAR_STATS defined (make CPPFLAGS=-DTAR_STATS), it counts what its hot paths do
+ * and times the public functions listed in enum tar_op, which are all those that read, look up or write something.
+ * Functions which only allocate or free a handle, give one of its fields or change a setting are not timed. Counters
+ * are kept per thread, without locking, and count the work done by the calling thread: the worker threads of
+ * check_archive_parallel() and tar_extract_all() keep their own. Without TAR_STATS, the counting compiles to nothing,
+ * tar_stats_get() reports zeros and no trace hook is ever called.
+ */
+
+/* The public functions that are timed and traced */
+enum tar_op {
+    TAR_OP_CHECK_ARCHIVE,
+    TAR_OP_EXISTS,
+    TAR_OP_IS_DIR,
+    TAR_OP_IS_FILE,
+    TAR_OP_IS_SYMLINK,
+    TAR_OP_LIST,
+    TAR_OP_READ_FILE,
+    TAR_OP_INDEX_BUILD,
+    TAR_OP_INDEX_UPDATE,
+    TAR_OP_EXISTS_INDEX,
+    TAR_OP_IS_DIR_INDEX,
+    TAR_OP_IS_FILE_INDEX,
+    TAR_OP_IS_SYMLINK_INDEX,
+    TAR_OP_LIST_INDEX,
+    TAR_OP_READ_FILE_INDEX,
+    TAR_OP_CHECK_ARCHIVE_PARALLEL,
+    TAR_OP_OPEN_MMAP,
+    TAR_OP_MMAP_HEADER,
+    TAR_OP_READ_FILE_VIEW,
+    TAR_OP_ITER_OPEN,
+    TAR_OP_ITER_NEXT,
+    TAR_OP_READ_FILES_BATCH,
+    TAR_OP_READ_FILES_BATCH_INDEX,
+    TAR_OP_STREAM_OPEN,
+    TAR_OP_STREAM_OPEN_INDEX,
+    TAR_OP_STREAM_READ,
+    TAR_OP_STREAM_SEEK,
+    TAR_OP_ASYNC_READ,
+    TAR_OP_ASYNC_SUBMIT,
+    TAR_OP_ASYNC_WAIT,
+    TAR_OP_INDEX_SAVE,
+    TAR_OP_INDEX_LOAD,
+    TAR_OP_INDEX_SELECT,
+    TAR_OP_OPEN_COMPRESSED,
+    TAR_OP_READ_FILE_COMPRESSED,
+    TAR_OP_EXTRACT_ALL,
+    TAR_OP_WRITER_ADD_FILE,
+    TAR_OP_WRITER_ADD_DIR,
+    TAR_OP_WRITER_ADD_SYMLINK,
+    TAR_OP_WRITER_CLOSE,
+    TAR_OP_LIST_ARENA,
+    TAR_OP_LIST_INDEX_ARENA,
+    TAR_OP_INDEX_SELECT_ARENA,
+    TAR_OP_LIST_RECURSIVE,
+    TAR_OP_FIND,
+    TAR_OP_LIST_RECURSIVE_INDEX,
+    TAR_OP_FIND_INDEX,
+    TAR_OP_INDEX_OPEN_SHARED,
+    TAR_OP_INDEX_PREFETCH,
+    TAR_OP_INDEX_VALIDATE,
+    TAR_OP_INDEX_HASH_CONTENTS,
+    TAR_OP_INDEX_CONTENT_HASH,
+    TAR_OP_CATALOG_ADD,
+    TAR_OP_CATALOG_WHICH,
+    TAR_OP_EXISTS_CATALOG,
+    TAR_OP_IS_DIR_CATALOG,
+    TAR_OP_IS_FILE_CATALOG,
+    TAR_OP_IS_SYMLINK_CATALOG,
+    TAR_OP_READ_FILE_CATALOG,
+    TAR_OP_COUNT
+};
+
+typedef struct tar_counters {
+    uint64_t headers_scanned;   /* headers visited while scanning the archive */
+    uint64_t bytes_read;        /* bytes read from the archive file */
+    uint64_t syscalls;          /* read system calls issued: pread() and io_uring_enter() */
+    uint64_t seeks;             /* reads of the archive which do not continue the previous one, such as rescans */
+    uint64_t index_hits;        /* paths found in an index */
+    uint64_t index_misses;      /* paths not found in an index */
+} tar_counters_t;
+
+typedef struct tar_stats {
+    tar_counters_t counters;
+    uint64_t calls[TAR_OP_COUNT];   /* calls of each public function */
+    uint64_t ns[TAR_OP_COUNT];      /* time spent in each public function, in nanoseconds */
+} tar_stats_t;
+
+/* A call of a public function, as reported to the trace hook */
+typedef struct tar_trace_event {
+    enum tar_op op;
+    const char *path;           /* the path argument, NULL for functions without one */
+    long ret;                   /* the returned value, 1 or 0 for functions returning a pointer */
+    uint64_t ns;                /* duration of the call */
+    tar_counters_t counters;    /* what the call did */
+} tar_trace_event_t;
+
+typedef void (*tar_trace_cb_t)(const tar_trace_event_t *event, void *arg);
+
+/**
+ * Copies the counters of the calling thread into stats.
+ */
+void tar_stats_get(tar_stats_t *stats);
+
+/**
+ * Resets the counters of the calling thread.
+ */
+void tar_stats_reset(void);
+
+/**
+ * Installs a hook called at the end of every call of a function listed in enum tar_op, in the thread that made it.
+ * The hook is process-wide and should be installed before other threads use the library. A NULL callback removes it.
+ *
+ * @return zero, -1 if the library was compiled without TAR_STATS.
+ */
+int tar_set_trace(tar_trace_cb_t callback, void *arg);
+
+/**
+ * Returns the name of the public function an operation stands for, for instance "read_file_index".
+ */
+const char *tar_op_name(enum tar_op op);
+
 #endif
@@ -1,7 +1,19 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
-#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
 
@@ -24,20 +36,2398 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Usage: %s tar_file\n", argv[0]);
-        return -1;
+/*
+ * Run without arguments, the tests write their archives in a temporary directory and check the functions of the
+ * library on them, printing each check that fails. Run with the path of an archive, check_archive() is called on it.
+ */
+
+static int checks, failures;
+static char test_dir[] = "/tmp/lib_tar-tests-XXXXXX";
+
+#define CHECK(cond) test_check((cond), #cond, __LINE__)
+
+static void test_check(int ok, const char *expr, int line) {
+    checks++;
+    if (!ok) {
+        printf("tests.c:%d: check failed: %s\n", line, expr);
+        failures++;
+    }
+}
+
+/* Returns the path of a file of the temporary directory, in one of four buffers used in turn. */
+static const char *test_path(const char *name) {
+    static char paths[4][PATH_MAX];
+    static int next;
+    char *path = paths[next++ % 4];
+
+    snprintf(path, PATH_MAX, "%s/%s", test_dir, name);
+    return path;
+}
+
+/* A member of a test archive: data is the content of a file or an extended header, or the target of a link. */
+struct test_member {
+    const char *path;
+    char typeflag;
+    const char *data;
+};
+
+/* Computes the checksum of a header. */
+static void test_chksum(tar_header_t *header) {
+    unsigned sum = 0;
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        sum += ((const uint8_t *)header)[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    header->chksum[7] = ' ';
+}
+
+/* Fills a ustar header, splitting a path longer than the name field into the prefix and the name. */
+static void test_header(tar_header_t *header, const char *path, char typeflag, const char *linkname, size_t size) {
+    size_t len = strlen(path);
+
+    memset(header, 0, sizeof(*header));
+    if (len > sizeof(header->name)) {
+        const char *split = strchr(path + len - sizeof(header->name) - 1, '/');
+
+        memcpy(header->prefix, path, (size_t)(split - path));
+        memcpy(header->name, split + 1, len - (size_t)(split - path) - 1);
+    } else {
+        memcpy(header->name, path, len);
+    }
+    snprintf(header->mode, sizeof(header->mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011o", (unsigned)size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 1700000000);
+    header->typeflag = typeflag;
+    if (linkname != NULL) {
+        memcpy(header->linkname, linkname, strlen(linkname));
+    }
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    memcpy(header->uname, "root", 4);
+    memcpy(header->gname, "root", 4);
+    test_chksum(header);
+}
+
+/* Appends members to an archive, followed by the end-of-archive marker. */
+static void test_append(int fd, const struct test_member *members, size_t count) {
+    static const uint8_t zeros[2 * TAR_HEADER_SIZE];
+    tar_header_t header;
+
+    for (size_t i = 0; i < count; i++) {
+        char type = members[i].typeflag;
+        int is_link = type == LNKTYPE || type == SYMTYPE;
+        size_t size = members[i].data != NULL && !is_link ? strlen(members[i].data) : 0;
+
+        test_header(&header, members[i].path, type, is_link ? members[i].data : NULL, size);
+        if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+            (size > 0 && write(fd, members[i].data, size) != (ssize_t)size) ||
+            write(fd, zeros, (TAR_HEADER_SIZE - size % TAR_HEADER_SIZE) % TAR_HEADER_SIZE) == -1) {
+            perror("write(archive)");
+            exit(-1);
+        }
+    }
+    if (write(fd, zeros, sizeof(zeros)) != sizeof(zeros)) {
+        perror("write(archive)");
+        exit(-1);
     }
+}
+
+/* Writes an archive of the given members in the temporary directory, and returns a descriptor of it. */
+static int test_archive(const char *name, const struct test_member *members, size_t count) {
+    int fd = open(test_path(name), O_RDWR | O_CREAT | O_TRUNC, 0644);
 
-    int fd = open(argv[1] , O_RDONLY);
     if (fd == -1) {
-        perror("open(tar_file)");
-        return -1;
+        perror("open(archive)");
+        exit(-1);
+    }
+    test_append(fd, members, count);
+    return fd;
+}
+
+#define TEST_ARCHIVE(name, members) test_archive(name, members, sizeof(members) / sizeof(members[0]))
+
+/* The archive most tests are run on. */
+static const struct test_member test_tree[] = {
+    {"dir/", DIRTYPE, NULL},
+    {"dir/a", REGTYPE, "hello"},
+    {"dir/b", REGTYPE, ""},
+    {"dir/c/", DIRTYPE, NULL},
+    {"dir/c/d", REGTYPE, "a nested file"},
+    {"dir/e/", DIRTYPE, NULL},
+    {"dir/link", SYMTYPE, "a"},
+    {"file", AREGTYPE, "a file at the root"},
+};
+
+/* Reads a whole file through read_file_index() and compares it with the expected content. */
+static int test_read_index(const tar_index_t *index, const char *path, const char *expected) {
+    uint8_t buf[256];
+    size_t len = sizeof(buf);
+
+    return read_file_index(index, path, 0, buf, &len) == 0 && len == strlen(expected) &&
+           memcmp(buf, expected, len) == 0;
+}
+
+static void test_index(void) {
+    int fd = TEST_ARCHIVE("index.tar", test_tree);
+    tar_index_t *index = tar_index_build(fd);
+    uint8_t buf[8];
+    size_t len;
+
+    CHECK(index != NULL);
+    CHECK(exists_index(index, "dir/") && exists_index(index, "dir/c/d") && exists_index(index, "file"));
+    CHECK(!exists_index(index, "missing") && !exists_index(index, "dir/c/d/") && !exists_index(index, ""));
+    CHECK(is_dir_index(index, "dir/") && is_dir_index(index, "dir/e/") && !is_dir_index(index, "dir/a"));
+    CHECK(is_file_index(index, "dir/a") && is_file_index(index, "file") && !is_file_index(index, "dir/"));
+    CHECK(!is_file_index(index, "dir/link") && !is_file_index(index, "missing"));
+    CHECK(is_symlink_index(index, "dir/link") && !is_symlink_index(index, "dir/a"));
+
+    // The answers of the index are those of a scan of the archive, which starts at the offset of the descriptor.
+    for (size_t i = 0; i < sizeof(test_tree) / sizeof(test_tree[0]); i++) {
+        char *path = (char *)test_tree[i].path;
+
+        CHECK(lseek(fd, 0, SEEK_SET) == 0 && exists_index(index, path) == !!exists(fd, path));
+        CHECK(lseek(fd, 0, SEEK_SET) == 0 && is_dir_index(index, path) == !!is_dir(fd, path));
+        CHECK(lseek(fd, 0, SEEK_SET) == 0 && is_file_index(index, path) == !!is_file(fd, path));
+        CHECK(lseek(fd, 0, SEEK_SET) == 0 && is_symlink_index(index, path) == !!is_symlink(fd, path));
+    }
+
+    CHECK(test_read_index(index, "dir/a", "hello"));
+    len = 2;
+    CHECK(read_file_index(index, "dir/a", 0, buf, &len) == 3 && len == 2 && memcmp(buf, "he", 2) == 0);
+    len = sizeof(buf);
+    CHECK(read_file_index(index, "dir/a", 3, buf, &len) == 0 && len == 2 && memcmp(buf, "lo", 2) == 0);
+    len = sizeof(buf);
+    CHECK(read_file_index(index, "dir/a", 5, buf, &len) == -2);
+    // As with read_file(), an offset at the end of the file is outside it, even for an empty file.
+    len = sizeof(buf);
+    CHECK(read_file_index(index, "dir/b", 0, buf, &len) == -2);
+    len = sizeof(buf);
+    CHECK(read_file_index(index, "missing", 0, buf, &len) == -1);
+    len = sizeof(buf);
+    CHECK(read_file_index(index, "dir/", 0, buf, &len) == -1);
+    tar_index_free(index);
+    close(fd);
+
+    // The last of several members with the same path wins.
+    static const struct test_member twice[] = {
+        {"file", REGTYPE, "first"},
+        {"other", REGTYPE, "other"},
+        {"file", REGTYPE, "second"},
+    };
+    fd = TEST_ARCHIVE("twice.tar", twice);
+    index = tar_index_build(fd);
+    CHECK(index != NULL && test_read_index(index, "file", "second") && test_read_index(index, "other", "other"));
+    tar_index_free(index);
+    close(fd);
+
+    fd = test_archive("empty.tar", NULL, 0);
+    index = tar_index_build(fd);
+    CHECK(index != NULL && !exists_index(index, "file"));
+    tar_index_free(index);
+    close(fd);
+
+    CHECK(tar_index_build(-1) == NULL && errno == EBADF);
+    tar_index_free(NULL);
+}
+
+static void test_mmap(void) {
+    int fd = TEST_ARCHIVE("mmap.tar", test_tree);
+    tar_mmap_t *archive = tar_open_mmap(test_path("mmap.tar"));
+    const tar_header_t *header;
+    const uint8_t *data, *rest;
+    size_t len;
+
+    CHECK(archive != NULL);
+    header = tar_mmap_header(archive, "dir/c/d");
+    CHECK(header != NULL && header->typeflag == REGTYPE && strcmp(header->name, "dir/c/d") == 0);
+    CHECK(tar_mmap_header(archive, "missing") == NULL);
+
+    len = SIZE_MAX;
+    CHECK(read_file_view(archive, "dir/a", 0, &data, &len) == 0 && len == 5 && memcmp(data, "hello", 5) == 0);
+    len = 2;
+    CHECK(read_file_view(archive, "dir/a", 0, &data, &len) == 3 && len == 2);
+    len = SIZE_MAX;
+    // The data is not copied: both views point into the same mapping.
+    CHECK(read_file_view(archive, "dir/a", 2, &rest, &len) == 0 && len == 3 && rest == data + 2);
+    len = SIZE_MAX;
+    CHECK(read_file_view(archive, "dir/a", 5, &data, &len) == -2);
+    len = SIZE_MAX;
+    CHECK(read_file_view(archive, "dir/", 0, &data, &len) == -1);
+    len = SIZE_MAX;
+    CHECK(read_file_view(archive, "missing", 0, &data, &len) == -1);
+
+    // The views are the bytes read_file() copies.
+    for (size_t i = 0; i < sizeof(test_tree) / sizeof(test_tree[0]); i++) {
+        uint8_t buf[256];
+        size_t buf_len = sizeof(buf);
+        ssize_t ret = read_file(fd, (char *)test_tree[i].path, 0, buf, &buf_len);
+
+        len = SIZE_MAX;
+        CHECK(read_file_view(archive, test_tree[i].path, 0, &data, &len) == ret);
+        CHECK(ret != 0 || (len == buf_len && memcmp(data, buf, len) == 0));
+    }
+    tar_close_mmap(archive);
+    close(fd);
+
+    CHECK(tar_open_mmap(test_path("missing.tar")) == NULL && errno == ENOENT);
+    tar_close_mmap(NULL);
+}
+
+static void test_scan_chunks(void) {
+    static const size_t sizes[] = {0, 512, 1000, 4096, TAR_SCAN_DEFAULT_CHUNK_SIZE};
+    static char data[40][1500];
+    static char paths[40][16];
+    struct test_member members[41] = {{"many/", DIRTYPE, NULL}};
+    int fd;
+
+    // Files of varied sizes, so that headers and data straddle the chunks of every size.
+    for (int i = 0; i < 40; i++) {
+        memset(data[i], 'a' + i % 26, (size_t)(i * 37));
+        snprintf(paths[i], sizeof(paths[i]), "many/f%d", i);
+        members[i + 1] = (struct test_member){paths[i], REGTYPE, data[i]};
+    }
+    fd = test_archive("chunks.tar", members, 41);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char buffers[64][PATH_MAX];
+        char *entries[64];
+        size_t no_entries = 64;
+        uint8_t buf[1500];
+        size_t len = sizeof(buf);
+
+        for (int i = 0; i < 64; i++) {
+            entries[i] = buffers[i];
+        }
+        tar_set_scan_chunk_size(sizes[s]);
+        CHECK(check_archive(fd) == 41);
+        CHECK(exists(fd, "many/f39") && is_file(fd, "many/f39") && !exists(fd, "many/f40"));
+        CHECK(is_dir(fd, "many/") && !is_symlink(fd, "many/f0"));
+        CHECK(list(fd, "many/", entries, &no_entries) && strcmp(entries[no_entries - 1], "many/f39") == 0);
+        CHECK(read_file(fd, "many/f38", 0, buf, &len) == 0 && len == 38 * 37 && memcmp(buf, data[38], len) == 0);
+        len = 10;
+        CHECK(read_file(fd, "many/f38", 1000, buf, &len) == 38 * 37 - 1010 && len == 10);
+    }
+    tar_set_scan_chunk_size(TAR_SCAN_DEFAULT_CHUNK_SIZE);
+    close(fd);
+}
+
+/* Overwrites bytes of an archive. */
+static void test_patch(int fd, off_t offset, const void *bytes, size_t len) {
+    if (pwrite(fd, bytes, len, offset) != (ssize_t)len) {
+        perror("pwrite(archive)");
+        exit(-1);
+    }
+}
+
+static void test_header_verify(void) {
+    static const struct test_member accented[] = {
+        {"caf\xc3\xa9/\xff", REGTYPE, "bytes over 127 add up unsigned"},
+    };
+    tar_header_t header, bad;
+    int fd;
+
+    test_header(&header, "dir/a", REGTYPE, NULL, 5);
+    CHECK(tar_header_verify(&header) == 0);
+    bad = header;
+    bad.magic[5] = ' ';
+    CHECK(tar_header_verify(&bad) == -1);
+    bad = header;
+    bad.version[1] = '1';
+    CHECK(tar_header_verify(&bad) == -2);
+    bad = header;
+    bad.chksum[0] ^= 1;
+    CHECK(tar_header_verify(&bad) == -3);
+    // A byte changed outside the checked fields is only caught by the checksum.
+    bad = header;
+    bad.padding[11] = 1;
+    CHECK(tar_header_verify(&bad) == -3);
+    CHECK(memcmp(&header.chksum, &bad.chksum, sizeof(header.chksum)) == 0);
+
+    test_header(&header, "caf\xc3\xa9/\xff", REGTYPE, NULL, 0);
+    CHECK(tar_header_verify(&header) == 0);
+    fd = TEST_ARCHIVE("accented.tar", accented);
+    CHECK(check_archive(fd) == 1);
+    close(fd);
+
+    fd = TEST_ARCHIVE("verify.tar", test_tree);
+    CHECK(check_archive(fd) == 8);
+    // The header of dir/c/, the fifth block, gets a bad checksum, then a bad version, then a bad magic value.
+    test_patch(fd, 4 * TAR_HEADER_SIZE + 148, "1", 1);
+    CHECK(check_archive(fd) == -3);
+    test_patch(fd, 4 * TAR_HEADER_SIZE + 263, "01", 2);
+    CHECK(check_archive(fd) == -2);
+    test_patch(fd, 4 * TAR_HEADER_SIZE + 257, "USTAR", 5);
+    CHECK(check_archive(fd) == -1);
+    close(fd);
+
+    fd = test_archive("empty.tar", NULL, 0);
+    CHECK(check_archive(fd) == 0);
+    close(fd);
+}
+
+static void test_check_parallel(void) {
+    static const int threads[] = {0, 1, 2, 3, 64};
+    static char paths[100][16];
+    struct test_member members[100];
+    int fd;
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "f%d", i);
+        members[i] = (struct test_member){paths[i], REGTYPE, i % 2 ? "odd" : ""};
+    }
+    members[0] = (struct test_member){"flat/", DIRTYPE, NULL};
+    fd = test_archive("parallel.tar", members, 100);
+
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        CHECK(check_archive_parallel(fd, threads[t]) == 100);
+    }
+
+    // Odd files have a data block after their header: header i is at block i + i / 2.
+    test_patch(fd, (90 + 45) * TAR_HEADER_SIZE + 148, "1", 1);
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        CHECK(check_archive_parallel(fd, threads[t]) == -3);
+    }
+    // The earliest bad header is reported, whichever thread checks it.
+    test_patch(fd, (60 + 30) * TAR_HEADER_SIZE + 263, "01", 2);
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        CHECK(check_archive_parallel(fd, threads[t]) == -2 && check_archive(fd) == -2);
+    }
+    test_patch(fd, 3 * TAR_HEADER_SIZE + 257, "USTAR", 5);
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        CHECK(check_archive_parallel(fd, threads[t]) == -1);
+    }
+    close(fd);
+
+    fd = test_archive("empty.tar", NULL, 0);
+    CHECK(check_archive_parallel(fd, 4) == 0);
+    close(fd);
+}
+
+/* Points the entries of a listing at buffers long enough for any path. */
+static char **test_entries(void) {
+    static char buffers[16][PATH_MAX];
+    static char *entries[16];
+
+    for (int i = 0; i < 16; i++) {
+        entries[i] = buffers[i];
+    }
+    return entries;
+}
+
+/* Checks that the first n entries listed are the given paths, in order. */
+static int test_listed(char **entries, size_t n, const char *const *expected, size_t expected_count) {
+    if (n != expected_count) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(entries[i], expected[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_list(void) {
+    static const struct test_member order[] = {
+        {"dir/", DIRTYPE, NULL},
+        {"dir/z", REGTYPE, "z"},
+        {"dir/sub/", DIRTYPE, NULL},
+        {"dir/sub/x", REGTYPE, "x"},
+        {"dir/sub/deeper/", DIRTYPE, NULL},
+        {"dir/a", REGTYPE, "a"},
+        {"dir/empty/", DIRTYPE, NULL},
+        {"other/", DIRTYPE, NULL},
+    };
+    static const char *const archive_order[] = {"dir/z", "dir/sub/", "dir/a", "dir/empty/"};
+    static const char *const name_order[] = {"dir/a", "dir/empty/", "dir/sub/", "dir/z"};
+    static const char *const sub[] = {"dir/sub/x", "dir/sub/deeper/"};
+    int fd = TEST_ARCHIVE("list.tar", order);
+    tar_index_t *index = tar_index_build(fd);
+    char **entries = test_entries();
+    size_t n;
+
+    // Only the entries right below the directory are listed, in archive order.
+    n = 16;
+    CHECK(list(fd, "dir/", entries, &n) && test_listed(entries, n, archive_order, 4));
+    n = 16;
+    CHECK(list(fd, "dir/sub/", entries, &n) && test_listed(entries, n, sub, 2));
+    n = 16;
+    CHECK(list(fd, "dir/empty/", entries, &n) && n == 0);
+    n = 2;
+    CHECK(list(fd, "dir/", entries, &n) && test_listed(entries, n, archive_order, 2));
+    n = 16;
+    CHECK(!list(fd, "dir", entries, &n) && !list(fd, "dir/z", entries, &n) && !list(fd, "missing/", entries, &n));
+
+    // The index lists them in name order.
+    n = 16;
+    CHECK(list_index(index, "dir/", entries, &n) && test_listed(entries, n, name_order, 4));
+    n = 16;
+    CHECK(list_index(index, "dir/sub/", entries, &n) && n == 2);
+    n = 16;
+    CHECK(list_index(index, "dir/empty/", entries, &n) && n == 0);
+    n = 2;
+    CHECK(list_index(index, "dir/", entries, &n) && test_listed(entries, n, name_order, 2));
+    n = 16;
+    CHECK(!list_index(index, "dir", entries, &n) && !list_index(index, "dir/z", entries, &n));
+    CHECK(!list_index(index, "missing/", entries, &n));
+    tar_index_free(index);
+    close(fd);
+
+    // A path which is not a directory leaves the buffers alone, and a sibling starting with the path is not listed.
+    static const struct test_member siblings[] = {
+        {"dir/", DIRTYPE, NULL},
+        {"dir/a", REGTYPE, "a"},
+        {"dirx/", DIRTYPE, NULL},
+        {"dirx/b", REGTYPE, "b"},
+        {"plain", DIRTYPE, NULL},
+        {"plain/c", REGTYPE, "c"},
+        {"plainx/d", REGTYPE, "d"},
+    };
+    static const char *const plain[] = {"plain/c"};
+    fd = TEST_ARCHIVE("siblings.tar", siblings);
+    strcpy(entries[0], "untouched");
+    n = 16;
+    CHECK(!list(fd, "dir", entries, &n) && n == 16 && strcmp(entries[0], "untouched") == 0);
+    n = 16;
+    CHECK(list(fd, "plain", entries, &n) && test_listed(entries, n, plain, 1));
+    close(fd);
+}
+
+static void test_index_lookup(void) {
+    enum { COUNT = 3000 };
+    static char paths[COUNT][16];
+    static struct test_member members[COUNT + 1] = {{"n/", DIRTYPE, NULL}};
+    tar_index_t *index;
+    int fd, found = 0, missed = 0;
+
+    for (int i = 0; i < COUNT; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "n/%d", i);
+        members[i + 1] = (struct test_member){paths[i], REGTYPE, paths[i]};
+    }
+    fd = test_archive("lookup.tar", members, COUNT + 1);
+    index = tar_index_build(fd);
+    CHECK(index != NULL);
+
+    // Every path is found, and none of the paths one character away from them.
+    for (int i = 0; i < COUNT; i++) {
+        char near[24];
+
+        found += is_file_index(index, paths[i]) && test_read_index(index, paths[i], paths[i]);
+        snprintf(near, sizeof(near), "n/%dx", i);
+        missed += !exists_index(index, near);
+        snprintf(near, sizeof(near), "n/0%d", i);
+        missed += !exists_index(index, near);
+        snprintf(near, sizeof(near), "n%d", i);
+        missed += !exists_index(index, near);
+    }
+    CHECK(found == COUNT && missed == 3 * COUNT);
+    CHECK(is_dir_index(index, "n/") && !exists_index(index, "n") && !exists_index(index, "n/3000"));
+    tar_index_free(index);
+    close(fd);
+}
+
+static void test_iter(void) {
+    int fd = TEST_ARCHIVE("iter.tar", test_tree);
+    tar_iter_t *iter = tar_iter_open(fd);
+    tar_entry_t entry;
+    size_t i = 0;
+    int ret;
+
+    CHECK(iter != NULL);
+    while ((ret = tar_iter_next(iter, &entry)) == 1 && i < sizeof(test_tree) / sizeof(test_tree[0])) {
+        const struct test_member *member = &test_tree[i++];
+        size_t size = member->typeflag == SYMTYPE || member->data == NULL ? 0 : strlen(member->data);
+        char data[64];
+
+        CHECK(entry.name_len == strlen(member->path) && memcmp(entry.name, member->path, entry.name_len) == 0);
+        CHECK(entry.typeflag == member->typeflag && entry.size == size && entry.header->typeflag == entry.typeflag);
+        CHECK(size == 0 ||
+              (pread(fd, data, size, entry.data_offset) == (ssize_t)size && memcmp(data, member->data, size) == 0));
+    }
+    CHECK(ret == 0 && i == sizeof(test_tree) / sizeof(test_tree[0]));
+    CHECK(tar_iter_next(iter, &entry) == 0);
+    tar_iter_close(iter);
+    close(fd);
+
+    fd = test_archive("empty.tar", NULL, 0);
+    iter = tar_iter_open(fd);
+    CHECK(iter != NULL && tar_iter_next(iter, &entry) == 0);
+    tar_iter_close(iter);
+    close(fd);
+
+    iter = tar_iter_open(-1);
+    CHECK(iter == NULL || tar_iter_next(iter, &entry) == -1);
+    tar_iter_close(iter);
+    tar_iter_close(NULL);
+}
+
+static const struct test_member test_links[] = {
+    {"d/", DIRTYPE, NULL},
+    {"d/f", REGTYPE, "target data"},
+    {"d/sub/", DIRTYPE, NULL},
+    {"d/sub/g", REGTYPE, "g"},
+    {"rel", SYMTYPE, "d/f"},
+    {"abs", SYMTYPE, "/d/f"},
+    {"d/up", SYMTYPE, "../d/./f"},
+    {"above", SYMTYPE, "../../d/f"},
+    {"chain", SYMTYPE, "rel"},
+    {"hard", LNKTYPE, "d/f"},
+    {"hard_to_link", LNKTYPE, "chain"},
+    {"dirlink", SYMTYPE, "d/sub"},
+    {"d/sublink", SYMTYPE, "sub/"},
+    {"dang", SYMTYPE, "nothing"},
+    {"loop1", SYMTYPE, "loop2"},
+    {"loop2", SYMTYPE, "loop1"},
+    {"self", SYMTYPE, "self"},
+    {"early", SYMTYPE, "late"},
+    {"late", REGTYPE, "defined after its link"},
+};
+
+/* Reads a whole file through read_file() and compares it with the expected content. */
+static int test_read(int fd, const char *path, const char *expected) {
+    uint8_t buf[256];
+    size_t len = sizeof(buf);
+
+    return read_file(fd, (char *)path, 0, buf, &len) == 0 && len == strlen(expected) &&
+           memcmp(buf, expected, len) == 0;
+}
+
+static void test_link_resolution(void) {
+    static const char *const resolved[] = {"rel", "abs", "d/up", "above", "chain", "hard", "hard_to_link"};
+    static const char *const unresolved[] = {"dang", "loop1", "loop2", "self", "dirlink", "d/"};
+    static const char *const sub[] = {"d/sub/g"};
+    int fd = TEST_ARCHIVE("links.tar", test_links);
+    tar_index_t *index = tar_index_build(fd);
+    tar_mmap_t *archive = tar_open_mmap(test_path("links.tar"));
+    char **entries = test_entries();
+    const uint8_t *view;
+    size_t n, len;
+
+    CHECK(index != NULL && archive != NULL);
+    for (size_t i = 0; i < sizeof(resolved) / sizeof(resolved[0]); i++) {
+        CHECK(test_read(fd, resolved[i], "target data") && test_read_index(index, resolved[i], "target data"));
+        len = SIZE_MAX;
+        CHECK(read_file_view(archive, resolved[i], 0, &view, &len) == 0 && len == 11);
+    }
+    // A dangling link, a loop or a link to a directory is not a file.
+    for (size_t i = 0; i < sizeof(unresolved) / sizeof(unresolved[0]); i++) {
+        uint8_t buf[16];
+
+        len = sizeof(buf);
+        CHECK(read_file(fd, (char *)unresolved[i], 0, buf, &len) == -1);
+        len = sizeof(buf);
+        CHECK(read_file_index(index, unresolved[i], 0, buf, &len) == -1);
+        len = SIZE_MAX;
+        CHECK(read_file_view(archive, unresolved[i], 0, &view, &len) == -1);
+    }
+    // A link to a member later in the archive is resolved too.
+    CHECK(test_read(fd, "early", "defined after its link"));
+    CHECK(test_read_index(index, "early", "defined after its link"));
+
+    // The predicates describe the link itself.
+    CHECK(is_symlink(fd, "rel") && !is_file(fd, "rel") && !is_symlink(fd, "hard") && !is_dir(fd, "dirlink"));
+    CHECK(is_symlink_index(index, "rel") && !is_file_index(index, "rel") && !is_dir_index(index, "dirlink"));
+
+    // Listing a link to a directory lists the directory.
+    n = 16;
+    CHECK(list(fd, "dirlink", entries, &n) && test_listed(entries, n, sub, 1));
+    n = 16;
+    CHECK(list(fd, "d/sublink", entries, &n) && test_listed(entries, n, sub, 1));
+    n = 16;
+    CHECK(list_index(index, "dirlink", entries, &n) && test_listed(entries, n, sub, 1));
+    n = 16;
+    CHECK(!list(fd, "rel", entries, &n) && !list(fd, "dang", entries, &n) && !list(fd, "loop1", entries, &n));
+    n = 16;
+    CHECK(!list_index(index, "rel", entries, &n) && !list_index(index, "loop1", entries, &n));
+    tar_close_mmap(archive);
+    tar_index_free(index);
+    close(fd);
+
+    // A chain of TAR_MAX_LINK_DEPTH links is followed, one more is taken for a loop.
+    static char paths[TAR_MAX_LINK_DEPTH + 1][8], targets[TAR_MAX_LINK_DEPTH + 1][8];
+    struct test_member chain[TAR_MAX_LINK_DEPTH + 2];
+    for (int i = 0; i <= TAR_MAX_LINK_DEPTH; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "c%d", i);
+        snprintf(targets[i], sizeof(targets[i]), i < TAR_MAX_LINK_DEPTH ? "c%d" : "file", i + 1);
+        chain[i] = (struct test_member){paths[i], SYMTYPE, targets[i]};
     }
+    chain[TAR_MAX_LINK_DEPTH + 1] = (struct test_member){"file", REGTYPE, "end of the chain"};
+    fd = test_archive("chain.tar", chain, TAR_MAX_LINK_DEPTH + 2);
+    index = tar_index_build(fd);
+    CHECK(test_read(fd, "c1", "end of the chain") && test_read_index(index, "c1", "end of the chain"));
+    CHECK(!test_read(fd, "c0", "end of the chain") && !test_read_index(index, "c0", "end of the chain"));
+    tar_index_free(index);
+    close(fd);
+}
 
-    int ret = check_archive(fd);
-    printf("check_archive returned %d\n", ret);
+struct test_shared_fd {
+    int fd;
+    const tar_index_t *index;
+    int ok;
+};
 
+static void *test_shared_fd_reader(void *arg) {
+    struct test_shared_fd *shared = arg;
+
+    shared->ok = 1;
+    for (int i = 0; i < 200; i++) {
+        shared->ok &= test_read(shared->fd, i % 2 ? "dir/a" : "dir/c/d", i % 2 ? "hello" : "a nested file");
+        shared->ok &= test_read_index(shared->index, i % 2 ? "file" : "dir/a", i % 2 ? "a file at the root" : "hello");
+    }
+    return NULL;
+}
+
+static void test_pread(void) {
+    int fd = TEST_ARCHIVE("pread.tar", test_tree);
+    tar_index_t *index = tar_index_build(fd);
+    char **entries = test_entries();
+    size_t n = 16;
+    struct test_shared_fd shared[4];
+    pthread_t threads[4];
+    int ok = 1;
+
+    // The offset of the descriptor is neither used nor moved.
+    CHECK(lseek(fd, 1234, SEEK_SET) == 1234);
+    CHECK(check_archive(fd) == 8 && exists(fd, "dir/a") && is_dir(fd, "dir/") && list(fd, "dir/", entries, &n));
+    CHECK(test_read(fd, "dir/c/d", "a nested file") && test_read_index(index, "dir/c/d", "a nested file"));
+    tar_index_free(tar_index_build(fd));
+    CHECK(lseek(fd, 0, SEEK_CUR) == 1234);
+
+    // Threads share the descriptor without any locking.
+    for (int t = 0; t < 4; t++) {
+        shared[t] = (struct test_shared_fd){fd, index, 0};
+        CHECK(pthread_create(&threads[t], NULL, test_shared_fd_reader, &shared[t]) == 0);
+    }
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        ok &= shared[t].ok;
+    }
+    CHECK(ok && lseek(fd, 0, SEEK_CUR) == 1234);
+    tar_index_free(index);
+    close(fd);
+}
+
+/* What a batch delivered for each path. */
+struct test_batch {
+    char data[16][64];
+    size_t len[16];
+    int chunks[16];
+    int complete[16];
+    int stop_after;             /* the callback stops the batch on this call, zero for never */
+    int calls;
+};
+
+static int test_batch_cb(size_t i, uint64_t offset, const uint8_t *data, size_t len, uint64_t size, void *arg) {
+    struct test_batch *batch = arg;
+
+    if (++batch->calls == batch->stop_after) {
+        return 1;
+    }
+    if (len > 0 && offset + len <= sizeof(batch->data[i])) {
+        memcpy(batch->data[i] + offset, data, len);
+    }
+    batch->len[i] += len;
+    batch->chunks[i]++;
+    batch->complete[i] = offset + len == size;
     return 0;
-}
\ No newline at end of file
+}
+
+/* Checks that a path of a batch was delivered whole, with the expected content. */
+static int test_delivered(const struct test_batch *batch, size_t i, const char *expected) {
+    return batch->complete[i] && batch->len[i] == strlen(expected) &&
+           memcmp(batch->data[i], expected, batch->len[i]) == 0;
+}
+
+static void test_batch(void) {
+    static char *paths[] = {"chain", "missing", "d/f", "dang", "d/", "late", "early", "loop1", "hard_to_link", "d/f",
+                            "dirlink"};
+    const size_t n = sizeof(paths) / sizeof(paths[0]);
+    int fd = TEST_ARCHIVE("batch.tar", test_links);
+    tar_index_t *index = tar_index_build(fd);
+    static struct test_batch batch;
+
+    for (int pass = 0; pass < 2; pass++) {
+        memset(&batch, 0, sizeof(batch));
+        CHECK((pass == 0 ? read_files_batch(fd, paths, n, test_batch_cb, &batch) :
+                           read_files_batch_index(index, paths, n, test_batch_cb, &batch)) == 6);
+        // A path given twice is delivered twice, links are resolved, and the rest is not delivered.
+        CHECK(test_delivered(&batch, 0, "target data") && test_delivered(&batch, 2, "target data"));
+        CHECK(test_delivered(&batch, 9, "target data") && test_delivered(&batch, 8, "target data"));
+        CHECK(test_delivered(&batch, 5, "defined after its link"));
+        CHECK(test_delivered(&batch, 6, "defined after its link"));
+        CHECK(batch.chunks[1] == 0 && batch.chunks[3] == 0 && batch.chunks[4] == 0 && batch.chunks[7] == 0);
+        CHECK(batch.chunks[10] == 0);
+
+        // A callback returning non-zero stops the batch.
+        memset(&batch, 0, sizeof(batch));
+        batch.stop_after = 2;
+        CHECK((pass == 0 ? read_files_batch(fd, paths, n, test_batch_cb, &batch) :
+                           read_files_batch_index(index, paths, n, test_batch_cb, &batch)) == -1);
+        CHECK(batch.calls == 2);
+
+        memset(&batch, 0, sizeof(batch));
+        CHECK((pass == 0 ? read_files_batch(fd, paths, 0, test_batch_cb, &batch) :
+                           read_files_batch_index(index, paths, 0, test_batch_cb, &batch)) == 0);
+        CHECK(batch.calls == 0);
+    }
+    tar_index_free(index);
+    close(fd);
+
+    // An empty file is a single empty chunk.
+    static char *empty[] = {"dir/b", "dir/a"};
+    fd = TEST_ARCHIVE("batch_empty.tar", test_tree);
+    memset(&batch, 0, sizeof(batch));
+    CHECK(read_files_batch(fd, empty, 2, test_batch_cb, &batch) == 2);
+    CHECK(batch.chunks[0] == 1 && batch.complete[0] && batch.len[0] == 0 && test_delivered(&batch, 1, "hello"));
+    close(fd);
+}
+
+static void test_stream(void) {
+    int fd = TEST_ARCHIVE("stream.tar", test_links);
+    tar_index_t *index = tar_index_build(fd);
+    uint8_t buf[64];
+    size_t len;
+
+    for (int pass = 0; pass < 2; pass++) {
+        tar_file_stream_t *stream = pass == 0 ? tar_stream_open(fd, "chain") : tar_stream_open_index(index, "chain");
+
+        CHECK(stream != NULL && tar_stream_size(stream) == 11 && tar_stream_tell(stream) == 0);
+        len = 4;
+        CHECK(tar_stream_read(stream, buf, &len) == 7 && len == 4 && memcmp(buf, "targ", 4) == 0);
+        CHECK(tar_stream_tell(stream) == 4);
+        len = sizeof(buf);
+        CHECK(tar_stream_read(stream, buf, &len) == 0 && len == 7 && memcmp(buf, "et data", 7) == 0);
+        len = sizeof(buf);
+        CHECK(tar_stream_read(stream, buf, &len) == -2);
+
+        // Seeking back and to the end is allowed, past the end leaves the position unchanged.
+        CHECK(tar_stream_seek(stream, 7) == 0 && tar_stream_tell(stream) == 7);
+        len = sizeof(buf);
+        CHECK(tar_stream_read(stream, buf, &len) == 0 && len == 4 && memcmp(buf, "data", 4) == 0);
+        CHECK(tar_stream_seek(stream, 11) == 0 && tar_stream_tell(stream) == 11);
+        CHECK(tar_stream_seek(stream, 12) == -2 && tar_stream_tell(stream) == 11);
+        tar_stream_close(stream);
+
+        // Missing paths, directories and dangling links are not files.
+        static const char *missing[] = {"missing", "d/", "d", "dang", "loop1", "dirlink"};
+        for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+            errno = 0;
+            stream = pass == 0 ? tar_stream_open(fd, missing[i]) : tar_stream_open_index(index, missing[i]);
+            CHECK(stream == NULL && errno == ENOENT);
+        }
+    }
+    tar_stream_close(NULL);
+    tar_index_free(index);
+    close(fd);
+
+    // An empty file is at its end from the start.
+    fd = TEST_ARCHIVE("stream_empty.tar", test_tree);
+    tar_file_stream_t *stream = tar_stream_open(fd, "dir/b");
+    len = sizeof(buf);
+    CHECK(stream != NULL && tar_stream_size(stream) == 0 && tar_stream_read(stream, buf, &len) == -2);
+    CHECK(tar_stream_seek(stream, 0) == 0 && tar_stream_seek(stream, 1) == -2);
+    tar_stream_close(stream);
+    close(fd);
+}
+
+/* The result of an asynchronous read. */
+struct test_async {
+    uint8_t buf[8];
+    ssize_t ret;
+    size_t len;
+    int calls;
+};
+
+static void test_async_cb(ssize_t ret, size_t len, void *arg) {
+    struct test_async *request = arg;
+
+    request->ret = ret;
+    request->len = len;
+    request->calls++;
+}
+
+static void test_async(void) {
+    static const char *paths[] = {"d/f", "chain", "hard_to_link", "late"};
+    const size_t n = sizeof(paths) / sizeof(paths[0]);
+    struct test_async requests[sizeof(paths) / sizeof(paths[0])];
+    int fd = TEST_ARCHIVE("async.tar", test_links);
+    tar_index_t *index = tar_index_build(fd);
+    tar_async_t *async = tar_async_create(2);
+    uint8_t buf[8];
+    int run = 0;
+
+    CHECK(async != NULL);
+    memset(requests, 0, sizeof(requests));
+    // More requests than the depth: the engine makes room by running callbacks itself.
+    for (size_t i = 0; i < n; i++) {
+        CHECK(tar_async_read(async, index, paths[i], 2, requests[i].buf, sizeof(requests[i].buf), test_async_cb,
+                             &requests[i]) == 0);
+    }
+    CHECK(tar_async_submit(async) >= 0);
+    for (size_t i = 0; i < n; i++) {
+        run += requests[i].calls;
+    }
+    int ret = tar_async_wait(async, n);
+    CHECK(ret >= 0 && run + ret == (int)n);
+    for (size_t i = 0; i < 3; i++) {
+        CHECK(requests[i].calls == 1 && requests[i].ret == 1 && requests[i].len == 8);
+        CHECK(memcmp(requests[i].buf, "rget dat", 8) == 0);
+    }
+    CHECK(requests[3].calls == 1 && requests[3].ret == 12 && memcmp(requests[3].buf, "fined af", 8) == 0);
+
+    // Requests that cannot be served are refused when queued.
+    CHECK(tar_async_read(async, index, "missing", 0, buf, sizeof(buf), test_async_cb, NULL) == -1);
+    CHECK(tar_async_read(async, index, "d/", 0, buf, sizeof(buf), test_async_cb, NULL) == -1);
+    CHECK(tar_async_read(async, index, "dang", 0, buf, sizeof(buf), test_async_cb, NULL) == -1);
+    CHECK(tar_async_read(async, index, "d/f", 11, buf, sizeof(buf), test_async_cb, NULL) == -2);
+    CHECK(tar_async_read(async, index, "d/sub/g", 2, buf, sizeof(buf), test_async_cb, NULL) == -2);
+    CHECK(tar_async_submit(async) == 0 && tar_async_wait(async, 1) == 0);
+
+    // Destroying the engine runs the callbacks of the requests still pending.
+    memset(requests, 0, sizeof(requests));
+    CHECK(tar_async_read(async, index, "d/f", 0, requests[0].buf, 4, test_async_cb, &requests[0]) == 0);
+    tar_async_destroy(async);
+    CHECK(requests[0].calls == 1 && requests[0].ret == 7 && memcmp(requests[0].buf, "targ", 4) == 0);
+    tar_async_destroy(NULL);
+    tar_index_free(index);
+    close(fd);
+}
+
+/* Counts the files of a directory of the temporary directory. */
+static int test_count_files(const char *name) {
+    DIR *dir = opendir(test_path(name));
+    struct dirent *entry;
+    int count = 0;
+
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        count += entry->d_name[0] != '.';
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    return count;
+}
+
+/* Saves an index at the same path over and over, counting the saves which fail. */
+struct test_saver {
+    const tar_index_t *index;
+    const char *path;
+    int failed;
+};
+
+static void *test_saver_run(void *arg) {
+    struct test_saver *saver = arg;
+
+    for (int i = 0; i < 50; i++) {
+        saver->failed += tar_index_save(saver->index, saver->path) != 0;
+    }
+    return NULL;
+}
+
+static void test_sidecar(void) {
+    int fd = TEST_ARCHIVE("sidecar.tar", test_links);
+    tar_index_t *index = tar_index_build(fd);
+    char sidecar[PATH_MAX];
+    char **entries = test_entries();
+    size_t n = 16;
+
+    snprintf(sidecar, sizeof(sidecar), "%s", test_path("sidecar.tar.idx"));
+    CHECK(tar_index_save(index, sidecar) == 0);
+    tar_index_free(index);
+    index = tar_index_load(fd, sidecar);
+    CHECK(index != NULL);
+    // A loaded index answers as the index it was saved from, links resolved.
+    CHECK(test_read_index(index, "d/f", "target data") && test_read_index(index, "hard_to_link", "target data"));
+    CHECK(test_read_index(index, "early", "defined after its link"));
+    CHECK(is_dir_index(index, "d/sub/") && is_symlink_index(index, "dang") && !exists_index(index, "missing"));
+    static const char *const listed[] = {"d/f", "d/sub/", "d/sublink", "d/up"};
+    CHECK(list_index(index, "d/", entries, &n) && test_listed(entries, n, listed, 4));
+    static const char *const sub[] = {"d/sub/g"};
+    n = 16;
+    CHECK(list_index(index, "dirlink", entries, &n) && test_listed(entries, n, sub, 1));
+    // Saving a loaded index writes the same sidecar file.
+    CHECK(tar_index_save(index, test_path("sidecar.tar.idx2")) == 0);
+    tar_index_free(index);
+    index = tar_index_load(fd, test_path("sidecar.tar.idx2"));
+    CHECK(index != NULL && test_read_index(index, "chain", "target data"));
+    tar_index_free(index);
+
+    // The index of an empty archive has no names, and is loaded back all the same.
+    int empty_fd = test_archive("sidecar-empty.tar", NULL, 0);
+    index = tar_index_build(empty_fd);
+    CHECK(tar_index_save(index, test_path("sidecar-empty.tar.idx")) == 0);
+    tar_index_free(index);
+    index = tar_index_load(empty_fd, test_path("sidecar-empty.tar.idx"));
+    CHECK(index != NULL && !exists_index(index, "a") && !is_dir_index(index, ""));
+    tar_index_free(index);
+    close(empty_fd);
+
+    // Threads saving the same path each write a file of their own, so that the one renamed last is whole.
+    struct test_saver savers[4];
+    pthread_t threads[4];
+    struct stat saved;
+    char shared_path[PATH_MAX];
+    snprintf(shared_path, sizeof(shared_path), "%s", test_path("sidecars/shared.idx"));
+    CHECK(mkdir(test_path("sidecars"), 0755) == 0);
+    index = tar_index_build(fd);
+    for (int t = 0; t < 4; t++) {
+        savers[t] = (struct test_saver){index, shared_path, 0};
+        CHECK(pthread_create(&threads[t], NULL, test_saver_run, &savers[t]) == 0);
+    }
+    for (int t = 0; t < 4; t++) {
+        CHECK(pthread_join(threads[t], NULL) == 0 && savers[t].failed == 0);
+    }
+    tar_index_free(index);
+    index = tar_index_load(fd, shared_path);
+    CHECK(index != NULL && test_read_index(index, "chain", "target data") && test_count_files("sidecars") == 1);
+    CHECK(stat(shared_path, &saved) == 0 && (saved.st_mode & 0777) == 0644);
+    tar_index_free(index);
+
+    // The archive changing, in size or in modification time, makes the sidecar file stale.
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0 && ftruncate(fd, st.st_size + TAR_HEADER_SIZE) == 0);
+    errno = 0;
+    CHECK(tar_index_load(fd, sidecar) == NULL && errno == ESTALE);
+    CHECK(ftruncate(fd, st.st_size) == 0);
+    struct timespec times[2] = {{0, UTIME_OMIT}, {st.st_mtim.tv_sec - 10, 0}};
+    CHECK(futimens(fd, times) == 0);
+    errno = 0;
+    CHECK(tar_index_load(fd, sidecar) == NULL && errno == ESTALE);
+
+    // Files which are not sidecar files are refused.
+    errno = 0;
+    CHECK(tar_index_load(fd, test_path("sidecar.tar")) == NULL && errno == EINVAL);
+    int empty = open(test_path("sidecar.empty"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    close(empty);
+    errno = 0;
+    CHECK(tar_index_load(fd, test_path("sidecar.empty")) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(tar_index_load(fd, test_path("sidecar.missing")) == NULL && errno == ENOENT);
+
+    index = tar_index_build(fd);
+    errno = 0;
+    CHECK(tar_index_save(index, test_path("missing/sidecar.tar.idx")) == -1 && errno == ENOENT);
+    tar_index_free(index);
+    close(fd);
+}
+
+/* Appends members where the end-of-archive marker of an archive is, as "tar -r" does, and returns their offset. */
+static off_t test_append_end(int fd, const struct test_member *members, size_t count) {
+    off_t offset = lseek(fd, -2 * TAR_HEADER_SIZE, SEEK_END);
+
+    test_append(fd, members, count);
+    return offset;
+}
+
+static void test_update(void) {
+    static const struct test_member appended[] = {
+        {"nothing", REGTYPE, "a target at last"},
+        {"d/f", REGTYPE, "replaced"},
+        {"d/new", REGTYPE, "new"},
+    };
+    static const struct test_member bad[] = {{"bad", REGTYPE, "bad"}};
+    int fd = TEST_ARCHIVE("update.tar", test_links);
+    tar_index_t *index = tar_index_build(fd);
+    char **entries = test_entries();
+    size_t n = 16;
+
+    CHECK(tar_index_update(index) == 0);
+    test_append_end(fd, appended, 3);
+    CHECK(tar_index_update(index) == 3);
+    // The appended members shadow the previous ones, including as targets of links.
+    CHECK(test_read_index(index, "d/f", "replaced") && test_read_index(index, "chain", "replaced"));
+    CHECK(test_read_index(index, "hard_to_link", "replaced") && test_read_index(index, "dang", "a target at last"));
+    CHECK(test_read_index(index, "d/new", "new") && test_read_index(index, "late", "defined after its link"));
+    static const char *const listed[] = {"d/f", "d/new", "d/sub/", "d/sublink", "d/up"};
+    CHECK(list_index(index, "d/", entries, &n) && test_listed(entries, n, listed, 5));
+    CHECK(tar_index_update(index) == 0);
+
+    // A link shadowed in the middle of a chain changes the chain, as does a file added where a directory was found.
+    static const struct test_member relinked[] = {{"rel", SYMTYPE, "d/new"}};
+    static const struct test_member sub_file[] = {{"d/sub", REGTYPE, "now a file"}};
+    test_append_end(fd, relinked, 1);
+    CHECK(tar_index_update(index) == 1);
+    CHECK(test_read_index(index, "chain", "new") && test_read_index(index, "hard_to_link", "new"));
+    CHECK(test_read_index(index, "hard", "replaced") && test_read_index(index, "rel", "new"));
+    test_append_end(fd, sub_file, 1);
+    CHECK(tar_index_update(index) == 1);
+    CHECK(test_read_index(index, "dirlink", "now a file") && !is_dir_index(index, "dirlink"));
+    CHECK(test_read_index(index, "chain", "new") && test_read_index(index, "dang", "a target at last"));
+
+    // A bad appended header leaves the index as it was.
+    static const struct {
+        off_t field;
+        char byte;
+        int ret;
+    } patches[] = {{148, '9', -3}, {257, 'x', -1}, {263, 'x', -2}};
+    for (size_t i = 0; i < sizeof(patches) / sizeof(patches[0]); i++) {
+        off_t offset = test_append_end(fd, bad, 1);
+
+        test_patch(fd, offset + patches[i].field, &patches[i].byte, 1);
+        CHECK(tar_index_update(index) == patches[i].ret);
+        CHECK(!exists_index(index, "bad") && test_read_index(index, "chain", "new"));
+        // Take the bad member out again.
+        CHECK(ftruncate(fd, offset) == 0 && lseek(fd, offset, SEEK_SET) == offset);
+        test_append(fd, NULL, 0);
+    }
+    CHECK(tar_index_update(index) == 0);
+
+    // A shrunk archive is not an append.
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0 && ftruncate(fd, st.st_size - 3 * TAR_HEADER_SIZE) == 0);
+    errno = 0;
+    CHECK(tar_index_update(index) == -4 && errno == ESTALE);
+    CHECK(exists_index(index, "d/new") && test_read_index(index, "d/f", "replaced"));
+    CHECK(ftruncate(fd, st.st_size) == 0);
+    tar_index_free(index);
+    close(fd);
+
+    // A loaded index is updated as a built one.
+    fd = TEST_ARCHIVE("update_loaded.tar", test_links);
+    index = tar_index_build(fd);
+    CHECK(tar_index_save(index, test_path("update_loaded.tar.idx")) == 0);
+    tar_index_free(index);
+    index = tar_index_load(fd, test_path("update_loaded.tar.idx"));
+    test_append_end(fd, appended, 3);
+    CHECK(index != NULL && tar_index_update(index) == 3);
+    CHECK(test_read_index(index, "chain", "replaced") && test_read_index(index, "dang", "a target at last"));
+    CHECK(test_read_index(index, "d/sub/g", "g"));
+    tar_index_free(index);
+    close(fd);
+}
+
+static void test_field(void) {
+    static const struct {
+        const char *field;
+        size_t width;
+        uint64_t value;
+    } fields[] = {
+        {"0000644\0", 8, 0644},
+        {"0000644 ", 8, 0644},
+        {"   644 \0", 8, 0644},
+        {"644", 3, 0644},
+        {"00000000013\0", 12, 013},
+        {"777777777777", 12, 0777777777777},               // The whole width, without a terminator.
+        {"77777777777\0", 12, 077777777777},
+        {"1234567012345670", 16, 01234567012345670},
+        {"12345670123456701", 16, 01234567012345670},     // Capped to 16 bytes.
+        {"\0\0\0\0\0\0\0\0", 8, 0},
+        {"        ", 8, 0},
+        {"", 0, 0},
+        {"12x4", 4, 012},                                  // The digits end at the first byte which is not one.
+        {"\x80\0\0\0\0\0\0\x02\0\0\0\0", 12, 0x200000000},  // 8 GiB.
+        {"\x80\0\0\0\x04\x05\x06\x07\x08\x09\x0a\x0b", 12, 0x0405060708090a0b},
+        {"\x80\0\0\0\xff\xff\xff\xff\xff\xff\xff\xff", 12, UINT64_MAX},
+        {"\x80\0\0\x01\0\0\0\0\0\0\0\0", 12, UINT64_MAX},    // Does not fit in 64 bits.
+        {"\xbf\xff\xff\xff\xff\xff\xff\xff", 8, UINT64_MAX >> 2},
+        {"\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", 12, 0},  // Negative.
+    };
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        CHECK(tar_field_to_u64(fields[i].field, fields[i].width) == fields[i].value);
+    }
+
+    // A base-256 size is the size of the member.
+    tar_header_t header;
+    test_header(&header, "big", REGTYPE, NULL, 0);
+    memcpy(header.size, "\x80\0\0\0\0\0\0\x02\0\0\0\x01", sizeof(header.size));
+    CHECK(TAR_FIELD(header.size) == 0x200000001);
+}
+
+/* The shapes of archives the benchmarks generate, at a scale the tests can afford. */
+static void test_large(void) {
+    const uint64_t big = ((uint64_t)8 << 30) + 5;
+    const off_t end = TAR_HEADER_SIZE + (off_t)((big + TAR_HEADER_SIZE - 1) / TAR_HEADER_SIZE * TAR_HEADER_SIZE);
+    int fd = open(test_path("large.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_header_t header;
+    uint8_t buf[16];
+    size_t len = sizeof(buf);
+
+    // A member of more than 8 GiB, its size in base-256, the archive left sparse.
+    test_header(&header, "big", REGTYPE, NULL, 0);
+    memcpy(header.size, "\x80\0\0\0\0\0\0\x02\0\0\0\x05", sizeof(header.size));
+    test_chksum(&header);
+    test_patch(fd, 0, &header, sizeof(header));
+    test_patch(fd, TAR_HEADER_SIZE + (off_t)big - 5, "tail!", 5);
+    CHECK(lseek(fd, end, SEEK_SET) == end);
+    static const struct test_member after[] = {{"after", REGTYPE, "after"}};
+    test_append(fd, after, 1);
+    CHECK(check_archive(fd) == 2 && exists(fd, "after") && test_read(fd, "after", "after"));
+    CHECK(read_file(fd, "big", (size_t)big - 5, buf, &len) == 0 && len == 5 && memcmp(buf, "tail!", 5) == 0);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "big", (size_t)big, buf, &len) == -2);
+    tar_index_t *index = tar_index_build(fd);
+    len = sizeof(buf);
+    CHECK(read_file_index(index, "big", (size_t)big - 8, buf, &len) == 0 && len == 8);
+    CHECK(memcmp(buf, "\0\0\0tail!", 8) == 0 && test_read_index(index, "after", "after"));
+    tar_index_free(index);
+    close(fd);
+
+    // Many members, flat and in a deep tree.
+    static struct test_member members[4000];
+    static char paths[4000][64];
+    for (size_t i = 0; i < 4000; i++) {
+        if (i < 2000) {
+            snprintf(paths[i], sizeof(paths[i]), "flat/%zu", i);
+        } else {
+            size_t j = i - 2000;
+            snprintf(paths[i], sizeof(paths[i]), "deep/%zu/%zu/%zu/%zu", j / 1000, j / 100 % 10, j / 10 % 10, j);
+        }
+        members[i] = (struct test_member){paths[i], REGTYPE, i % 2 ? "odd" : ""};
+    }
+    members[0] = (struct test_member){"flat/", DIRTYPE, NULL};
+    fd = TEST_ARCHIVE("many.tar", members);
+    char **entries = test_entries();
+    size_t n = 16;
+    CHECK(check_archive(fd) == 4000);
+    CHECK(exists(fd, "flat/1999") && exists(fd, "deep/1/9/9/1999") && !exists(fd, "deep/1/9/9/2000"));
+    CHECK(test_read(fd, "deep/0/1/2/123", "odd"));
+    // Directories without members of their own are not listed.
+    CHECK(!list(fd, "deep/1/", entries, &n));
+    n = 16;
+    CHECK(list(fd, "flat/", entries, &n) && n == 16);
+    close(fd);
+}
+
+/* The calls traced, their paths copied. */
+struct test_trace {
+    enum tar_op ops[16];
+    char paths[16][32];
+    long rets[16];
+    size_t count;
+};
+
+static void test_trace_cb(const tar_trace_event_t *event, void *arg) {
+    struct test_trace *trace = arg;
+
+    if (trace->count < 16) {
+        trace->ops[trace->count] = event->op;
+        snprintf(trace->paths[trace->count], sizeof(trace->paths[0]), "%s", event->path ? event->path : "");
+        trace->rets[trace->count] = event->ret;
+    }
+    trace->count++;
+}
+
+static void test_stats(void) {
+    int fd = TEST_ARCHIVE("stats.tar", test_tree);
+    static struct test_trace trace;
+    tar_stats_t stats;
+    uint8_t buf[8];
+    size_t len = sizeof(buf);
+
+    CHECK(strcmp(tar_op_name(TAR_OP_CHECK_ARCHIVE), "check_archive") == 0);
+    CHECK(strcmp(tar_op_name(TAR_OP_READ_FILE_INDEX), "read_file_index") == 0);
+    CHECK(strcmp(tar_op_name(TAR_OP_INDEX_SAVE), "tar_index_save") == 0);
+    CHECK(strcmp(tar_op_name(TAR_OP_COUNT), "unknown") == 0 && strcmp(tar_op_name((enum tar_op)-1), "unknown") == 0);
+    int distinct = 1;
+    for (int i = 0; i < TAR_OP_COUNT; i++) {
+        for (int j = 0; j < i; j++) {
+            distinct &= strcmp(tar_op_name((enum tar_op)i), tar_op_name((enum tar_op)j)) != 0;
+        }
+    }
+    CHECK(distinct);
+
+    tar_stats_reset();
+    memset(&trace, 0, sizeof(trace));
+#ifdef TAR_STATS
+    CHECK(tar_set_trace(test_trace_cb, &trace) == 0);
+    CHECK(read_file(fd, "dir/a", 0, buf, &len) == 0 && !exists(fd, "missing"));
+    tar_index_t *index = tar_index_build(fd);
+    CHECK(exists_index(index, "dir/") && !exists_index(index, "missing"));
+    // Functions calling others are traced once.
+    CHECK(tar_index_save(index, test_path("stats.tar.idx")) == 0);
+    tar_index_free(index);
+    CHECK(tar_set_trace(NULL, NULL) == 0 && exists(fd, "file"));
+
+    CHECK(trace.count == 6);
+    CHECK(trace.ops[0] == TAR_OP_READ_FILE && strcmp(trace.paths[0], "dir/a") == 0 && trace.rets[0] == 0);
+    CHECK(trace.ops[1] == TAR_OP_EXISTS && strcmp(trace.paths[1], "missing") == 0 && trace.rets[1] == 0);
+    CHECK(trace.ops[2] == TAR_OP_INDEX_BUILD && strcmp(trace.paths[2], "") == 0 && trace.rets[2] == 1);
+    CHECK(trace.ops[3] == TAR_OP_EXISTS_INDEX && trace.ops[4] == TAR_OP_EXISTS_INDEX && trace.rets[4] == 0);
+    CHECK(trace.ops[5] == TAR_OP_INDEX_SAVE && trace.rets[5] == 0);
+
+    tar_stats_get(&stats);
+    CHECK(stats.calls[TAR_OP_EXISTS] == 2 && stats.calls[TAR_OP_READ_FILE] == 1 && stats.calls[TAR_OP_LIST] == 0);
+    CHECK(stats.calls[TAR_OP_INDEX_SAVE] == 1 && stats.calls[TAR_OP_INDEX_BUILD] == 1);
+    CHECK(stats.counters.index_hits == 1 && stats.counters.index_misses == 1);
+    CHECK(stats.counters.headers_scanned > 0 && stats.counters.bytes_read > 0 && stats.counters.syscalls > 0);
+    tar_stats_reset();
+    tar_stats_get(&stats);
+    CHECK(stats.calls[TAR_OP_EXISTS] == 0 && stats.counters.headers_scanned == 0);
+#else
+    // Without TAR_STATS, nothing is counted or traced.
+    errno = 0;
+    CHECK(tar_set_trace(test_trace_cb, &trace) == -1 && errno == ENOSYS);
+    CHECK(read_file(fd, "dir/a", 0, buf, &len) == 0 && trace.count == 0);
+    tar_stats_get(&stats);
+    CHECK(stats.calls[TAR_OP_READ_FILE] == 0 && stats.counters.headers_scanned == 0);
+#endif
+    close(fd);
+}
+
+/* Joins paths with spaces, to compare a listing with a single string. */
+static const char *test_join(const char *const *paths, size_t n) {
+    static char joined[4096];
+    size_t len = 0;
+
+    joined[0] = '\0';
+    for (size_t i = 0; i < n && len < sizeof(joined); i++) {
+        len += (size_t)snprintf(joined + len, sizeof(joined) - len, i == 0 ? "%s" : " %s", paths[i]);
+    }
+    return joined;
+}
+
+static void test_select(void) {
+    static const struct test_member members[] = {
+        {"z", REGTYPE, ""},
+        {"a/", DIRTYPE, NULL},
+        {"a/small", REGTYPE, "x"},
+        {"a/big", REGTYPE, "twenty bytes of data"},
+        {"a/sub/", DIRTYPE, NULL},
+        {"a/sub/mid", REGTYPE, "ten bytes!"},
+        {"ab", AREGTYPE, "five!"},
+        {"a/link", SYMTYPE, "small"},
+        {"a/hard", LNKTYPE, "a/small"},
+        {"a/fifo", '6', NULL},             // A fifo.
+    };
+    static const struct {
+        tar_filter_t filter;
+        const char *expected;
+    } selects[] = {
+        {{0}, "a/ a/big a/fifo a/hard a/link a/small a/sub/ a/sub/mid ab z"},
+        {{.types = TAR_TYPE_FILE}, "a/big a/small a/sub/mid ab z"},
+        {{.types = TAR_TYPE_FILE, .min_size = 5}, "a/big a/sub/mid ab"},
+        {{.types = TAR_TYPE_FILE, .min_size = 5, .max_size = 10}, "a/sub/mid ab"},
+        {{.max_size = 1}, "a/ a/fifo a/hard a/link a/small a/sub/ z"},
+        {{.types = TAR_TYPE_DIR | TAR_TYPE_SYMLINK}, "a/ a/link a/sub/"},
+        {{.types = TAR_TYPE_HARDLINK}, "a/hard"},
+        {{.types = TAR_TYPE_OTHER}, "a/fifo"},
+        {{.prefix = "a/"}, "a/ a/big a/fifo a/hard a/link a/small a/sub/ a/sub/mid"},
+        {{.prefix = "a"}, "a/ a/big a/fifo a/hard a/link a/small a/sub/ a/sub/mid ab"},
+        {{.prefix = "a/sub"}, "a/sub/ a/sub/mid"},
+        {{.prefix = "a/sub/", .types = TAR_TYPE_FILE}, "a/sub/mid"},
+        {{.prefix = ""}, "a/ a/big a/fifo a/hard a/link a/small a/sub/ a/sub/mid ab z"},
+        {{.prefix = "q"}, ""},
+        {{.prefix = "zz"}, ""},
+        {{.min_mtime = 1700000001}, "a/big"},
+        {{.min_mtime = 1800000001}, ""},
+    };
+    int fd = TEST_ARCHIVE("select.tar", members);
+    tar_arena_t *arena = tar_arena_create(0);
+    char **entries = test_entries();
+    const char **selected;
+    tar_header_t header;
+    size_t n;
+
+    // a/big, after the headers of z and a/ and the header and data of a/small, is newer than the other members.
+    CHECK(pread(fd, &header, sizeof(header), 4 * TAR_HEADER_SIZE) == sizeof(header));
+    CHECK(strcmp(header.name, "a/big") == 0);
+    snprintf(header.mtime, sizeof(header.mtime), "%011o", 1800000000);
+    test_chksum(&header);
+    test_patch(fd, 4 * TAR_HEADER_SIZE, &header, sizeof(header));
+    tar_index_t *index = tar_index_build(fd);
+
+    for (size_t i = 0; i < sizeof(selects) / sizeof(selects[0]); i++) {
+        n = 16;
+        ssize_t count = tar_index_select(index, &selects[i].filter, entries, &n);
+        CHECK(count == (ssize_t)n && strcmp(test_join((const char *const *)entries, n), selects[i].expected) == 0);
+        CHECK(tar_index_select_arena(index, &selects[i].filter, arena, &selected) == count);
+        CHECK(strcmp(test_join(selected, (size_t)count), selects[i].expected) == 0);
+    }
+
+    // More matches than entries: the count is that of all matches, the first ones listed.
+    n = 3;
+    CHECK(tar_index_select(index, &selects[0].filter, entries, &n) == 10 && n == 3);
+    CHECK(strcmp(test_join((const char *const *)entries, n), "a/ a/big a/fifo") == 0);
+    n = 0;
+    CHECK(tar_index_select(index, &selects[1].filter, entries, &n) == 5 && n == 0);
+    tar_index_free(index);
+    tar_arena_destroy(arena);
+    close(fd);
+}
+
+/* Formats a pax record, "<length> <key>=<value>\n", its length counting its own digits. */
+static const char *test_pax(char *record, size_t size, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;
+    int digits = snprintf(NULL, 0, "%zu", len);
+
+    len += (size_t)digits;
+    len += (size_t)(snprintf(NULL, 0, "%zu", len) - digits);
+    snprintf(record, size, "%zu %s=%s\n", len, key, value);
+    return record;
+}
+
+static void test_long_paths(void) {
+    char dir[128], ustar[256], pax[512], gnu[512];
+    char pax_record[400], link_record[200], size_record[16], other_record[64], malformed[128];
+
+    // A path of 144 bytes, which fits in the prefix and name fields, and longer ones, which need extra headers.
+    memset(dir, 'd', 119);
+    dir[60] = '/';
+    snprintf(dir + 119, sizeof(dir) - 119, "/");
+    snprintf(ustar, sizeof(ustar), "%s%s", dir, "a file with a ustar path");
+    snprintf(pax, sizeof(pax), "%s%0186d", dir, 1);
+    snprintf(gnu, sizeof(gnu), "%s%0134d", dir, 2);
+    snprintf(malformed, sizeof(malformed), "99 path=ignored\n%s",
+             test_pax(other_record, sizeof(other_record), "path", "not malformed"));
+
+    const struct test_member members[] = {
+        {dir, DIRTYPE, NULL},
+        {ustar, REGTYPE, "ustar"},
+        {"PaxHeaders/1", XHDTYPE, test_pax(pax_record, sizeof(pax_record), "path", pax)},
+        {"pax short name", REGTYPE, "pax"},
+        {"PaxHeaders/2", XHDTYPE, test_pax(link_record, sizeof(link_record), "linkpath", ustar)},
+        {"paxlink", SYMTYPE, "short target"},
+        {"././@LongLink", GNUTYPE_LONGNAME, gnu},
+        {"gnu short name", REGTYPE, "gnu"},
+        {"././@LongLink", GNUTYPE_LONGLINK, gnu},
+        {"gnulink", LNKTYPE, "short target"},
+        {"GlobalHead", XGLTYPE, "20 path=global/path\n"},
+        {"after global", REGTYPE, "global"},
+        {"PaxHeaders/3", XHDTYPE, test_pax(size_record, sizeof(size_record), "size", "3")},
+        {"sized", REGTYPE, "abc"},
+        {"PaxHeaders/4", XHDTYPE, malformed},
+        {"malformed", REGTYPE, "malformed"},
+    };
+    int fd = test_archive("long_paths.tar", members, sizeof(members) / sizeof(members[0]));
+    char **entries = test_entries();
+    size_t n = 16;
+
+    CHECK(strlen(ustar) == 144 && strlen(pax) == 306 && strlen(gnu) == 254);
+    CHECK(atoi(pax_record) == (int)strlen(pax_record) && atoi(link_record) == (int)strlen(link_record));
+    CHECK(atoi(size_record) == (int)strlen(size_record) && atoi(other_record) == (int)strlen(other_record));
+    CHECK(check_archive(fd) == 16);
+
+    // The "sized" member has 3 bytes of data, whatever the size its header gives.
+    tar_header_t header;
+    off_t offset = 0;
+    do {
+        CHECK(pread(fd, &header, sizeof(header), offset) == sizeof(header));
+        offset += TAR_HEADER_SIZE + (off_t)(TAR_FIELD(header.size) + TAR_HEADER_SIZE - 1) / TAR_HEADER_SIZE *
+                                        TAR_HEADER_SIZE;
+    } while (strcmp(header.name, "sized") != 0 && header.name[0] != '\0');
+    snprintf(header.size, sizeof(header.size), "%011o", 7);
+    test_chksum(&header);
+    test_patch(fd, offset - 2 * TAR_HEADER_SIZE, &header, sizeof(header));
+
+    tar_index_t *index = tar_index_build(fd);
+    for (int pass = 0; pass < 2; pass++) {
+        // The same answers from a scan and from the index.
+#define TEST_EITHER(scan, indexed) (pass == 0 ? (scan) : (indexed))
+        CHECK(TEST_EITHER(is_file(fd, ustar), is_file_index(index, ustar)));
+        CHECK(TEST_EITHER(test_read(fd, ustar, "ustar"), test_read_index(index, ustar, "ustar")));
+        CHECK(TEST_EITHER(is_file(fd, pax), is_file_index(index, pax)));
+        CHECK(TEST_EITHER(test_read(fd, pax, "pax"), test_read_index(index, pax, "pax")));
+        CHECK(TEST_EITHER(is_file(fd, gnu), is_file_index(index, gnu)));
+        CHECK(TEST_EITHER(test_read(fd, gnu, "gnu"), test_read_index(index, gnu, "gnu")));
+        // Link targets come from extra headers too.
+        CHECK(TEST_EITHER(is_symlink(fd, "paxlink"), is_symlink_index(index, "paxlink")));
+        CHECK(TEST_EITHER(test_read(fd, "paxlink", "ustar"), test_read_index(index, "paxlink", "ustar")));
+        CHECK(TEST_EITHER(test_read(fd, "gnulink", "gnu"), test_read_index(index, "gnulink", "gnu")));
+        // The names in the headers of members named by an extra header are not theirs, nor are extra headers members.
+        CHECK(!TEST_EITHER(exists(fd, "pax short name"), exists_index(index, "pax short name")));
+        CHECK(!TEST_EITHER(exists(fd, "gnu short name"), exists_index(index, "gnu short name")));
+        CHECK(!TEST_EITHER(exists(fd, "PaxHeaders/1"), exists_index(index, "PaxHeaders/1")));
+        CHECK(!TEST_EITHER(exists(fd, "././@LongLink"), exists_index(index, "././@LongLink")));
+        // A global header names no member, and a pax size overrides the size of the header.
+        CHECK(!TEST_EITHER(exists(fd, "global/path"), exists_index(index, "global/path")));
+        CHECK(TEST_EITHER(test_read(fd, "after global", "global"), test_read_index(index, "after global", "global")));
+        CHECK(TEST_EITHER(test_read(fd, "sized", "abc"), test_read_index(index, "sized", "abc")));
+        // The records after a malformed one are ignored.
+        CHECK(TEST_EITHER(test_read(fd, "malformed", "malformed"), test_read_index(index, "malformed", "malformed")));
+        CHECK(!TEST_EITHER(exists(fd, "not malformed"), exists_index(index, "not malformed")));
+#undef TEST_EITHER
+    }
+    const char *const listed[] = {ustar, pax, gnu};
+    CHECK(list(fd, dir, entries, &n) && test_listed(entries, n, listed, 3));
+    const char *const name_order[] = {pax, gnu, ustar};
+    n = 16;
+    CHECK(list_index(index, dir, entries, &n) && test_listed(entries, n, name_order, 3));
+    // A path too long for the ustar fields is matched by its whole length only.
+    CHECK(!exists(fd, gnu + 1) && !exists_index(index, gnu + 1));
+    pax[305] = '\0';
+    CHECK(!exists(fd, pax) && !exists_index(index, pax));
+    tar_index_free(index);
+    close(fd);
+}
+
+/* Compresses a file of the temporary directory with gzip, and returns a descriptor of the result. */
+static int test_gzip(const char *name, const char *gz_name) {
+    int in = open(test_path(name), O_RDONLY), out = open(test_path(gz_name), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    gzFile gz = gzdopen(dup(out), "wb6");
+    char buf[4096];
+    ssize_t len;
+
+    if (in == -1 || out == -1 || gz == NULL) {
+        perror("gzip");
+        exit(-1);
+    }
+    while ((len = read(in, buf, sizeof(buf))) > 0) {
+        if (gzwrite(gz, buf, (unsigned)len) != len) {
+            perror("gzwrite");
+            exit(-1);
+        }
+    }
+    gzclose(gz);
+    close(in);
+    return out;
+}
+
+static void test_compressed(void) {
+    static char data[64][3001];
+    static char paths[64][16];
+    static struct test_member members[64 + 4];
+    unsigned seed = 12345;
+
+    // Letters at random compress to about 60 %, so that small spans put checkpoints inside files.
+    for (size_t i = 0; i < 64; i++) {
+        size_t len = 1 + i * 2999 / 63;
+        for (size_t j = 0; j < len; j++) {
+            seed = seed * 1103515245 + 12345;
+            data[i][j] = (char)('a' + (seed >> 16) % 26);
+        }
+        data[i][len] = '\0';
+        snprintf(paths[i], sizeof(paths[i]), "dir/%02zu", i);
+        members[i + 1] = (struct test_member){paths[i], REGTYPE, data[i]};
+    }
+    members[0] = (struct test_member){"dir/", DIRTYPE, NULL};
+    members[65] = (struct test_member){"link", SYMTYPE, "dir/63"};
+    members[66] = (struct test_member){"empty", REGTYPE, ""};
+    members[67] = (struct test_member){"dir/00", REGTYPE, "redefined"};
+    int fd = TEST_ARCHIVE("compressed.tar", members), gz = test_gzip("compressed.tar", "compressed.tar.gz");
+    tar_index_t *plain = tar_index_build(fd);
+    uint8_t buf[4096], expected[4096];
+
+    for (int span = 0; span < 2; span++) {
+        tar_compressed_t *archive = tar_open_compressed(gz, span == 0 ? 0 : 4096);
+        const tar_index_t *index = tar_compressed_index(archive);
+        char **entries = test_entries();
+        size_t n = 16, len, expected_len;
+        int same = 1;
+
+        CHECK(archive != NULL && index != NULL);
+        CHECK(is_dir_index(index, "dir/") && is_file_index(index, "dir/63") && is_symlink_index(index, "link"));
+        CHECK(list_index(index, "dir/", entries, &n) && n == 16 && strcmp(entries[0], "dir/00") == 0);
+        // Reads in any order, whole and in the middle, give the data of the plain archive.
+        for (size_t k = 0; k < 3 * 64; k++) {
+            const char *path = paths[k * 37 % 64];
+            size_t offset = k % 3 == 0 ? 0 : k * 101 % (strlen(data[k * 37 % 64]) + 1);
+
+            len = k % 2 ? sizeof(buf) : 100;
+            expected_len = len;
+            ssize_t ret = read_file_compressed(archive, path, offset, buf, &len);
+            same &= ret == read_file_index(plain, path, offset, expected, &expected_len);
+            same &= ret < 0 || (len == expected_len && memcmp(buf, expected, len) == 0);
+        }
+        CHECK(same);
+        len = sizeof(buf);
+        CHECK(read_file_compressed(archive, "link", 2990, buf, &len) == 0 && len == 10);
+        CHECK(memcmp(buf, data[63] + 2990, len) == 0);
+        len = sizeof(buf);
+        CHECK(read_file_compressed(archive, "dir/00", 0, buf, &len) == 0 && len == 9);
+        CHECK(memcmp(buf, "redefined", 9) == 0);
+        len = sizeof(buf);
+        CHECK(read_file_compressed(archive, "dir/01", strlen(data[1]), buf, &len) == -2);
+        len = sizeof(buf);
+        CHECK(read_file_compressed(archive, "empty", 0, buf, &len) == -2);
+        len = sizeof(buf);
+        CHECK(read_file_compressed(archive, "missing", 0, buf, &len) == -1);
+        len = sizeof(buf);
+        CHECK(read_file_compressed(archive, "dir/", 0, buf, &len) == -1);
+        // The offsets of the index are in the decompressed archive.
+        len = sizeof(buf);
+        CHECK(read_file_index(index, "dir/01", 0, buf, &len) == -1);
+        tar_close_compressed(archive);
+    }
+    tar_close_compressed(NULL);
+    tar_index_free(plain);
+
+    // A plain archive is not compressed, and corrupt data is refused.
+    errno = 0;
+    CHECK(tar_open_compressed(fd, 0) == NULL && errno == ENOTSUP);
+    test_patch(gz, 4, "\x28\xb5\x2f\xfd", 4);
+    test_patch(gz, 0, "\x28\xb5\x2f\xfd", 4);
+#ifndef TAR_HAVE_ZSTD
+    errno = 0;
+    CHECK(tar_open_compressed(gz, 0) == NULL && errno == ENOTSUP);
+#endif
+    close(gz);
+    gz = test_gzip("compressed.tar", "compressed.tar.gz");
+    struct stat st;
+    CHECK(fstat(gz, &st) == 0);
+    test_patch(gz, st.st_size / 2, "garbage!", 8);
+    errno = 0;
+    CHECK(tar_open_compressed(gz, 0) == NULL && errno == EINVAL);
+    close(gz);
+    gz = test_gzip("compressed.tar", "compressed.tar.gz");
+    CHECK(ftruncate(gz, st.st_size / 2) == 0);
+    errno = 0;
+    CHECK(tar_open_compressed(gz, 0) == NULL && errno == EINVAL);
+    close(gz);
+    // So is an archive with a bad header, once decompressed.
+    test_patch(fd, 148, "9", 1);
+    gz = test_gzip("compressed.tar", "compressed.tar.gz");
+    errno = 0;
+    CHECK(tar_open_compressed(gz, 0) == NULL && errno == EINVAL);
+    close(gz);
+    close(fd);
+}
+
+/* Checks that a file extracted under a directory holds the expected content. */
+static int test_extracted(const char *dir, const char *path, const char *expected) {
+    char full[PATH_MAX], buf[256];
+    int fd;
+
+    snprintf(full, sizeof(full), "%s/%s", dir, path);
+    fd = open(full, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    return len == (ssize_t)strlen(expected) && memcmp(buf, expected, (size_t)len) == 0;
+}
+
+/* Stats a path extracted under a directory, without following symlinks. */
+static int test_lstat(const char *dir, const char *path, struct stat *st) {
+    char full[PATH_MAX];
+
+    snprintf(full, sizeof(full), "%s/%s", dir, path);
+    return lstat(full, st);
+}
+
+static void test_extract(void) {
+    static const struct test_member members[] = {
+        {"dir/", DIRTYPE, NULL},
+        {"dir/a", REGTYPE, "first a"},
+        {"dir/c/", DIRTYPE, NULL},
+        {"dir/c/d", REGTYPE, "a nested file"},
+        {"dir/link", SYMTYPE, "a"},
+        {"dir/hard", LNKTYPE, "dir/c/d"},
+        {"implicit/parent/file", REGTYPE, "in directories without members"},
+        {"dir/a", REGTYPE, "second a"},
+        {"empty", REGTYPE, ""},
+    };
+    const char *dest = test_path("extract");
+    struct stat st, other;
+    char full[PATH_MAX], target[16];
+    int fd = TEST_ARCHIVE("extract.tar", members);
+
+    CHECK(tar_extract_all(fd, dest, 4) == 0);
+    CHECK(test_extracted(dest, "dir/a", "second a") && test_extracted(dest, "dir/c/d", "a nested file"));
+    CHECK(test_extracted(dest, "implicit/parent/file", "in directories without members"));
+    CHECK(test_extracted(dest, "empty", "") && test_extracted(dest, "dir/hard", "a nested file"));
+    CHECK(test_lstat(dest, "dir/hard", &st) == 0 && test_lstat(dest, "dir/c/d", &other) == 0);
+    CHECK(st.st_ino == other.st_ino);
+    CHECK(test_lstat(dest, "dir/link", &st) == 0 && S_ISLNK(st.st_mode));
+    snprintf(full, sizeof(full), "%s/dir/link", dest);
+    CHECK(readlink(full, target, sizeof(target)) == 1 && target[0] == 'a');
+    // Modes and modification times are those of the headers, directories included.
+    CHECK(test_lstat(dest, "dir/a", &st) == 0 && (st.st_mode & 07777) == 0644 && st.st_mtime == 1700000000);
+    CHECK(test_lstat(dest, "dir/c", &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 07777) == 0755);
+    CHECK(st.st_mtime == 1700000000);
+    // Extracting again over the files written the first time gives the same tree.
+    CHECK(tar_extract_all(fd, dest, 1) == 0 && test_extracted(dest, "dir/a", "second a"));
+    close(fd);
+
+    // Members which are not extracted do not stop the others.
+    static const struct test_member unsafe[] = {
+        {"../escaped", REGTYPE, "outside"},
+        {"/absolute", REGTYPE, "outside"},
+        {"ok/../../escaped", REGTYPE, "outside"},
+        {"ok/file", REGTYPE, "inside"},
+    };
+    dest = test_path("unsafe");
+    fd = TEST_ARCHIVE("unsafe.tar", unsafe);
+    errno = 0;
+    CHECK(tar_extract_all(fd, dest, 2) == -1 && errno == EINVAL);
+    CHECK(test_extracted(dest, "ok/file", "inside") && access(test_path("escaped"), F_OK) == -1);
+    CHECK(access(test_path("absolute"), F_OK) == -1 && access("/absolute", F_OK) == -1);
+    close(fd);
+
+    static const struct test_member special[] = {
+        {"fifo", '6', NULL},
+        {"device", '3', NULL},
+        {"file", REGTYPE, "extracted"},
+    };
+    dest = test_path("special");
+    fd = TEST_ARCHIVE("special.tar", special);
+    errno = 0;
+    CHECK(tar_extract_all(fd, dest, 0) == -1 && errno == EOPNOTSUPP);
+    CHECK(test_extracted(dest, "file", "extracted") && test_lstat(dest, "fifo", &st) == -1);
+    CHECK(test_lstat(dest, "device", &st) == -1);
+    close(fd);
+
+    // Nothing is written through a symlink of the archive: the directories files are written into come first.
+    static const struct test_member through[] = {
+        {"up", SYMTYPE, ".."},
+        {"up/planted", REGTYPE, "outside"},
+        {"here", SYMTYPE, "."},
+        {"here/planted", REGTYPE, "inside"},
+    };
+    dest = test_path("through");
+    fd = TEST_ARCHIVE("through.tar", through);
+    errno = 0;
+    CHECK(tar_extract_all(fd, dest, 1) == -1 && errno == EEXIST);
+    CHECK(access(test_path("planted"), F_OK) == -1 && test_lstat(dest, "planted", &st) == -1);
+    CHECK(test_lstat(dest, "up", &st) == 0 && S_ISDIR(st.st_mode) && test_extracted(dest, "up/planted", "outside"));
+
+    // The destination is created, but not its parents.
+    errno = 0;
+    CHECK(tar_extract_all(fd, test_path("missing/dest"), 1) == -1 && errno == ENOENT);
+    close(fd);
+}
+
+/* Writes a file of the temporary directory, and returns a descriptor of it open for reading. */
+static int test_file(const char *name, const void *data, size_t len) {
+    int fd = open(test_path(name), O_RDWR | O_CREAT | O_TRUNC, 0640);
+
+    if (fd == -1 || write(fd, data, len) != (ssize_t)len) {
+        perror("write(file)");
+        exit(-1);
+    }
+    return fd;
+}
+
+static void test_writer(void) {
+    static uint8_t big[300 * 1024], buf[300 * 1024];
+    char ustar[160], pax[400], target[200];
+    int fd = open(test_path("written.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *writer = tar_writer_open(fd);
+    struct stat st;
+    size_t len;
+
+    for (size_t i = 0; i < sizeof(big); i++) {
+        big[i] = (uint8_t)(i * 7 + i / 1000);
+    }
+    memset(ustar, 'u', sizeof(ustar));
+    ustar[70] = '/';
+    ustar[150] = '\0';
+    memset(pax, 'p', sizeof(pax));
+    pax[99] = pax[199] = '/';
+    pax[300] = '\0';
+    memset(target, 't', sizeof(target));
+    target[150] = '\0';
+    int small = test_file("small", "small data", 10), large = test_file("large", big, sizeof(big));
+    int empty = test_file("empty", "", 0);
+
+    CHECK(writer != NULL);
+    CHECK(tar_writer_add_dir(writer, "w", 0750, 1600000000) == 0);
+    CHECK(tar_writer_add_dir(writer, "w/sub/", 0700, 0) == 0);
+    // The offset of a source file is not used.
+    CHECK(lseek(small, 3, SEEK_SET) == 3 && tar_writer_add_file(writer, "w/small", small) == 0);
+    CHECK(lseek(small, 0, SEEK_CUR) == 3);
+    CHECK(tar_writer_add_file(writer, "w/large", large) == 0 && tar_writer_add_file(writer, "w/empty", empty) == 0);
+    CHECK(tar_writer_add_file(writer, ustar, small) == 0 && tar_writer_add_file(writer, pax, small) == 0);
+    CHECK(tar_writer_add_symlink(writer, "w/link", "small", 1600000000) == 0);
+    CHECK(tar_writer_add_symlink(writer, "w/long_link", target, 0) == 0);
+    // A descriptor which is not of a regular file adds nothing.
+    int dir = open(test_path(""), O_RDONLY | O_DIRECTORY);
+    errno = 0;
+    CHECK(tar_writer_add_file(writer, "w/dir", dir) == -1 && errno == EINVAL);
+    close(dir);
+    CHECK(tar_writer_close(writer) == 0);
+
+    // Whole records are written, which check_archive() accepts, pax headers counted.
+    CHECK(fstat(fd, &st) == 0 && st.st_size % 10240 == 0);
+    CHECK(check_archive(fd) == 11);
+    CHECK(is_dir(fd, "w/") && is_dir(fd, "w/sub/") && !exists(fd, "w/dir"));
+    CHECK(test_read(fd, "w/small", "small data") && test_read(fd, ustar, "small data"));
+    CHECK(test_read(fd, pax, "small data"));
+    CHECK(test_read(fd, "w/link", "small data") && is_symlink(fd, "w/long_link"));
+    len = sizeof(buf);
+    CHECK(read_file(fd, "w/large", 0, buf, &len) == 0 && len == sizeof(big) && memcmp(buf, big, len) == 0);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "w/empty", 0, buf, &len) == -2 && is_file(fd, "w/empty"));
+    // The header of the directory holds its mode and time, the header of a file those of its source.
+    tar_header_t header;
+    CHECK(pread(fd, &header, sizeof(header), 0) == sizeof(header) && strcmp(header.name, "w/") == 0);
+    CHECK(TAR_FIELD(header.mode) == 0750 && TAR_FIELD(header.mtime) == 1600000000 && header.typeflag == DIRTYPE);
+    CHECK(pread(fd, &header, sizeof(header), 2 * TAR_HEADER_SIZE) == sizeof(header) && fstat(small, &st) == 0);
+    CHECK(strcmp(header.name, "w/small") == 0 && TAR_FIELD(header.mode) == 0640 && TAR_FIELD(header.size) == 10);
+    CHECK(TAR_FIELD(header.mtime) == (uint64_t)st.st_mtime);
+    close(fd);
+
+    // After a failure, every call fails.
+    fd = open(test_path("written.tar"), O_RDONLY);
+    writer = tar_writer_open(fd);
+    CHECK(tar_writer_add_dir(writer, "w", 0755, 0) == 0);
+    errno = 0;
+    CHECK(tar_writer_add_file(writer, "w/large", large) == -1 && errno == EBADF);
+    errno = 0;
+    CHECK(tar_writer_add_dir(writer, "v", 0755, 0) == -1 && errno == EBADF);
+    errno = 0;
+    CHECK(tar_writer_close(writer) == -1 && errno == EBADF);
+    close(fd);
+
+    fd = open(test_path("written_empty_path.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(fd);
+    errno = 0;
+    CHECK(tar_writer_add_symlink(writer, "", "target", 0) == -1 && errno == EINVAL);
+    CHECK(tar_writer_add_dir(writer, "v", 0755, 0) == -1 && tar_writer_close(writer) == -1);
+    close(fd);
+    close(small);
+    close(large);
+    close(empty);
+}
+
+static void test_arena(void) {
+    tar_arena_t *arena = tar_arena_create(1);
+    uint8_t *small[100], *large;
+    int aligned = 1, kept = 1;
+
+    // Allocations are aligned and apart, larger ones than a block included.
+    CHECK(arena != NULL);
+    for (int i = 0; i < 100; i++) {
+        small[i] = tar_arena_alloc(arena, (size_t)i % 7 + 1);
+        aligned &= small[i] != NULL && (uintptr_t)small[i] % 16 == 0;
+        memset(small[i], i, (size_t)i % 7 + 1);
+    }
+    large = tar_arena_alloc(arena, 100000);
+    CHECK(large != NULL && (uintptr_t)large % 16 == 0);
+    memset(large, 0xff, 100000);
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < i % 7 + 1; j++) {
+            kept &= small[i][j] == i;
+        }
+    }
+    CHECK(aligned && kept);
+
+    char *copy = tar_arena_strndup(arena, "a path and more", 6);
+    CHECK(copy != NULL && strcmp(copy, "a path") == 0);
+    copy = tar_arena_strndup(arena, "", 0);
+    CHECK(copy != NULL && copy[0] == '\0');
+    tar_arena_reset(arena);
+    copy = tar_arena_strndup(arena, "after a reset", 13);
+    CHECK(copy != NULL && strcmp(copy, "after a reset") == 0);
+    tar_arena_destroy(arena);
+    tar_arena_destroy(NULL);
+
+    // Listings into an arena have no limit on their number of entries.
+    static const char *const listed[] = {"dir/a", "dir/b", "dir/c/", "dir/e/", "dir/link"};
+    static const char *const nested[] = {"dir/c/d"};
+    int fd = TEST_ARCHIVE("arena.tar", test_tree);
+    tar_index_t *index = tar_index_build(fd);
+    char **entries;
+    const char **index_entries;
+
+    arena = tar_arena_create(0);
+    CHECK(list_arena(fd, "dir/", arena, &entries) == 5 && test_listed(entries, 5, listed, 5));
+    CHECK(list_index_arena(index, "dir/", arena, &index_entries) == 5);
+    CHECK(test_listed((char **)index_entries, 5, listed, 5));
+    CHECK(list_arena(fd, "dir/c/", arena, &entries) == 1 && test_listed(entries, 1, nested, 1));
+    CHECK(list_index_arena(index, "dir/c/", arena, &index_entries) == 1 && strcmp(index_entries[0], "dir/c/d") == 0);
+    CHECK(list_arena(fd, "dir/e/", arena, &entries) == 0);
+    CHECK(list_index_arena(index, "dir/e/", arena, &index_entries) == 0);
+    static const char *const missing[] = {"missing/", "dir", "dir/a", "file", ""};
+    for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+        errno = 0;
+        CHECK(list_arena(fd, missing[i], arena, &entries) == -1 && errno == ENOENT);
+        errno = 0;
+        CHECK(list_index_arena(index, missing[i], arena, &index_entries) == -1 && errno == ENOENT);
+    }
+    tar_index_free(index);
+    close(fd);
+
+    // Symlinks are resolved, as by list().
+    fd = TEST_ARCHIVE("arena_links.tar", test_links);
+    index = tar_index_build(fd);
+    CHECK(list_arena(fd, "dirlink", arena, &entries) == 1 && strcmp(entries[0], "d/sub/g") == 0);
+    CHECK(list_index_arena(index, "d/sublink", arena, &index_entries) == 1 && strcmp(index_entries[0], "d/sub/g") == 0);
+    tar_index_free(index);
+    close(fd);
+
+    static struct test_member members[1 + 2000];
+    static char paths[2000][16];
+    members[0] = (struct test_member){"many/", DIRTYPE, NULL};
+    for (size_t i = 0; i < 2000; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "many/%04zu", 1999 - i);
+        members[i + 1] = (struct test_member){paths[i], REGTYPE, ""};
+    }
+    fd = TEST_ARCHIVE("arena_many.tar", members);
+    index = tar_index_build(fd);
+    tar_arena_reset(arena);
+    CHECK(list_arena(fd, "many/", arena, &entries) == 2000);
+    CHECK(strcmp(entries[0], "many/1999") == 0 && strcmp(entries[1999], "many/0000") == 0);
+    CHECK(list_index_arena(index, "many/", arena, &index_entries) == 2000);
+    CHECK(strcmp(index_entries[0], "many/0000") == 0 && strcmp(index_entries[1999], "many/1999") == 0);
+    tar_index_free(index);
+    tar_arena_destroy(arena);
+    close(fd);
+}
+
+static int test_strcmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Checks that entries are the space-separated paths expected, in archive order, or in name order when sorted is set. */
+static int test_found(const char **entries, ssize_t n, const char *expected, int sorted) {
+    static char copy[1024];
+    const char *paths[32];
+    size_t count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", expected);
+    for (char *path = strtok(copy, " "); path != NULL && count < 32; path = strtok(NULL, " ")) {
+        paths[count++] = path;
+    }
+    if (sorted) {
+        qsort(paths, count, sizeof(paths[0]), test_strcmp);
+    }
+    return n == (ssize_t)count && strcmp(test_join(entries, (size_t)n), test_join(paths, count)) == 0;
+}
+
+static void test_query(void) {
+    static const struct test_member members[] = {
+        {"data/", DIRTYPE, NULL},
+        {"data/a.json", REGTYPE, "a"},
+        {"data/x/", DIRTYPE, NULL},
+        {"data/x/y/", DIRTYPE, NULL},
+        {"data/x/y/b.json", REGTYPE, "b"},
+        {"data/c.txt", REGTYPE, "c"},
+        {"data/[lit]", REGTYPE, "brackets"},
+        {"top.json", REGTYPE, "top"},
+        {"data/x/y/deep/", DIRTYPE, NULL},
+        {"other/", DIRTYPE, NULL},
+        {"other/a.json", REGTYPE, "other"},
+        {"q?", REGTYPE, "question"},
+        {"dl", SYMTYPE, "data/x"},
+    };
+    static const struct {
+        const char *pattern;
+        const char *expected;
+    } globs[] = {
+        {"**.json", "data/a.json data/x/y/b.json top.json other/a.json"},
+        {"*.json", "top.json"},
+        {"*", "data/ top.json other/ q? dl"},
+        {"*/", "data/ other/"},
+        {"data/*", "data/a.json data/x/ data/c.txt data/[lit]"},
+        {"data/*/", "data/x/"},
+        {"data/**/*.json", "data/a.json data/x/y/b.json"},
+        {"data/**/", "data/ data/x/ data/x/y/ data/x/y/deep/"},
+        {"**/", "data/ data/x/ data/x/y/ data/x/y/deep/ other/"},
+        {"data/?.txt", "data/c.txt"},
+        {"data/?", "data/x/"},                      // A directory is matched without its trailing '/'.
+        {"data/[a-c].*", "data/a.json data/c.txt"},
+        {"data/[!a]*", "data/x/ data/c.txt data/[lit]"},
+        {"data/\\[lit]", "data/[lit]"},
+        {"data/[[]lit]", "data/[lit]"},
+        {"q\\?", "q?"},
+        {"q?", "q?"},
+        {"?", ""},
+        {"top.json", "top.json"},
+        {"data", "data/"},
+        {"data/", "data/"},
+        {"nomatch*", ""},
+        {"dl/*", ""},
+    };
+    int fd = TEST_ARCHIVE("query.tar", members);
+    tar_index_t *index = tar_index_build(fd);
+    tar_arena_t *arena = tar_arena_create(0);
+    const char **entries;
+    char **scanned;
+
+    for (size_t i = 0; i < sizeof(globs) / sizeof(globs[0]); i++) {
+        ssize_t n = find(fd, globs[i].pattern, arena, &scanned);
+        CHECK(test_found((const char **)scanned, n, globs[i].expected, 0));
+        n = find_index(index, globs[i].pattern, arena, &entries);
+        CHECK(test_found(entries, n, globs[i].expected, 1));
+        tar_arena_reset(arena);
+    }
+
+    // Everything below the directory, at any depth; links to directories are resolved.
+    static const struct {
+        const char *path;
+        const char *expected;
+    } below[] = {
+        {"data/", "data/a.json data/x/ data/x/y/ data/x/y/b.json data/c.txt data/[lit] data/x/y/deep/"},
+        {"data/x/", "data/x/y/ data/x/y/b.json data/x/y/deep/"},
+        {"dl", "data/x/y/ data/x/y/b.json data/x/y/deep/"},
+        {"data/x/y/deep/", ""},
+    };
+    for (size_t i = 0; i < sizeof(below) / sizeof(below[0]); i++) {
+        ssize_t n = list_recursive(fd, below[i].path, arena, &scanned);
+        CHECK(test_found((const char **)scanned, n, below[i].expected, 0));
+        n = list_recursive_index(index, below[i].path, arena, &entries);
+        CHECK(test_found(entries, n, below[i].expected, 1));
+    }
+    static const char *const missing[] = {"missing/", "data", "top.json", "data/x/y/deep"};
+    for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+        errno = 0;
+        CHECK(list_recursive(fd, missing[i], arena, &scanned) == -1 && errno == ENOENT);
+        errno = 0;
+        CHECK(list_recursive_index(index, missing[i], arena, &entries) == -1 && errno == ENOENT);
+    }
+    tar_arena_destroy(arena);
+    tar_index_free(index);
+    close(fd);
+}
+
+/* Formats the path of the cache file of an archive, as tar_index_open_shared() names it. */
+static void test_shared_path(char *path, const char *dir, int fd, const char *suffix) {
+    struct stat st;
+
+    fstat(fd, &st);
+    snprintf(path, PATH_MAX, "%s/tar-index-%llx-%llx-%llx.%09ld%s", dir, (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino, (unsigned long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, suffix);
+}
+
+static void test_shared(void) {
+    char cache[PATH_MAX];
+    int fd = TEST_ARCHIVE("shared.tar", test_links);
+    tar_index_t *index;
+
+    snprintf(cache, sizeof(cache), "%s", test_path("shm"));
+    CHECK(mkdir(cache, 0755) == 0);
+    // The first process to open the archive publishes its index, the next ones map it.
+    index = tar_index_open_shared(fd, cache);
+    CHECK(index != NULL && test_read_index(index, "chain", "target data") && test_count_files("shm") == 2);
+    tar_index_free(index);
+    index = tar_index_open_shared(fd, cache);
+    CHECK(index != NULL && test_read_index(index, "early", "defined after its link") && test_count_files("shm") == 2);
+    tar_index_free(index);
+
+    // Processes opening an archive at once share a single index.
+    int other = TEST_ARCHIVE("shared_other.tar", test_tree), status, ok = 1;
+    pid_t children[4];
+    for (int i = 0; i < 4; i++) {
+        children[i] = fork();
+        if (children[i] == 0) {
+            index = tar_index_open_shared(other, cache);
+            _exit(index != NULL && test_read_index(index, "dir/c/d", "a nested file") ? 0 : 1);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        ok &= children[i] > 0 && waitpid(children[i], &status, 0) == children[i] && WIFEXITED(status) &&
+              WEXITSTATUS(status) == 0;
+    }
+    CHECK(ok && test_count_files("shm") == 4);
+    close(other);
+
+    // A changed archive gets an index of its own, the index of the previous version being left.
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1600000000, 0}};
+    CHECK(futimens(fd, times) == 0);
+    index = tar_index_open_shared(fd, cache);
+    CHECK(index != NULL && test_read_index(index, "d/f", "target data") && test_count_files("shm") == 6);
+    tar_index_free(index);
+
+    // Without a cache, the index is the process' own.
+    index = tar_index_open_shared(fd, test_path("missing"));
+    CHECK(index != NULL && test_read_index(index, "hard", "target data") && test_count_files("missing") == 0);
+    tar_index_free(index);
+
+    // A cache file which others can write, or a link, is not mapped but replaced.
+    char file[PATH_MAX], lock[PATH_MAX];
+    struct stat st, before;
+    int forged = TEST_ARCHIVE("shared_forged.tar", test_tree);
+    test_shared_path(file, cache, forged, "");
+    CHECK(symlink(test_path("shared.tar"), file) == 0);
+    index = tar_index_open_shared(forged, cache);
+    CHECK(index != NULL && test_read_index(index, "dir/a", "hello"));
+    CHECK(lstat(file, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0777) == 0600);
+    tar_index_free(index);
+    CHECK(chmod(file, 0666) == 0);
+    index = tar_index_open_shared(forged, cache);
+    CHECK(index != NULL && lstat(file, &before) == 0 && before.st_ino != st.st_ino && (before.st_mode & 0777) == 0600);
+    tar_index_free(index);
+    close(forged);
+
+    // A lock held for too long makes the index the process' own once the timeout is over.
+    int locked = TEST_ARCHIVE("shared_locked.tar", test_tree), lock_fd;
+    test_shared_path(file, cache, locked, "");
+    test_shared_path(lock, cache, locked, ".lock");
+    lock_fd = open(lock, O_RDWR | O_CREAT, 0600);
+    CHECK(lock_fd != -1 && flock(lock_fd, LOCK_EX) == 0);
+    tar_set_shared_lock_timeout(20);
+    index = tar_index_open_shared(locked, cache);
+    CHECK(index != NULL && test_read_index(index, "dir/c/d", "a nested file") && access(file, F_OK) == -1);
+    tar_index_free(index);
+    tar_set_shared_lock_timeout(TAR_SHARED_LOCK_TIMEOUT_MS);
+    close(lock_fd);
+    close(locked);
+
+    // The index of an empty archive is published once, then mapped.
+    int empty = test_archive("shared_empty.tar", NULL, 0);
+    test_shared_path(file, cache, empty, "");
+    tar_index_free(tar_index_open_shared(empty, cache));
+    index = tar_index_open_shared(empty, cache);
+    CHECK(index != NULL && !exists_index(index, "a") && stat(file, &st) == 0);
+    tar_index_free(index);
+    index = tar_index_open_shared(empty, cache);
+    CHECK(index != NULL && stat(file, &before) == 0 && before.st_ino == st.st_ino);
+    tar_index_free(index);
+    close(empty);
+
+    // The default directory is the user's own, and is not used once others can enter it.
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/tar-indexes-%ld", TAR_SHARED_INDEX_DIR, (long)geteuid());
+    int existed = stat(dir, &st) == 0;
+    test_shared_path(file, dir, fd, "");
+    index = tar_index_open_shared(fd, NULL);
+    CHECK(index != NULL && test_read_index(index, "d/f", "target data"));
+    CHECK(stat(dir, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0700 && unlink(file) == 0);
+    tar_index_free(index);
+    CHECK(chmod(dir, 0755) == 0);
+    index = tar_index_open_shared(fd, NULL);
+    CHECK(index != NULL && test_read_index(index, "d/f", "target data") && access(file, F_OK) == -1);
+    tar_index_free(index);
+    CHECK(chmod(dir, st.st_mode & 07777) == 0);
+    test_shared_path(lock, dir, fd, ".lock");
+    unlink(lock);
+    if (!existed) {
+        rmdir(dir);
+    }
+    close(fd);
+}
+
+static void test_advise(void) {
+    static char *paths[] = {"d/f", "missing", "d/", "chain", "dang", "late", "d/sub/g"};
+    static char *empty[] = {"dir/b", "dir/a", "dir/link", "dir/"};
+    int fd = TEST_ARCHIVE("advise.tar", test_links);
+    tar_mmap_t *archive = tar_open_mmap(test_path("advise.tar"));
+    tar_index_t *index = tar_index_build(fd);
+    const uint8_t *view;
+    size_t len;
+
+    // Advice changes how the archive is read, never what is read.
+    for (int access = TAR_ACCESS_NORMAL; access <= TAR_ACCESS_DONTNEED; access++) {
+        CHECK(tar_advise(fd, (enum tar_access)access) == 0 && test_read(fd, "chain", "target data"));
+        CHECK(tar_mmap_advise(archive, (enum tar_access)access) == 0);
+        len = 64;
+        CHECK(read_file_view(archive, "late", 0, &view, &len) == 0 && len == 22);
+        CHECK(memcmp(view, "defined after its link", 22) == 0);
+    }
+    errno = 0;
+    CHECK(tar_advise(fd, (enum tar_access)(TAR_ACCESS_DONTNEED + 1)) == -1 && errno == EINVAL);
+    errno = 0;
+    CHECK(tar_mmap_advise(archive, (enum tar_access)-1) == -1 && errno == EINVAL);
+    errno = 0;
+    CHECK(tar_advise(-1, TAR_ACCESS_SEQUENTIAL) == -1 && errno == EBADF);
+
+    // Only the files are prefetched, links resolved.
+    CHECK(tar_index_prefetch(index, paths, sizeof(paths) / sizeof(paths[0])) == 4);
+    CHECK(tar_index_prefetch(index, paths, 0) == 0 && test_read_index(index, "d/sub/g", "g"));
+    tar_index_free(index);
+    tar_close_mmap(archive);
+    close(fd);
+
+    fd = TEST_ARCHIVE("advise_empty.tar", test_tree);
+    index = tar_index_build(fd);
+    CHECK(tar_index_prefetch(index, empty, sizeof(empty) / sizeof(empty[0])) == 3);
+    tar_index_free(index);
+    close(fd);
+}
+
+static void test_lazy(void) {
+    int fd = TEST_ARCHIVE("lazy.tar", test_tree);
+    tar_index_t *unchecked, *loaded, *checked = tar_index_build(fd);
+    char **entries = test_entries();
+    uint8_t buf[32];
+    size_t len, n;
+
+    CHECK(tar_index_validate(checked) == 8);
+    // The header of dir/c/d, the sixth block, gets a bad checksum.
+    test_patch(fd, 5 * TAR_HEADER_SIZE + 148, "1", 1);
+    unchecked = tar_index_build(fd);
+    CHECK(tar_index_save(unchecked, test_path("lazy.tar.idx")) == 0);
+    loaded = tar_index_load(fd, test_path("lazy.tar.idx"));
+    CHECK(unchecked != NULL && loaded != NULL);
+
+    // Disabled, nothing is checked.
+    CHECK(exists(fd, "file") && test_read(fd, "dir/c/d", "a nested file"));
+    CHECK(test_read_index(unchecked, "dir/c/d", "a nested file"));
+
+    tar_set_lazy_validation(1);
+    // The scans stop at the first bad header they walk through, and only there.
+    CHECK(exists(fd, "dir/a") && test_read(fd, "dir/a", "hello") && is_dir(fd, "dir/c/"));
+    errno = 0;
+    CHECK(!exists(fd, "file") && errno == EBADMSG);
+    errno = 0;
+    CHECK(!is_file(fd, "dir/c/d") && errno == EBADMSG);
+    len = sizeof(buf);
+    errno = 0;
+    CHECK(read_file(fd, "file", 0, buf, &len) == -1 && errno == EBADMSG);
+    n = 16;
+    errno = 0;
+    CHECK(!list(fd, "dir/", entries, &n) && errno == EBADMSG);
+    errno = 0;
+    CHECK(tar_index_build(fd) == NULL && errno == EBADMSG);
+
+    // Reads through an index check the header of the entry as they need it.
+    for (int i = 0; i < 2; i++) {
+        tar_index_t *index = i == 0 ? unchecked : loaded;
+
+        CHECK(test_read_index(index, "dir/a", "hello") && test_read_index(index, "file", "a file at the root"));
+        len = sizeof(buf);
+        errno = 0;
+        CHECK(read_file_index(index, "dir/c/d", 0, buf, &len) == -1 && errno == EBADMSG);
+        // Lookups without a read do not need it.
+        CHECK(is_file_index(index, "dir/c/d") && exists_index(index, "dir/c/d"));
+        CHECK(tar_index_validate(index) == -3);
+    }
+    // The headers of an index validated before the header went bad are not checked again.
+    CHECK(test_read_index(checked, "dir/c/d", "a nested file"));
+    tar_set_lazy_validation(0);
+    CHECK(test_read(fd, "file", "a file at the root"));
+
+    test_patch(fd, 5 * TAR_HEADER_SIZE + 257, "USTAR", 5);
+    CHECK(tar_index_validate(unchecked) == -1);
+    tar_index_free(checked);
+    tar_index_free(unchecked);
+    tar_index_free(loaded);
+    close(fd);
+}
+
+static void test_content_hash(void) {
+    static uint8_t bytes[1024 + 1], big[3 * 1024 * 1024 + 7];
+    static const struct test_member appended[] = {{"dir/new", REGTYPE, "abc"}};
+    int fd = TEST_ARCHIVE("hash.tar", test_tree);
+    tar_index_t *index = tar_index_build(fd), *loaded;
+    uint64_t hash;
+
+    // Reference values of XXH64 with a seed of zero.
+    for (size_t i = 0; i < 1024; i++) {
+        bytes[i + 1] = (uint8_t)i;
+    }
+    CHECK(tar_content_hash("", 0) == 0xef46db3751d8e999 && tar_content_hash("a", 1) == 0xd24ec4f1a98c6e5b);
+    CHECK(tar_content_hash("abc", 3) == 0x44bc2cf5ad770999 && tar_content_hash("hello", 5) == 0x26c7827d889f6da3);
+    CHECK(tar_content_hash(bytes + 1, 1024) == 0x6f3914f18fe4df57);
+
+    errno = 0;
+    CHECK(tar_index_content_hash(index, "dir/a", &hash) == -1 && errno == ENODATA);
+    CHECK(tar_index_hash_contents(index) == 0);
+    CHECK(tar_index_content_hash(index, "dir/a", &hash) == 0 && hash == 0x26c7827d889f6da3);
+    CHECK(tar_index_content_hash(index, "dir/link", &hash) == 0 && hash == 0x26c7827d889f6da3);
+    CHECK(tar_index_content_hash(index, "dir/b", &hash) == 0 && hash == 0xef46db3751d8e999);
+    CHECK(tar_index_content_hash(index, "file", &hash) == 0 && hash == 0x860e80671f42397e);
+    static const char *const missing[] = {"missing", "dir/", "dir/c/"};
+    for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+        errno = 0;
+        CHECK(tar_index_content_hash(index, missing[i], &hash) == -1 && errno == ENOENT);
+    }
+
+    // The hashes are saved with the index, and appended files are hashed as they are added.
+    CHECK(tar_index_save(index, test_path("hash.tar.idx")) == 0);
+    loaded = tar_index_load(fd, test_path("hash.tar.idx"));
+    CHECK(tar_index_content_hash(loaded, "dir/c/d", &hash) == 0 && hash == tar_content_hash("a nested file", 13));
+    test_append_end(fd, appended, 1);
+    CHECK(tar_index_update(index) == 1 && tar_index_update(loaded) == 1);
+    CHECK(tar_index_content_hash(index, "dir/new", &hash) == 0 && hash == 0x44bc2cf5ad770999);
+    CHECK(tar_index_content_hash(loaded, "dir/new", &hash) == 0 && hash == 0x44bc2cf5ad770999);
+    tar_index_free(loaded);
+    tar_index_free(index);
+
+    // A sidecar file without hashes, loaded, has them computed.
+    index = tar_index_build(fd);
+    CHECK(tar_index_save(index, test_path("hash.tar.idx")) == 0);
+    tar_index_free(index);
+    loaded = tar_index_load(fd, test_path("hash.tar.idx"));
+    errno = 0;
+    CHECK(tar_index_content_hash(loaded, "dir/new", &hash) == -1 && errno == ENODATA);
+    CHECK(tar_index_hash_contents(loaded) == 0 && tar_index_content_hash(loaded, "dir/new", &hash) == 0);
+    CHECK(hash == 0x44bc2cf5ad770999);
+    tar_index_free(loaded);
+    close(fd);
+
+    // A file larger than the chunks of the sweep hashes as in memory.
+    for (size_t i = 0; i < sizeof(big); i++) {
+        big[i] = (uint8_t)(i * 31 + i / 4096);
+    }
+    int src = test_file("hash_big", big, sizeof(big)), small = test_file("hash_small", "abc", 3);
+    fd = open(test_path("hash_big.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *writer = tar_writer_open(fd);
+    CHECK(tar_writer_add_file(writer, "big", src) == 0 && tar_writer_add_file(writer, "small", small) == 0);
+    CHECK(tar_writer_close(writer) == 0);
+    index = tar_index_build(fd);
+    CHECK(tar_index_hash_contents(index) == 0 && tar_index_content_hash(index, "big", &hash) == 0);
+    CHECK(hash == tar_content_hash(big, sizeof(big)));
+    CHECK(tar_index_content_hash(index, "small", &hash) == 0 && hash == 0x44bc2cf5ad770999);
+    tar_index_free(index);
+    close(small);
+    close(src);
+
+    // The archive is read through the descriptor of the index.
+    index = tar_index_build(fd);
+    close(fd);
+    errno = 0;
+    CHECK(tar_index_hash_contents(index) == -1 && errno == EBADF);
+    errno = 0;
+    CHECK(tar_index_content_hash(index, "big", &hash) == -1 && errno == ENODATA);
+    tar_index_free(index);
+}
+
+/* Reads a whole file through read_file_catalog() and compares it with the expected content. */
+static int test_read_catalog(tar_catalog_t *catalog, const char *path, const char *expected) {
+    uint8_t buf[256];
+    size_t len = sizeof(buf);
+
+    return read_file_catalog(catalog, path, 0, buf, &len) == 0 && len == strlen(expected) &&
+           memcmp(buf, expected, len) == 0;
+}
+
+static void *test_catalog_reader(void *arg) {
+    int ok = 1;
+
+    for (int i = 0; i < 100; i++) {
+        ok &= test_read_catalog(arg, i % 2 ? "dir/a" : "b/only", i % 2 ? "shadowing" : "only in b");
+    }
+    return ok ? arg : NULL;
+}
+
+static void test_catalog(void) {
+    static const struct test_member b[] = {
+        {"dir/", DIRTYPE, NULL},
+        {"dir/a", REGTYPE, "shadowing"},
+        {"b/only", REGTYPE, "only in b"},
+        {"b/link", SYMTYPE, "../dir/a"},
+    };
+    static const struct test_member c[] = {{"file", AREGTYPE, "from c"}, {"dir/c/d", SYMTYPE, "../a"}};
+    char paths[3][PATH_MAX], sidecar[PATH_MAX];
+    uint8_t buf[16];
+    size_t len;
+
+    close(TEST_ARCHIVE("catalog_a.tar", test_tree));
+    int fd = TEST_ARCHIVE("catalog_b.tar", b);
+    close(TEST_ARCHIVE("catalog_c.tar", c));
+    snprintf(paths[0], sizeof(paths[0]), "%s", test_path("catalog_a.tar"));
+    snprintf(paths[1], sizeof(paths[1]), "%s", test_path("catalog_b.tar"));
+    snprintf(paths[2], sizeof(paths[2]), "%s", test_path("catalog_c.tar"));
+    snprintf(sidecar, sizeof(sidecar), "%s", test_path("catalog_b.tar.idx"));
+    tar_index_t *index = tar_index_build(fd);
+    CHECK(tar_index_save(index, sidecar) == 0);
+    tar_index_free(index);
+
+    for (int order = 0; order < 2; order++) {
+        tar_catalog_t *catalog = tar_catalog_create(order == 0 ? TAR_CATALOG_LAST_WINS : TAR_CATALOG_FIRST_WINS);
+
+        CHECK(catalog != NULL && tar_catalog_add(catalog, paths[0], NULL) == 0);
+        CHECK(tar_catalog_add(catalog, paths[1], sidecar) == 1 && tar_catalog_add(catalog, paths[2], NULL) == 2);
+        // The archive holding a path found in several is the last or the first one added.
+        CHECK(tar_catalog_which(catalog, "dir/a") == (order == 0 ? 1 : 0));
+        CHECK(tar_catalog_which(catalog, "file") == (order == 0 ? 2 : 0));
+        CHECK(tar_catalog_which(catalog, "dir/c/d") == (order == 0 ? 2 : 0));
+        CHECK(tar_catalog_which(catalog, "dir/e/") == 0 && tar_catalog_which(catalog, "b/only") == 1);
+        CHECK(tar_catalog_which(catalog, "missing") == -1 && tar_catalog_which(catalog, "dir") == -1);
+        CHECK(test_read_catalog(catalog, "dir/a", order == 0 ? "shadowing" : "hello"));
+        CHECK(test_read_catalog(catalog, "file", order == 0 ? "from c" : "a file at the root"));
+        // Links are followed inside the archive holding them.
+        CHECK(test_read_catalog(catalog, "dir/link", "hello") && test_read_catalog(catalog, "b/link", "shadowing"));
+        // The link of c to dir/a is dangling in c, whatever the other archives hold.
+        len = sizeof(buf);
+        CHECK(order == 0 ? read_file_catalog(catalog, "dir/c/d", 0, buf, &len) == -1 :
+                           test_read_catalog(catalog, "dir/c/d", "a nested file"));
+        CHECK(exists_catalog(catalog, "b/only") && exists_catalog(catalog, "dir/") && !exists_catalog(catalog, "x"));
+        CHECK(is_dir_catalog(catalog, "dir/") && !is_dir_catalog(catalog, "dir/a") && is_file_catalog(catalog, "file"));
+        CHECK(is_symlink_catalog(catalog, "b/link") && !is_file_catalog(catalog, "b/link"));
+        CHECK(is_symlink_catalog(catalog, "dir/c/d") == (order == 0));
+        len = sizeof(buf);
+        CHECK(read_file_catalog(catalog, "missing", 0, buf, &len) == -1);
+        len = sizeof(buf);
+        CHECK(read_file_catalog(catalog, "dir/", 0, buf, &len) == -1);
+        len = 2;
+        CHECK(read_file_catalog(catalog, "b/only", 1, buf, &len) == 6 && len == 2 && memcmp(buf, "nl", 2) == 0);
+        len = sizeof(buf);
+        CHECK(read_file_catalog(catalog, "b/only", 9, buf, &len) == -2);
+        tar_catalog_free(catalog);
+    }
+    tar_catalog_free(NULL);
+
+    // Reads from several threads, which open the archives as they need them.
+    tar_catalog_t *catalog = tar_catalog_create(TAR_CATALOG_LAST_WINS);
+    pthread_t threads[4];
+    void *ret;
+    int ok = 1;
+    CHECK(tar_catalog_add(catalog, paths[0], NULL) == 0 && tar_catalog_add(catalog, paths[1], NULL) == 1);
+    for (int i = 0; i < 4; i++) {
+        CHECK(pthread_create(&threads[i], NULL, test_catalog_reader, catalog) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        ok &= pthread_join(threads[i], &ret) == 0 && ret == catalog;
+    }
+    CHECK(ok);
+    tar_catalog_free(catalog);
+
+    catalog = tar_catalog_create(TAR_CATALOG_LAST_WINS);
+    errno = 0;
+    CHECK(tar_catalog_add(catalog, test_path("missing.tar"), NULL) == -1 && errno == ENOENT);
+    CHECK(tar_catalog_add(catalog, paths[0], NULL) == 0 && tar_catalog_add(catalog, paths[1], sidecar) == 1);
+    // An archive changed since it was added is not read, and a stale sidecar file is not used.
+    static const struct test_member appended[] = {{"b/new", REGTYPE, "new"}};
+    test_append_end(fd, appended, 1);
+    errno = 0;
+    len = sizeof(buf);
+    CHECK(read_file_catalog(catalog, "b/only", 0, buf, &len) == -1 && errno == ESTALE);
+    errno = 0;
+    len = sizeof(buf);
+    CHECK(read_file_catalog(catalog, "dir/a", 0, buf, &len) == -1 && errno == ESTALE);
+    CHECK(test_read_catalog(catalog, "dir/c/d", "a nested file"));
+    CHECK(tar_catalog_add(catalog, paths[1], sidecar) == 2 && test_read_catalog(catalog, "b/new", "new"));
+    CHECK(tar_catalog_which(catalog, "b/only") == 2 && test_read_catalog(catalog, "b/only", "only in b"));
+    tar_catalog_free(catalog);
+    close(fd);
+}
+
+static int test_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2) {
+        int fd = open(argv[1] , O_RDONLY);
+        if (fd == -1) {
+            perror("open(tar_file)");
+            return -1;
+        }
+
+        int ret = check_archive(fd);
+        printf("check_archive returned %d\n", ret);
+
+        return 0;
+    }
+
+    if (mkdtemp(test_dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    test_index();
+    test_mmap();
+    test_scan_chunks();
+    test_header_verify();
+    test_check_parallel();
+    test_list();
+    test_index_lookup();
+    test_iter();
+    test_link_resolution();
+    test_pread();
+    test_batch();
+    test_stream();
+    test_async();
+    test_sidecar();
+    test_update();
+    test_field();
+    test_large();
+    test_stats();
+    test_select();
+    test_long_paths();
+    test_compressed();
+    test_extract();
+    test_writer();
+    test_arena();
+    test_query();
+    test_shared();
+    test_advise();
+    test_lazy();
+    test_content_hash();
+    test_catalog();
+
+    nftw(test_dir, test_remove, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures != 0;
+}